@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "ospfs.h"
+
+/****************************************************************************
+ * allocbench
+ *
+ *   Measures the module's block allocator (ospfsalloc.h) in user space.
+ *   For each fill level, the free-block bitmap of a simulated disk is
+ *   filled from the front, the way a disk fills when files are written
+ *   and never deleted, and a run of allocations is timed.  The same run
+ *   is then timed with a linear scan of the bitmap, which is what
+ *   allocate_block did before it had the free-block summary.
+ *
+ *   Only the bitmap is simulated: ospfs_block returns blocks of an array
+ *   that holds the boot block, the superblock and the bitmap, and the
+ *   kernel helpers ospfsalloc.h uses are replaced by user-space ones.
+ *
+ ****************************************************************************/
+
+uint32_t ospfs_blksize_bits = OSPFS_MINBLKSIZE_BITS;
+static ospfs_super_t *ospfs_super;
+static uint8_t *disk;
+
+static void *
+ospfs_block(uint32_t blockno)
+{
+	return disk + (size_t) blockno * OSPFS_BLKSIZE;
+}
+
+static void
+ospfs_block_dirty(uint32_t blockno)
+{
+	(void) blockno;
+}
+
+// The bitvector operations, as in ospfsmod.c.
+static inline void
+bitvector_set(void *vector, int i)
+{
+	((uint32_t *) vector) [i / 32] |= (1 << (i % 32));
+}
+
+static inline void
+bitvector_clear(void *vector, int i)
+{
+	((uint32_t *) vector) [i / 32] &= ~(1 << (i % 32));
+}
+
+static inline int
+bitvector_test(const void *vector, int i)
+{
+	return (((const uint32_t *) vector) [i / 32] & (1 << (i % 32))) != 0;
+}
+
+#define DEFINE_SPINLOCK(lock)	int lock
+#define spin_lock(lock)		((void) (lock))
+#define spin_unlock(lock)	((void) (lock))
+#define vmalloc(size)		malloc(size)
+#define vfree(ptr)		free(ptr)
+#define hweight32(w)		__builtin_popcount(w)
+#define __ffs(w)		__builtin_ctz(w)
+
+static int freemap_summary_init(void);
+static void freemap_summary_destroy(void);
+
+#include "ospfsalloc.h"
+
+// linear_allocate_block()
+//	The old allocate_block: tests one bit at a time from the start of the
+//	bitmap.
+static uint32_t
+linear_allocate_block(void)
+{
+	uint32_t *freemap = ospfs_block(OSPFS_FREEMAP_BLK);
+	uint32_t i;
+
+	for (i = OSPFS_FREEMAP_BLK; i < ospfs_super->os_nblocks; i++)
+		if (bitvector_test(freemap, i)) {
+			bitvector_clear(freemap, i);
+			return i;
+		}
+	return 0;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// fill(nused)
+//	Makes the first 'nused' blocks allocated and the rest free, and
+//	rebuilds the free-block summary.
+static void
+fill(uint32_t nused)
+{
+	uint32_t *freemap = ospfs_block(OSPFS_FREEMAP_BLK);
+	uint32_t i, nbitmap = (ospfs_super->os_nblocks + OSPFS_BLKBITSIZE - 1)
+		/ OSPFS_BLKBITSIZE;
+
+	memset(freemap, 0, (size_t) nbitmap * OSPFS_BLKSIZE);
+	for (i = nused; i < ospfs_super->os_nblocks; i++)
+		bitvector_set(freemap, i);
+	freemap_summary_destroy();
+	if (freemap_summary_init() < 0) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+}
+
+// time_allocs(allocate, nallocs)
+//	Returns the average time, in nanoseconds, of 'nallocs' calls to
+//	'allocate'.  The blocks stay allocated.
+static double
+time_allocs(uint32_t (*allocate)(void), uint32_t nallocs)
+{
+	double start = now();
+	uint32_t i;
+
+	for (i = 0; i < nallocs; i++)
+		if (allocate() == 0) {
+			fprintf(stderr, "disk full\n");
+			exit(1);
+		}
+	return (now() - start) * 1e9 / nallocs;
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "Usage: allocbench [-b BLKSIZE] [-n NBLOCKS] [-a NALLOCS]\n\
+  \"-b BLKSIZE\" means simulate BLKSIZE-byte blocks (default 1024).\n\
+  \"-n NBLOCKS\" means simulate a disk of NBLOCKS blocks (default 1048576).\n\
+  \"-a NALLOCS\" means time NALLOCS allocations per fill level (default 1000).\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const double fills[] = {
+		0, 25, 50, 75, 90, 95, 99, 99.9
+	};
+	long blksize = 1024, nblocks = 1 << 20, nallocs = 1000;
+	long *opt;
+	char *s;
+	uint32_t nbitmap;
+	size_t i;
+
+	while (argc > 2 && argv[1][0] == '-' && strlen(argv[1]) == 2) {
+		if (argv[1][1] == 'b')
+			opt = &blksize;
+		else if (argv[1][1] == 'n')
+			opt = &nblocks;
+		else if (argv[1][1] == 'a')
+			opt = &nallocs;
+		else
+			usage();
+		*opt = strtol(argv[2], &s, 0);
+		if (*s || s == argv[2] || *opt < 1)
+			usage();
+		argc -= 2, argv += 2;
+	}
+	if (argc != 1)
+		usage();
+	for (ospfs_blksize_bits = OSPFS_MINBLKSIZE_BITS;
+	     ospfs_blksize_bits < OSPFS_MAXBLKSIZE_BITS
+		     && OSPFS_BLKSIZE < blksize; ospfs_blksize_bits++)
+		/* do nothing */;
+	if (OSPFS_BLKSIZE != blksize || nblocks > (1L << 30)) {
+		fprintf(stderr, "allocbench: bad block size or disk size\n");
+		exit(2);
+	}
+
+	nbitmap = (nblocks + OSPFS_BLKBITSIZE - 1) / OSPFS_BLKBITSIZE;
+	if (!(disk = calloc(OSPFS_FREEMAP_BLK + nbitmap, OSPFS_BLKSIZE))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	ospfs_super = (ospfs_super_t *) ospfs_block(1);
+	ospfs_super->os_nblocks = nblocks;
+
+	printf("%ld blocks of %ld bytes, %ld allocations per fill level\n",
+	       nblocks, blksize, nallocs);
+	printf("%8s %16s %16s\n", "full %", "summary ns/alloc", "linear ns/alloc");
+	for (i = 0; i < sizeof(fills) / sizeof(fills[0]); i++) {
+		uint32_t nused = nblocks * fills[i] / 100;
+		double summary, linear;
+
+		if (nused < OSPFS_FREEMAP_BLK + nbitmap)
+			nused = OSPFS_FREEMAP_BLK + nbitmap;
+		if (nused + nallocs > (uint32_t) nblocks)
+			break;
+		fill(nused);
+		summary = time_allocs(allocate_block, nallocs);
+		fill(nused);
+		linear = time_allocs(linear_allocate_block, nallocs);
+		printf("%8.1f %16.1f %16.1f\n", fills[i], summary, linear);
+	}
+	return 0;
+}
@@ -6,12 +6,30 @@
  * BLOCKS
  *
  *   The OSPFS format divides disk data into a series of blocks,
- *   where each block contains 'OSPFS_BLKSIZE' bytes (1024 bytes)
+ *   where each block contains 'OSPFS_BLKSIZE' bytes
  *   and 'OSPFS_BLKBITSIZE' bits.
  *
+ *   The block size is a power of two from 1KB to 64KB, chosen when the
+ *   file system is created (ospfsformat's "-b" option) and recorded in the
+ *   superblock.  So OSPFS_BLKSIZE_BITS is not a constant: it is the
+ *   variable 'ospfs_blksize_bits', which the module and the tools set from
+ *   the superblock when they open a file system.  Everything computed from
+ *   it, like OSPFS_NINDIRECT, changes with it.
+ *
+ *   The module reads a file system on a block device through the Linux
+ *   buffer cache, whose blocks are at most a page, so it mounts devices
+ *   only with blocks no bigger than the page size (4KB on most machines).
+ *   Larger blocks work for images built into the module.
+ *
  *****************************************************************************/
-#define OSPFS_BLKSIZE_BITS  10
-#define OSPFS_BLKSIZE       (1 << OSPFS_BLKSIZE_BITS) /* == 1024 */
+#define OSPFS_MINBLKSIZE_BITS 10
+#define OSPFS_MAXBLKSIZE_BITS 16
+#define OSPFS_MAXBLKSIZE    (1 << OSPFS_MAXBLKSIZE_BITS)
+
+extern uint32_t ospfs_blksize_bits;
+
+#define OSPFS_BLKSIZE_BITS  ospfs_blksize_bits
+#define OSPFS_BLKSIZE       (1 << OSPFS_BLKSIZE_BITS)
 #define OSPFS_BLKBITSIZE    (OSPFS_BLKSIZE * 8)
 
 
@@ -34,7 +52,15 @@
  *      (The file's name, however, is stored elsewhere.)
  *      Each file and directory on the disk corresponds to an inode.
  *      All inodes are stored in the inode blocks.
- *   4. The rest of the disk consists of DATA BLOCKS.
+ *   4. REFERENCE COUNTS.  An optional table of 's_nref' blocks, starting
+ *      at 's_refb', right after the inode blocks (see SHARED BLOCKS below).
+ *      ospfsformat's "-d" option creates it; it is 0 blocks long if the
+ *      file system has no shared blocks.
+ *   5. JOURNAL.  An optional region of 's_njournal' blocks, starting at
+ *      's_journalb', right after the reference counts (see JOURNAL below).
+ *      Its size is chosen by ospfsformat's "-j" option; it is 0 if the
+ *      file system has no journal.
+ *   6. The rest of the disk consists of DATA BLOCKS.
  *      Each data block belongs to a normal file or to a directory.
  *      Directory data blocks consist of sequences of directory entry
  *      structures, which refer to inodes.
@@ -43,15 +69,23 @@
  *
  *   |<--------------------------    N blocks    --------------------------->|
  *   |                                                                       |
- *   +------+-------+------------+-------------+-----------------------------+
- *   | boot | super | free block |    inode    |           data              |
- *   | stuff| block |   bitmap   |    blocks   |           blocks            |
- *   +------+-------+------------+-------------+-----------------------------+
- * Block 0      1      2 to X-1      X to Y-1             Y to N-1
- *                    (enough to    (enough to
- *                   hold N bits)  hold M inodes)
+ *   +------+-------+------------+-----------+--------+---------+-------------+
+ *   | boot | super | free block |   inode   | ref-   | journal |    data     |
+ *   | stuff| block |   bitmap   |   blocks  | counts |         |    blocks   |
+ *   +------+-------+------------+-----------+--------+---------+-------------+
+ * Block 0      1      2 to X-1     X to R-1   R to Y-1 Y to Z-1    Z to N-1
+ *                    (enough to   (enough to
+ *                   hold N bits) hold M inodes)
+ *
+ *   where X equals the superblock's "s_firstinob" member, R and Y-R equal
+ *   "s_refb" and "s_nref", and Y and Z-Y equal "s_journalb" and
+ *   "s_njournal".
  *
- *   where X equals the superblock's "s_firstinob" member.
+ *   The superblock is at byte offset OSPFS_BLKSIZE, which depends on the
+ *   block size.  To find it, try each block size: the right one has
+ *   OSPFS_MAGIC at that offset and "s_blksize_bits" equal to its log2.
+ *   (File systems from before the block size was configurable have
+ *   "s_blksize_bits" 0, meaning 1KB blocks.)
  *
  *****************************************************************************/
 
@@ -66,9 +100,111 @@ typedef struct ospfs_super {
 	uint32_t os_nblocks;   // Number of blocks on disk
 	uint32_t os_ninodes;   // Number of inodes on disk
 	uint32_t os_firstinob; // First inode block
+	uint32_t os_journalb;  // First journal block
+	uint32_t os_njournal;  // Number of journal blocks (0 if none)
+	uint32_t os_blksize_bits; // log2(block size); 0 means 10
+	uint32_t os_refb;      // First reference count block
+	uint32_t os_nref;      // Number of reference count blocks (0 if none)
 } ospfs_super_t;
 
 
+/*****************************************************************************
+ * SHARED BLOCKS
+ *
+ *   A data block of a regular file may belong to several files, or appear
+ *   several times in one file, if they hold the same data there.
+ *   ospfsformat's "-d" option stores each distinct block of data once.
+ *   The REFERENCE COUNT table records how many extra block pointers or
+ *   extents name each block: it is an array of 32-bit counts, one per
+ *   block on the disk, starting at block 's_refb'.  A count of 0 means the
+ *   block has at most one owner, which is always true of free blocks,
+ *   metadata blocks, directory blocks, and indirect and extent blocks.
+ *
+ *   A shared block is COPY-ON-WRITE: a file that changes it first copies
+ *   it to a block of its own, points its block map at the copy, and
+ *   decrements the original's count.  Freeing a shared block decrements
+ *   its count instead of marking it free.
+ *
+ *   The table is metadata, so it is journaled.  File systems without the
+ *   table (older images have 0 in 's_nref') never share blocks.
+ *
+ *   The module's OSPFS_IOC_CLONE ioctl, issued on an empty regular file
+ *   open for writing with the descriptor of another file on the same file
+ *   system as its argument, makes the empty file a CLONE of the other: it
+ *   shares all of the other file's data blocks, and gets its own copies of
+ *   the indirect or extent blocks.  The request number is the one Linux
+ *   uses for FICLONE, so "cp --reflink" can use it.
+ *
+ *   A clone is cheaper than a copy, but it does not take constant time:
+ *   it copies every indirect or extent block and updates the count of
+ *   every data block, so its cost grows with the size of the file.  It is
+ *   one journal operation, so a file whose clone would change more blocks
+ *   than the journal holds can't be cloned (the ioctl fails with EFBIG).
+ *
+ *****************************************************************************/
+// Number of reference counts in a reference count block.
+#define OSPFS_BLKREFS		(OSPFS_BLKSIZE / 4)
+
+// Clone request (see above).  Needs <linux/ioctl.h> or <sys/ioctl.h>.
+#define OSPFS_IOC_CLONE		_IOW(0x94, 9, int)
+
+
+/*****************************************************************************
+ * JOURNAL
+ *
+ *   Mounted from a block device, OSPFS writes changed metadata blocks
+ *   (the free block bitmap, inode blocks, reference counts, directory
+ *   blocks, and indirect and extent blocks) to the journal before it writes them in place, so
+ *   a crash can't leave an operation half done.  The journal holds at
+ *   most one transaction:
+ *
+ *   - Journal block 0 is a DESCRIPTOR: an 'ospfs_journal_header' of type
+ *     OSPFS_JOURNAL_DESCRIPTOR, listing the home block numbers of the
+ *     transaction's 'oj_nblocks' blocks.
+ *   - Journal blocks 1 to oj_nblocks hold the new contents of those blocks,
+ *     in order.
+ *   - Journal block oj_nblocks + 1 is the COMMIT block: a header of type
+ *     OSPFS_JOURNAL_COMMIT with the descriptor's 'oj_seq', and a checksum
+ *     of the descriptor and the logged blocks.
+ *
+ *   The commit block is written only after the rest of the transaction is
+ *   on disk.  At mount, if the commit block matches the descriptor and
+ *   the checksum is right, the logged blocks are copied to their homes
+ *   again.  Replaying a transaction twice is harmless, so the journal is
+ *   never cleared.
+ *
+ *   File data is not journaled, but it is written before the transaction
+ *   that makes it part of a file commits.
+ *
+ *   An operation is never split between transactions, so the journal
+ *   must hold at least OSPFS_JOURNAL_MINBLOCKS blocks.  A change too big
+ *   for one transaction, like truncating a large file, is made as a
+ *   series of smaller operations, each of which leaves the file whole.
+ *
+ *****************************************************************************/
+#define OSPFS_JOURNAL_MAGIC	0x013101AF
+
+#define OSPFS_JOURNAL_DESCRIPTOR 1
+#define OSPFS_JOURNAL_COMMIT	 2
+
+// Maximum number of blocks in a transaction.
+#define OSPFS_JOURNAL_MAXBLOCKS	((OSPFS_BLKSIZE - 20) / 4)
+
+// Minimum size of the journal, in blocks.
+#define OSPFS_JOURNAL_MINBLOCKS	128
+
+typedef struct ospfs_journal_header {
+	uint32_t oj_magic;	// Magic number: OSPFS_JOURNAL_MAGIC
+	uint32_t oj_type;	// OSPFS_JOURNAL_DESCRIPTOR or _COMMIT
+	uint32_t oj_seq;	// Transaction sequence number
+	uint32_t oj_nblocks;	// Number of blocks in the transaction
+	uint32_t oj_checksum;	// Commit only: CRC32 of the logged blocks,
+				// then the descriptor
+	uint32_t oj_blocknos[];	// Descriptor only: home block numbers,
+				// up to OSPFS_JOURNAL_MAXBLOCKS
+} ospfs_journal_header_t;
+
+
 /*****************************************************************************
  * INODES
  *
@@ -99,18 +235,27 @@ typedef struct ospfs_super {
 	(OSPFS_NDIRECT					  /* direct blocks */ \
 	 + OSPFS_NINDIRECT	    /* blocks pointed to by indirect block */ \
 	 + OSPFS_NINDIRECT * OSPFS_NINDIRECT)   /* ... by indirect^2 block */
-// Maximum file size.
-#define OSPFS_MAXFILESIZE	(OSPFS_MAXFILEBLKS * OSPFS_BLKSIZE)
+// Maximum file size.  'oi_size' is 32 bits wide, which limits large
+// block sizes.
+#define OSPFS_MAXFILESIZE	\
+	((uint64_t) OSPFS_MAXFILEBLKS * OSPFS_BLKSIZE < 0xFFFFFFFFU	\
+	 ? (uint64_t) OSPFS_MAXFILEBLKS * OSPFS_BLKSIZE : 0xFFFFFFFFU)
+// Maximum size of an extent-mapped file, which has a 64-bit size and
+// 32-bit file block numbers (see EXTENT-MAPPED INODES below).
+#define OSPFS_MAXXFILESIZE	((uint64_t) 0xFFFFFFFFU << OSPFS_BLKSIZE_BITS)
 
 // File type constants for 'struct ospfs_inode's 'i_ftype' member.
 #define OSPFS_FTYPE_REG		0  // Regular file
 #define OSPFS_FTYPE_DIR		1  // Directory
 #define OSPFS_FTYPE_SYMLINK	2  // Symbolic link
+#define OSPFS_FTYPE_XREG	3  // Regular file, extent-mapped
 
 // Inode number for the root directory.
 #define OSPFS_ROOT_INO		1
 
-// OSPFS's inode structure.
+// OSPFS's inode structure.  An inode with link count 0 is free.  A
+// regular file unlinked while it is still open keeps its size and blocks
+// until it is closed, or, after a crash, until the next mount frees them.
 typedef struct ospfs_inode {
 	uint32_t oi_size;                   // File size
 	uint32_t oi_ftype;                  // OSPFS_FTYPE_* constant
@@ -170,6 +315,73 @@ typedef struct ospfs_symlink_inode {
 } ospfs_symlink_inode_t;
 
 
+/*****************************************************************************
+ * EXTENT-MAPPED INODES
+ *
+ *   A regular file whose inode has type OSPFS_FTYPE_XREG stores its block
+ *   map as a list of EXTENTS instead of direct and indirect block pointers.
+ *   An extent maps 'oe_len' consecutive file blocks, starting at file block
+ *   'oe_lblock', to 'oe_len' consecutive disk blocks starting at
+ *   'oe_pblock'.  A file laid out contiguously on disk needs one extent,
+ *   however big it is.
+ *
+ *   Extents are sorted by 'oe_lblock' and never overlap.  The first
+ *   OSPFS_NIEXTENTS extents are stored in the inode itself.  The rest spill
+ *   into a chain of EXTENT BLOCKS, starting at 'oi_extblock'; each extent
+ *   block holds up to OSPFS_NBEXTENTS extents and the number of its next
+ *   extent block (0 at the end of the chain).  'oi_nextents' counts all the
+ *   file's extents, in the inode and in extent blocks.
+ *
+ *   The extent blocks form a list, not a tree.  Finding the extent for a
+ *   block walks the chain from its head, checking only the last extent
+ *   of each block, then binary-searches the block that holds it, so a
+ *   lookup costs one block read per extent block before it.  A chain
+ *   block holds OSPFS_NBEXTENTS extents (127 with 1KB blocks), so the
+ *   chain stays short unless a file is badly fragmented, and sequential
+ *   access mostly hits the module's block-map cursor instead.  A tree
+ *   would make random access to a very fragmented file cheaper, at the
+ *   cost of a more complicated format.
+ *
+ *   Extent-mapped files are also the large-file format.  'oi_size_hi'
+ *   holds the upper 32 bits of the file size, so an extent-mapped file may
+ *   grow to OSPFS_MAXXFILESIZE (2^32 - 1 blocks); a direct/indirect-mapped
+ *   file is limited to OSPFS_MAXFILESIZE.  Older images have 0 there.
+ *
+ *   We use a separate type of inode structure to represent this, namely
+ *   'struct ospfs_extent_inode'.
+ *
+ *****************************************************************************/
+
+typedef struct ospfs_extent {
+	uint32_t oe_lblock;		// First file block in the extent
+	uint32_t oe_pblock;		// Disk block holding file block oe_lblock
+	uint32_t oe_len;		// Number of blocks in the extent
+} ospfs_extent_t;
+
+// Number of extents stored in the inode.
+#define OSPFS_NIEXTENTS		3
+// Number of extents stored in an extent block.
+#define OSPFS_NBEXTENTS		((OSPFS_BLKSIZE - 8) / sizeof(ospfs_extent_t))
+
+typedef struct ospfs_extent_inode {
+	uint32_t oi_size;		    // File size (low 32 bits)
+	uint32_t oi_ftype;		    // == OSPFS_FTYPE_XREG
+	uint32_t oi_nlink;		    // Link count (0 means free)
+	uint32_t oi_mode;		    // File permissions mode
+
+	uint32_t oi_nextents;		    // Total number of extents
+	uint32_t oi_extblock;		    // First extent block, or 0
+	ospfs_extent_t oi_extents[OSPFS_NIEXTENTS]; // First extents
+	uint32_t oi_size_hi;		    // File size (high 32 bits)
+} ospfs_extent_inode_t;
+
+typedef struct ospfs_extent_block {
+	uint32_t oeb_nextents;		    // Number of extents in this block
+	uint32_t oeb_next;		    // Next extent block, or 0
+	ospfs_extent_t oeb_extents[];	    // OSPFS_NBEXTENTS of them
+} ospfs_extent_block_t;
+
+
 /*****************************************************************************
  * DIRECTORY ENTRIES
  *
@@ -0,0 +1,223 @@
+#ifndef OSPFSALLOC_H
+#define OSPFSALLOC_H
+
+/*****************************************************************************
+ * ospfsalloc.h
+ *
+ *   The free-block allocator.  ospfsmod.c includes this file after it
+ *   defines 'ospfs_super', ospfs_block and ospfs_block_dirty; allocbench.c
+ *   includes it in user space, with stand-ins for those and for the kernel
+ *   helpers used here, to measure allocation speed.
+ *
+ ****************************************************************************/
+
+// The free-block summary
+//	Scanning the free-block bitmap one bit at a time makes allocate_block
+//	linear in the size of the disk.  Instead we keep two in-memory
+//	summaries of the bitmap, built at mount time:
+//
+//	- 'freemap_summary' has one bit per 32-bit bitmap word.  The bit is 1
+//	  if that word contains at least one free block.
+//	- 'freemap_nfree' counts the free blocks described by each bitmap
+//	  block, so full bitmap blocks can be skipped without looking at them.
+//
+//	'freemap_hint' is the first bitmap block that might contain a free
+//	block.  Every bitmap block before it is full.
+//
+//	allocate_block and free_block keep the summaries in sync with the
+//	on-disk bitmap.  'freemap_lock' protects the bitmap, the summaries
+//	and 'blockmap_gen'.
+
+// Number of 32-bit words in a bitmap block.
+#define FREEMAP_BLKWORDS	(OSPFS_BLKSIZE / 4)
+// Number of 'freemap_summary' words covering one bitmap block.
+#define FREEMAP_SUMMARYWORDS	(FREEMAP_BLKWORDS / 32)
+
+static DEFINE_SPINLOCK(freemap_lock);
+static uint32_t *freemap_summary;
+static uint32_t *freemap_nfree;
+static uint32_t freemap_nblocks;	// Number of bitmap blocks
+static uint32_t freemap_hint;
+
+// freemap_summary_init()
+//	Builds the free-block summary from the on-disk bitmap.
+//
+//   Returns: 0 on success, -ENOMEM if the summary can't be allocated.
+
+static inline int
+freemap_summary_init(void)
+{
+	uint32_t *freemap = ospfs_block(OSPFS_FREEMAP_BLK);
+	uint32_t w;
+
+	freemap_nblocks = (ospfs_super->os_nblocks + OSPFS_BLKBITSIZE - 1)
+		/ OSPFS_BLKBITSIZE;
+	freemap_summary = vmalloc(freemap_nblocks * FREEMAP_SUMMARYWORDS * 4);
+	freemap_nfree = vmalloc(freemap_nblocks * 4);
+	if (!freemap_summary || !freemap_nfree) {
+		freemap_summary_destroy();
+		return -ENOMEM;
+	}
+	memset(freemap_summary, 0, freemap_nblocks * FREEMAP_SUMMARYWORDS * 4);
+	memset(freemap_nfree, 0, freemap_nblocks * 4);
+
+	for (w = 0; w < freemap_nblocks * FREEMAP_BLKWORDS; w++)
+		if (freemap[w]) {
+			bitvector_set(freemap_summary, w);
+			freemap_nfree[w / FREEMAP_BLKWORDS] += hweight32(freemap[w]);
+		}
+
+	freemap_hint = 0;
+	return 0;
+}
+
+// freemap_summary_destroy()
+//	Frees the free-block summary.
+
+static inline void
+freemap_summary_destroy(void)
+{
+	vfree(freemap_summary);
+	vfree(freemap_nfree);
+	freemap_summary = freemap_nfree = NULL;
+}
+
+
+// find_free_block()
+//	Returns the lowest-numbered free block, or 0 if the disk is full.
+//	The block is not allocated.
+//
+//	The search uses the free-block summary: it skips full bitmap blocks
+//	using 'freemap_nfree', then finds the first non-full bitmap word and
+//	the first free bit in that word with find-first-set.
+//	The caller must hold 'freemap_lock'.
+
+static inline uint32_t
+find_free_block(void)
+{
+	uint32_t *freemap = ospfs_block(OSPFS_FREEMAP_BLK);
+	uint32_t b, s, w, i;
+
+	while (freemap_hint < freemap_nblocks
+	       && freemap_nfree[freemap_hint] == 0)
+		freemap_hint++;
+
+	for (b = freemap_hint; b < freemap_nblocks; b++) {
+		if (freemap_nfree[b] == 0)
+			continue;
+		for (s = b * FREEMAP_SUMMARYWORDS;
+		     s < (b + 1) * FREEMAP_SUMMARYWORDS; s++) {
+			if (freemap_summary[s] == 0)
+				continue;
+
+			w = s * 32 + __ffs(freemap_summary[s]);
+			i = w * 32 + __ffs(freemap[w]);
+			return (i < ospfs_super->os_nblocks ? i : 0);
+		}
+	}
+	return 0;
+}
+
+// claim_block(blockno)
+//	Marks the free block 'blockno' as allocated in the free-block bitmap
+//	and in the free-block summary.  The caller must hold 'freemap_lock'.
+
+static inline void
+claim_block(uint32_t blockno)
+{
+	uint32_t *freemap = ospfs_block(OSPFS_FREEMAP_BLK);
+
+	bitvector_clear(freemap, blockno);
+	if (freemap[blockno / 32] == 0)
+		bitvector_clear(freemap_summary, blockno / 32);
+	freemap_nfree[blockno / OSPFS_BLKBITSIZE]--;
+	ospfs_block_dirty(OSPFS_FREEMAP_BLK + blockno / OSPFS_BLKBITSIZE);
+}
+
+
+// release_block(blockno)
+//	Marks the allocated block 'blockno' as free in the free-block bitmap
+//	and in the free-block summary.  The caller must hold 'freemap_lock'.
+
+static inline void
+release_block(uint32_t blockno)
+{
+	uint32_t *freemap = ospfs_block(OSPFS_FREEMAP_BLK);
+	uint32_t b = blockno / OSPFS_BLKBITSIZE;
+
+	bitvector_set(freemap, blockno);
+	bitvector_set(freemap_summary, blockno / 32);
+	freemap_nfree[b]++;
+	if (b < freemap_hint)
+		freemap_hint = b;
+	ospfs_block_dirty(OSPFS_FREEMAP_BLK + b);
+}
+
+
+// allocate_block()
+//	Use this function to allocate a block.
+//
+//   Inputs:  none
+//   Returns: block number of the allocated block,
+//	      or 0 if the disk is full
+//
+//   This function searches the free-block bitmap, which starts at Block 2, for
+//   a free block, allocates it (by marking it non-free), and returns the block
+//   number to the caller.  The block itself is not touched.
+//
+//   Note:  A value of 0 for a bit indicates the corresponding block is
+//      allocated; a value of 1 indicates the corresponding block is free.
+
+static inline uint32_t
+allocate_block(void)
+{
+	uint32_t blockno;
+
+	spin_lock(&freemap_lock);
+	if ((blockno = find_free_block()) != 0)
+		claim_block(blockno);
+	spin_unlock(&freemap_lock);
+	return blockno;
+}
+
+
+// allocate_blocks(n, hint, count)
+//	Use this function to allocate a contiguous run of blocks.
+//
+//   Inputs:  n     -- the maximum number of blocks wanted
+//	      hint  -- preferred first block of the run (for example, the
+//		       block after a file's current last block), or 0
+//	      count -- set to the number of blocks in the returned run
+//   Returns: block number of the first block in the run,
+//	      or 0 if the disk is full
+//
+//   The run starts at 'hint' if that block is free, and at the first free
+//   block on the disk otherwise.  It is extended while the following blocks
+//   are free, up to 'n' blocks, so '*count' may be less than 'n'.  As with
+//   allocate_block, the blocks themselves are not touched.
+
+static inline uint32_t
+allocate_blocks(uint32_t n, uint32_t hint, uint32_t *count)
+{
+	uint32_t *freemap = ospfs_block(OSPFS_FREEMAP_BLK);
+	uint32_t start, i;
+
+	spin_lock(&freemap_lock);
+	if (hint != 0 && hint < ospfs_super->os_nblocks
+	    && bitvector_test(freemap, hint))
+		start = hint;
+	else if ((start = find_free_block()) == 0) {
+		spin_unlock(&freemap_lock);
+		return 0;
+	}
+
+	for (i = start; i < ospfs_super->os_nblocks && i - start < n
+		     && bitvector_test(freemap, i); i++)
+		claim_block(i);
+	spin_unlock(&freemap_lock);
+
+	*count = i - start;
+	return start;
+}
+
+#endif
@@ -0,0 +1,479 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "ospfs.h"
+
+/****************************************************************************
+ * ospfsck
+ *
+ *   Checks an OSPFS image made by ospfsformat (or written by the module).
+ *   Walks every inode's block map, rebuilds the free block bitmap, the
+ *   link counts and the block reference counts the image should have, and
+ *   reports where the image disagrees.
+ *
+ *   The image is mapped with mmap, and the inode table is divided among
+ *   worker threads.  Workers take inodes in chunks from a shared counter,
+ *   so one huge file doesn't leave the other threads idle, and record
+ *   block use and directory references with atomic operations.
+ *
+ *   Like the module, ospfsck assumes a little-endian host.
+ *
+ ****************************************************************************/
+
+// Inodes a worker takes at a time.
+#define CHUNK		64
+
+uint32_t ospfs_blksize_bits;
+uint8_t *disk;
+uint32_t nblocks;
+uint32_t ninodes;
+uint32_t firstdatab;		// First block that may belong to a file
+struct ospfs_super *super;
+int verbose = 0;
+
+uint32_t *used;			// Expected bitmap: 1 means in use
+uint32_t *refs;			// On-disk reference counts, or NULL
+uint32_t *nuses;		// Block pointers naming each block, if 'refs'
+uint32_t *nrefs;		// Directory entries naming each inode
+uint32_t nextchunk;		// Next inode for a worker to take
+unsigned long nproblems;
+pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+problem(const char *format, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&report_lock);
+	va_start(ap, format);
+	vprintf(format, ap);
+	va_end(ap);
+	nproblems++;
+	pthread_mutex_unlock(&report_lock);
+}
+
+static inline void *
+block(uint32_t bno)
+{
+	return disk + (size_t) bno * OSPFS_BLKSIZE;
+}
+
+static inline struct ospfs_inode *
+inode(uint32_t ino)
+{
+	return (struct ospfs_inode *) block(super->os_firstinob) + ino;
+}
+
+// Mark block 'bno' as used by inode 'ino'.
+// Return 0 if 'bno' can't belong to a file, so the caller shouldn't read it.
+int
+markblock(uint32_t ino, uint32_t bno, const char *what)
+{
+	uint32_t bit;
+
+	if (bno < firstdatab || bno >= nblocks) {
+		problem("inode %u: %s block %u out of range\n", ino, what, bno);
+		return 0;
+	}
+	bit = 1U << (bno % 32);
+	if (refs) {
+		// a data block may be shared, as often as its count says
+		uint32_t n = __sync_fetch_and_add(&nuses[bno], 1);
+		__sync_fetch_and_or(&used[bno / 32], bit);
+		if (refs[bno] != 0 && strcmp(what, "data") != 0)
+			problem("inode %u: %s block %u has reference count %u\n", ino, what, bno, refs[bno]);
+		else if (n > refs[bno])
+			problem("inode %u: %s block %u is used more than once\n", ino, what, bno);
+	} else if (__sync_fetch_and_or(&used[bno / 32], bit) & bit)
+		problem("inode %u: %s block %u is used more than once\n", ino, what, bno);
+	return 1;
+}
+
+// Mark the blocks of direct/indirect-mapped inode 'ino', and store the
+// number of its 'n'th block in 'map[n]' for walkdir.
+void
+markblockmap(uint32_t ino, struct ospfs_inode *oi, uint32_t nblk, uint32_t *map)
+{
+	uint32_t i, j, n = 0;
+	uint32_t *indir, *indir2;
+
+	for (i = 0; i < OSPFS_NDIRECT && n < nblk; i++, n++)
+		if (markblock(ino, oi->oi_direct[i], "data"))
+			map[n] = oi->oi_direct[i];
+	if (n == nblk)
+		return;
+
+	if (!markblock(ino, oi->oi_indirect, "indirect"))
+		return;
+	indir = block(oi->oi_indirect);
+	for (i = 0; i < OSPFS_NINDIRECT && n < nblk; i++, n++)
+		if (markblock(ino, indir[i], "data"))
+			map[n] = indir[i];
+	if (n == nblk)
+		return;
+
+	if (!markblock(ino, oi->oi_indirect2, "doubly indirect"))
+		return;
+	indir2 = block(oi->oi_indirect2);
+	for (j = 0; j < OSPFS_NINDIRECT && n < nblk; j++) {
+		if (!markblock(ino, indir2[j], "indirect")) {
+			n += OSPFS_NINDIRECT;
+			continue;
+		}
+		indir = block(indir2[j]);
+		for (i = 0; i < OSPFS_NINDIRECT && n < nblk; i++, n++)
+			if (markblock(ino, indir[i], "data"))
+				map[n] = indir[i];
+	}
+}
+
+// Check and mark one extent of extent-mapped inode 'ino'.
+void
+markextent(uint32_t ino, struct ospfs_extent *e, uint32_t nblk, uint32_t *next, uint32_t *map)
+{
+	uint32_t i;
+
+	if (e->oe_lblock != *next)
+		problem("inode %u: extent at file block %u, expected %u\n", ino, e->oe_lblock, *next);
+	if (e->oe_len == 0 || e->oe_lblock + e->oe_len > nblk
+	    || e->oe_lblock + e->oe_len < e->oe_lblock) {
+		problem("inode %u: bad extent (%u, %u, %u)\n", ino, e->oe_lblock, e->oe_pblock, e->oe_len);
+		return;
+	}
+	for (i = 0; i < e->oe_len; i++)
+		if (markblock(ino, e->oe_pblock + i, "data"))
+			map[e->oe_lblock + i] = e->oe_pblock + i;
+	*next = e->oe_lblock + e->oe_len;
+}
+
+// Mark the blocks of extent-mapped inode 'ino'.
+void
+markextents(uint32_t ino, struct ospfs_extent_inode *xi, uint32_t nblk, uint32_t *map)
+{
+	uint32_t i, n = 0, next = 0, xbno;
+	struct ospfs_extent_block *xb;
+
+	for (i = 0; i < xi->oi_nextents && i < OSPFS_NIEXTENTS; i++, n++)
+		markextent(ino, &xi->oi_extents[i], nblk, &next, map);
+	for (xbno = xi->oi_extblock; xbno != 0 && n < xi->oi_nextents; xbno = xb->oeb_next) {
+		if (!markblock(ino, xbno, "extent"))
+			break;
+		xb = block(xbno);
+		if (xb->oeb_nextents > OSPFS_NBEXTENTS) {
+			problem("inode %u: extent block %u holds %u extents\n", ino, xbno, xb->oeb_nextents);
+			break;
+		}
+		for (i = 0; i < xb->oeb_nextents; i++, n++)
+			markextent(ino, &xb->oeb_extents[i], nblk, &next, map);
+	}
+	if (n != xi->oi_nextents)
+		problem("inode %u: has %u extents, expected %u\n", ino, n, xi->oi_nextents);
+	if (next != nblk)
+		problem("inode %u: extents map %u blocks, size needs %u\n", ino, next, nblk);
+}
+
+// Count the references made by directory 'ino', whose blocks are 'map'.
+void
+walkdir(uint32_t ino, struct ospfs_inode *oi, uint32_t nblk, uint32_t *map)
+{
+	uint32_t n, off;
+	struct ospfs_direntry *od;
+
+	if (oi->oi_size % OSPFS_DIRENTRY_SIZE != 0)
+		problem("inode %u: directory size %u is not a multiple of %d\n", ino, oi->oi_size, OSPFS_DIRENTRY_SIZE);
+	for (n = 0; n < nblk; n++) {
+		if (map[n] == 0)
+			continue;
+		for (off = 0; off < OSPFS_BLKSIZE && n * OSPFS_BLKSIZE + off < oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
+			od = (struct ospfs_direntry *) ((uint8_t *) block(map[n]) + off);
+			if (od->od_ino == 0)
+				continue;
+			if (od->od_ino >= ninodes) {
+				problem("inode %u: entry \"%.*s\" names inode %u, out of range\n", ino, OSPFS_MAXNAMELEN, od->od_name, od->od_ino);
+				continue;
+			}
+			__sync_fetch_and_add(&nrefs[od->od_ino], 1);
+		}
+	}
+}
+
+// 'map' holds room for '*mapsize' block numbers; it grows as needed.
+void
+checkinode(uint32_t ino, uint32_t **map, uint32_t *mapsize)
+{
+	struct ospfs_inode *oi = inode(ino);
+	uint64_t size, maxsize = OSPFS_MAXFILESIZE;
+	uint32_t nblk;
+
+	if (oi->oi_nlink == 0) {
+		// A file unlinked while open keeps its blocks until it is
+		// closed; after a crash, the next mount frees them
+		if ((oi->oi_ftype != OSPFS_FTYPE_REG && oi->oi_ftype != OSPFS_FTYPE_XREG)
+		    || (oi->oi_size == 0 && (oi->oi_ftype == OSPFS_FTYPE_REG
+			|| ((struct ospfs_extent_inode *) oi)->oi_size_hi == 0)))
+			return;
+		if (verbose)
+			printf("inode %u: unlinked, but its blocks aren't freed yet; mounting frees them\n", ino);
+	}
+
+	switch (oi->oi_ftype) {
+	case OSPFS_FTYPE_SYMLINK:
+		if (oi->oi_size > OSPFS_MAXSYMLINKLEN)
+			problem("inode %u: symbolic link too long (%u)\n", ino, oi->oi_size);
+		return;
+	case OSPFS_FTYPE_REG:
+	case OSPFS_FTYPE_DIR:
+	case OSPFS_FTYPE_XREG:
+		break;
+	default:
+		problem("inode %u: unknown type %u\n", ino, oi->oi_ftype);
+		return;
+	}
+
+	// Extent-mapped files keep the high 32 bits of their size
+	size = oi->oi_size;
+	if (oi->oi_ftype == OSPFS_FTYPE_XREG) {
+		size |= (uint64_t) ((struct ospfs_extent_inode *) oi)->oi_size_hi << 32;
+		maxsize = OSPFS_MAXXFILESIZE;
+	}
+	if (size > maxsize) {
+		problem("inode %u: size %llu too large\n", ino, (unsigned long long) size);
+		return;
+	}
+	nblk = (size + OSPFS_BLKSIZE - 1) >> OSPFS_BLKSIZE_BITS;
+	if (nblk > *mapsize) {
+		free(*map);
+		if (!(*map = malloc((size_t) nblk * sizeof(uint32_t)))) {
+			perror("malloc");
+			exit(2);
+		}
+		*mapsize = nblk;
+	}
+	memset(*map, 0, (size_t) nblk * sizeof(uint32_t));
+	if (oi->oi_ftype == OSPFS_FTYPE_XREG)
+		markextents(ino, (struct ospfs_extent_inode *) oi, nblk, *map);
+	else
+		markblockmap(ino, oi, nblk, *map);
+	if (oi->oi_ftype == OSPFS_FTYPE_DIR)
+		walkdir(ino, oi, nblk, *map);
+}
+
+void *
+worker(void *arg)
+{
+	uint32_t *map = NULL, mapsize = 0;
+	uint32_t ino, end;
+
+	while ((ino = __sync_fetch_and_add(&nextchunk, CHUNK)) < ninodes) {
+		end = (ino + CHUNK < ninodes ? ino + CHUNK : ninodes);
+		for (; ino < end; ino++)
+			checkinode(ino, &map, &mapsize);
+	}
+	free(map);
+	return NULL;
+}
+
+// Compare the rebuilt bitmap with the one on disk, a word at a time.
+// On disk, a set bit means the block is free.
+void
+checkbitmap(void)
+{
+	uint32_t *ondisk = block(OSPFS_FREEMAP_BLK);
+	uint32_t w, bno, nused = 0;
+
+	for (w = 0; w < (nblocks + 31) / 32; w++) {
+		uint32_t want_free = ~used[w];
+		uint32_t diff = want_free ^ ondisk[w];
+		if (w == nblocks / 32)	// ignore bits past the end of the disk
+			diff &= (1U << (nblocks % 32)) - 1;
+		nused += __builtin_popcount(used[w]);
+		for (; diff; diff &= diff - 1) {
+			bno = w * 32 + __builtin_ctz(diff);
+			if (want_free & (1U << (bno % 32)))
+				problem("block %u is marked in use, but nothing uses it\n", bno);
+			else
+				problem("block %u is in use, but marked free\n", bno);
+		}
+	}
+	if (verbose)
+		printf("%u of %u blocks in use\n", nused, nblocks);
+}
+
+// Compare each shared block's reference count with its uses.  Blocks
+// used too often were reported as they were found.
+void
+checkrefs(void)
+{
+	uint32_t bno;
+
+	if (!refs)
+		return;
+	for (bno = 0; bno < nblocks; bno++)
+		if (refs[bno] != 0 && nuses[bno] < refs[bno] + 1)
+			problem("block %u has reference count %u, so should be used %u times, but is used %u\n", bno, refs[bno], refs[bno] + 1, nuses[bno]);
+}
+
+// Compare each file's link count with the entries that name it.
+// Directory link counts aren't kept consistently, so they are not checked.
+void
+checklinks(void)
+{
+	uint32_t ino;
+	struct ospfs_inode *oi;
+
+	for (ino = 1; ino < ninodes; ino++) {
+		oi = inode(ino);
+		if (oi->oi_nlink == 0 && nrefs[ino] != 0)
+			problem("inode %u: free, but named by %u directory entries\n", ino, nrefs[ino]);
+		else if (oi->oi_nlink != 0 && oi->oi_ftype != OSPFS_FTYPE_DIR
+			 && oi->oi_nlink != nrefs[ino])
+			problem("inode %u: link count %u, but named by %u directory entries\n", ino, oi->oi_nlink, nrefs[ino]);
+	}
+}
+
+// Report a transaction that the next mount will replay.
+void
+checkjournal(void)
+{
+	struct ospfs_journal_header *d, *c;
+
+	if (super->os_njournal == 0)
+		return;
+	d = block(super->os_journalb);
+	if (d->oj_magic != OSPFS_JOURNAL_MAGIC || d->oj_type != OSPFS_JOURNAL_DESCRIPTOR
+	    || d->oj_nblocks + 2 > super->os_njournal)
+		return;
+	c = block(super->os_journalb + 1 + d->oj_nblocks);
+	if (c->oj_magic == OSPFS_JOURNAL_MAGIC && c->oj_type == OSPFS_JOURNAL_COMMIT
+	    && c->oj_seq == d->oj_seq && verbose)
+		printf("journal holds transaction %u (%u blocks); mounting replays it\n", d->oj_seq, d->oj_nblocks);
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "Usage: ospfsck [-V] [-t NTHREADS] fs.img\n\
+  \"-V\" means print a summary as well as problems.\n\
+  \"-t NTHREADS\" means use NTHREADS worker threads (default: one per CPU).\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	int fd, i;
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	char *s;
+	struct stat st;
+	pthread_t *threads;
+
+    option:
+	if (argc > 1 && strcmp(argv[1], "-V") == 0) {
+		argc--, argv++, verbose = 1;
+		goto option;
+	}
+	if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+		nthreads = strtol(argv[2], &s, 0);
+		if (*s || s == argv[2] || nthreads < 1)
+			usage();
+		argc -= 2, argv += 2;
+		goto option;
+	}
+	if (argc != 2)
+		usage();
+	if (nthreads < 1)
+		nthreads = 1;
+
+	if ((fd = open(argv[1], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(argv[1]);
+		exit(2);
+	}
+	disk = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (disk == MAP_FAILED) {
+		perror("mmap");
+		exit(2);
+	}
+	madvise(disk, st.st_size, MADV_WILLNEED);
+
+	// find the superblock, and with it the block size
+	for (ospfs_blksize_bits = OSPFS_MINBLKSIZE_BITS;
+	     ospfs_blksize_bits <= OSPFS_MAXBLKSIZE_BITS; ospfs_blksize_bits++) {
+		if (2 * OSPFS_BLKSIZE > st.st_size)
+			break;
+		super = block(1);
+		if (super->os_magic == OSPFS_MAGIC
+		    && (super->os_blksize_bits == ospfs_blksize_bits
+			|| (super->os_blksize_bits == 0
+			    && ospfs_blksize_bits == OSPFS_MINBLKSIZE_BITS)))
+			break;
+	}
+	if (ospfs_blksize_bits > OSPFS_MAXBLKSIZE_BITS || 2 * OSPFS_BLKSIZE > st.st_size) {
+		fprintf(stderr, "%s: no OSPFS found\n", argv[1]);
+		exit(2);
+	}
+	nblocks = super->os_nblocks;
+	ninodes = super->os_ninodes;
+	firstdatab = super->os_firstinob + (ninodes + OSPFS_BLKINODES - 1) / OSPFS_BLKINODES;
+	if (super->os_nref) {
+		if (super->os_refb != firstdatab
+		    || (uint64_t) super->os_nref * OSPFS_BLKREFS < nblocks) {
+			fprintf(stderr, "%s: bad reference count table\n", argv[1]);
+			exit(2);
+		}
+		firstdatab = super->os_refb + super->os_nref;
+	}
+	if (super->os_njournal)
+		firstdatab = super->os_journalb + super->os_njournal;
+	if ((uint64_t) nblocks * OSPFS_BLKSIZE > (uint64_t) st.st_size
+	    || super->os_firstinob != OSPFS_FREEMAP_BLK + (nblocks + OSPFS_BLKBITSIZE - 1) / OSPFS_BLKBITSIZE
+	    || firstdatab > nblocks) {
+		fprintf(stderr, "%s: no OSPFS found\n", argv[1]);
+		exit(2);
+	}
+
+	used = calloc((nblocks + 31) / 32, sizeof(uint32_t));
+	nrefs = calloc(ninodes, sizeof(uint32_t));
+	threads = calloc(nthreads, sizeof(pthread_t));
+	if (super->os_nref) {
+		refs = block(super->os_refb);
+		nuses = calloc(nblocks, sizeof(uint32_t));
+	}
+	if (!used || !nrefs || !threads || (refs && !nuses)) {
+		perror("calloc");
+		exit(2);
+	}
+	// boot sector, superblock, bitmap, inodes, reference counts and journal
+	for (i = 0; i < firstdatab; i++)
+		used[i / 32] |= 1U << (i % 32);
+
+	if (inode(OSPFS_ROOT_INO)->oi_nlink == 0
+	    || inode(OSPFS_ROOT_INO)->oi_ftype != OSPFS_FTYPE_DIR)
+		problem("root inode %u is not a directory\n", OSPFS_ROOT_INO);
+
+	for (i = 0; i < nthreads; i++)
+		if ((errno = pthread_create(&threads[i], NULL, worker, NULL)) != 0) {
+			perror("pthread_create");
+			exit(2);
+		}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	checkbitmap();
+	checkrefs();
+	checklinks();
+	checkjournal();
+
+	if (verbose || nproblems)
+		printf("%s: %u inodes, %u %u-byte blocks, %lu problem%s\n", argv[1], ninodes, nblocks, OSPFS_BLKSIZE, nproblems, (nproblems == 1 ? "" : "s"));
+	exit(nproblems ? 1 : 0);
+}
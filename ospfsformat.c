@@ -1,4 +1,6 @@
 #define _BSD_EXTENSION
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -9,7 +11,9 @@
 #include <assert.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "ospfs.h"
 #include "md5.h"
@@ -24,20 +28,40 @@
 
 #define nelem(x)	(sizeof(x) / sizeof((x)[0]))
 
+uint32_t ospfs_blksize_bits = OSPFS_MINBLKSIZE_BITS;
 int diskfd;
 uint32_t nblocks;
 uint32_t ninodes;
+uint32_t njournal;
 uint32_t nbitblock;
+uint32_t nrefblock;
 uint32_t nextb;
 uint32_t nextinode;
 int verbose = 0;
 int link_contents = 0;
-
+int share_blocks = 0;
+int use_extents = 0;
+int nthreads = 1;
+
+// Hardlinks are found through two hash tables, one keyed by host inode
+// number and one by content digest (with -c).  A file may match one entry
+// by inode and another by digest; the one added last wins.  Entries are
+// carved out of arena chunks and never freed.
 struct Hardlink {
-	unsigned long osp_ino;
-	uint32_t host_ino;
+	uint32_t osp_ino;
+	uint32_t seq;			// order in which entries were added
+	unsigned long host_ino;
+	int has_md5;
 	unsigned char md5_digest[MD5_DIGEST_SIZE];
-	struct Hardlink *next;
+	struct Hardlink *host_next;	// next in host inode hash chain
+	struct Hardlink *md5_next;	// next in digest hash chain
+};
+
+#define HARDLINK_CHUNK	1024
+
+struct HardlinkChunk {
+	struct Hardlink h[HARDLINK_CHUNK];
+	struct HardlinkChunk *next;
 };
 
 enum {
@@ -52,51 +76,232 @@ struct Block {
 	uint32_t bno;
 	uint32_t type;
 	uint32_t busy;
-	uint32_t used;
+	struct Block *hnext;		// next block in the same hash bucket
+	struct Block *lprev, *lnext;	// LRU list neighbors, if not busy
 	union {
-		uint8_t b[OSPFS_BLKSIZE];
-		uint32_t u[OSPFS_BLKSIZE / 4];
-		ospfs_inode_t ino[OSPFS_BLKINODES];
+		uint8_t b[OSPFS_MAXBLKSIZE];
+		uint32_t u[OSPFS_MAXBLKSIZE / 4];
+		ospfs_inode_t ino[OSPFS_MAXBLKSIZE / OSPFS_INODESIZE];
 	} u;
 };
 
-struct Hardlink *hardlinks = NULL;
+struct HardlinkChunk *hardlink_chunks, *hardlink_tail;
+uint32_t nhardlinks;
+struct Hardlink **host_hash, **md5_hash;
+uint32_t nhardlink_hash;
+
+// With -d, each data block written is entered in a hash table keyed by
+// the MD5 digest of its contents, and a block whose contents are already
+// in the image is mapped to the earlier copy instead of written again
+// (see SHARED BLOCKS in ospfs.h).  Chains hold indexes into the
+// 'sharedblocks' array plus 1, newest first, so the entries added for a
+// file can be taken back off the end.  'blockrefs' counts the extra
+// references to each block, for the reference count table.
+struct SharedBlock {
+	unsigned char md5_digest[MD5_DIGEST_SIZE];
+	uint32_t bno;
+	uint32_t next;			// next in hash chain, plus 1; 0 ends it
+};
 
-struct Block cache[16];
+struct SharedBlock *sharedblocks;
+uint32_t nsharedblocks, nsharedblocks_alloc;
+uint32_t *share_hash;
+uint32_t nshare_hash;
+uint32_t *blockrefs;
+// The block numbers of the file sharedata stored last
+uint32_t *filebnos;
+uint32_t nfilebnos;
+
+// The block cache.  Cached blocks are found through a hash table on
+// their block numbers.  Blocks that aren't busy are also on an LRU list,
+// most recently used first; when the cache holds 'ncache' blocks, getblk
+// reuses the least recently used one.  If every cached block is busy,
+// the cache grows instead.
+uint32_t ncache = 64;
+uint32_t ncached;
+// Largest "-C" argument, which keeps the hash table size from overflowing
+#define MAXCACHE	(1 << 24)
+struct Block **hashtab;
+uint32_t nhash;
+struct Block *lru_head, *lru_tail;
 
 struct ospfs_super super;
 
+static inline uint32_t
+host_hashval(unsigned long host_ino)
+{
+	return (uint32_t) ((uint64_t) host_ino * 0x9E3779B97F4A7C15ULL >> 32) & (nhardlink_hash - 1);
+}
+
+static inline uint32_t
+md5_hashval(const unsigned char *md5_digest)
+{
+	// the digest is already well mixed
+	uint32_t x;
+	memcpy(&x, md5_digest, sizeof(x));
+	return x & (nhardlink_hash - 1);
+}
+
+static inline uint32_t
+share_hashval(const unsigned char *md5_digest)
+{
+	uint32_t x;
+	memcpy(&x, md5_digest, sizeof(x));
+	return x & (nshare_hash - 1);
+}
+
+// Put 'h' at the front of its hash chains
+void
+hash_hardlink(struct Hardlink *h)
+{
+	uint32_t i;
+	if (h->host_ino) {
+		i = host_hashval(h->host_ino);
+		h->host_next = host_hash[i];
+		host_hash[i] = h;
+	}
+	if (h->has_md5) {
+		i = md5_hashval(h->md5_digest);
+		h->md5_next = md5_hash[i];
+		md5_hash[i] = h;
+	}
+}
+
 // Return the osp ino for the given host ino
 // Return 0 iff there is no mapping
 uint32_t
 get_hardlink(unsigned long host_ino, unsigned char *md5_digest)
 {
-	struct Hardlink *cur;
-	for (cur = hardlinks; cur; cur = cur->next)
-		if ((host_ino && cur->host_ino == host_ino)
-		    || (link_contents && md5_digest
-			&& memcmp(cur->md5_digest, md5_digest, MD5_DIGEST_SIZE) == 0))
-			return cur->osp_ino;
+	struct Hardlink *by_host = NULL, *by_md5 = NULL;
+
+	if (!nhardlinks)
+		return 0;
+	if (host_ino)
+		for (by_host = host_hash[host_hashval(host_ino)];
+		     by_host && by_host->host_ino != host_ino;
+		     by_host = by_host->host_next)
+			/* do nothing */;
+	if (link_contents && md5_digest)
+		for (by_md5 = md5_hash[md5_hashval(md5_digest)];
+		     by_md5 && memcmp(by_md5->md5_digest, md5_digest, MD5_DIGEST_SIZE) != 0;
+		     by_md5 = by_md5->md5_next)
+			/* do nothing */;
+	if (by_md5 && (!by_host || by_md5->seq > by_host->seq))
+		return by_md5->osp_ino;
+	return (by_host ? by_host->osp_ino : 0);
+}
+
+// Return the block that holds data with digest 'md5_digest', or 0
+uint32_t
+find_shared(const unsigned char *md5_digest)
+{
+	uint32_t i;
+
+	if (!nsharedblocks)
+		return 0;
+	for (i = share_hash[share_hashval(md5_digest)]; i; i = sharedblocks[i - 1].next)
+		if (memcmp(sharedblocks[i - 1].md5_digest, md5_digest, MD5_DIGEST_SIZE) == 0)
+			return sharedblocks[i - 1].bno;
 	return 0;
 }
 
-// Add a new host->osp inode mapping to 'hardlinks'
+// Put entry 'i' of 'sharedblocks' at the front of its hash chain
+void
+hash_shared(uint32_t i)
+{
+	uint32_t *head = &share_hash[share_hashval(sharedblocks[i].md5_digest)];
+	sharedblocks[i].next = *head;
+	*head = i + 1;
+}
+
+// Record that block 'bno' holds data with digest 'md5_digest'
+void
+add_shared(const unsigned char *md5_digest, uint32_t bno)
+{
+	uint32_t i;
+
+	if (nsharedblocks == nsharedblocks_alloc) {
+		nsharedblocks_alloc = (nsharedblocks_alloc ? nsharedblocks_alloc * 2 : 1024);
+		if (!(sharedblocks = realloc(sharedblocks, nsharedblocks_alloc * sizeof(struct SharedBlock)))) {
+			perror("malloc");
+			abort();
+		}
+	}
+	// grow the table to keep the chains short; rehashing in order
+	// keeps the newest entry of each chain at its front
+	if (nsharedblocks >= nshare_hash) {
+		nshare_hash = (nshare_hash ? nshare_hash * 2 : 1024);
+		free(share_hash);
+		if (!(share_hash = calloc(nshare_hash, sizeof(uint32_t)))) {
+			perror("malloc");
+			abort();
+		}
+		for (i = 0; i < nsharedblocks; i++)
+			hash_shared(i);
+	}
+
+	i = nsharedblocks++;
+	memcpy(sharedblocks[i].md5_digest, md5_digest, MD5_DIGEST_SIZE);
+	sharedblocks[i].bno = bno;
+	hash_shared(i);
+}
+
+// Forget the entry add_shared added last
+void
+pop_shared(void)
+{
+	uint32_t i = --nsharedblocks;
+	uint32_t *head = &share_hash[share_hashval(sharedblocks[i].md5_digest)];
+	assert(*head == i + 1);
+	*head = sharedblocks[i].next;
+}
+
+// Add a new host->osp inode mapping to the hardlink tables
 void
 add_hardlink(unsigned long host_ino, uint32_t osp_ino, unsigned char *md5_digest)
 {
-	struct Hardlink *prev_head = hardlinks;
-	hardlinks = malloc(sizeof(*hardlinks));
-	if (!hardlinks) {
-		perror("malloc");
-		abort();
+	struct Hardlink *h;
+	struct HardlinkChunk *c;
+	uint32_t i;
+
+	// grow the tables to keep the chains short
+	if (nhardlinks >= nhardlink_hash) {
+		nhardlink_hash = (nhardlink_hash ? nhardlink_hash * 2 : 1024);
+		free(host_hash);
+		free(md5_hash);
+		host_hash = calloc(nhardlink_hash, sizeof(struct Hardlink *));
+		md5_hash = calloc(nhardlink_hash, sizeof(struct Hardlink *));
+		if (!host_hash || !md5_hash) {
+			perror("malloc");
+			abort();
+		}
+		for (c = hardlink_chunks, i = 0; i < nhardlinks; i++) {
+			if (i && i % HARDLINK_CHUNK == 0)
+				c = c->next;
+			hash_hardlink(&c->h[i % HARDLINK_CHUNK]);
+		}
 	}
-	hardlinks->host_ino = host_ino;
-	hardlinks->osp_ino = osp_ino;
-	if (link_contents && md5_digest)
-		memcpy(hardlinks->md5_digest, md5_digest, MD5_DIGEST_SIZE);
-	else
-		memset(hardlinks->md5_digest, '\0', MD5_DIGEST_SIZE);
-	hardlinks->next = prev_head;
+
+	if (nhardlinks % HARDLINK_CHUNK == 0) {
+		if (!(c = malloc(sizeof(struct HardlinkChunk)))) {
+			perror("malloc");
+			abort();
+		}
+		c->next = NULL;
+		if (hardlink_tail)
+			hardlink_tail->next = c;
+		else
+			hardlink_chunks = c;
+		hardlink_tail = c;
+	}
+	h = &hardlink_tail->h[nhardlinks % HARDLINK_CHUNK];
+	h->seq = nhardlinks++;
+	h->host_ino = host_ino;
+	h->osp_ino = osp_ino;
+	h->has_md5 = (link_contents && md5_digest);
+	if (h->has_md5)
+		memcpy(h->md5_digest, md5_digest, MD5_DIGEST_SIZE);
+	hash_hardlink(h);
 }
 
 ssize_t
@@ -173,6 +378,11 @@ swizzleblock(struct Block *b)
 		swizzle(&s->os_nblocks);
 		swizzle(&s->os_ninodes);
 		swizzle(&s->os_firstinob);
+		swizzle(&s->os_journalb);
+		swizzle(&s->os_njournal);
+		swizzle(&s->os_blksize_bits);
+		swizzle(&s->os_refb);
+		swizzle(&s->os_nref);
 		break;
 	case BLOCK_DIR:
 		for (i = 0; i < OSPFS_BLKSIZE; i += OSPFS_DIRENTRY_SIZE) {
@@ -195,8 +405,7 @@ void
 flushb(struct Block *b)
 {
 	swizzleblock(b);
-	if (lseek(diskfd, b->bno * OSPFS_BLKSIZE, 0) < 0
-	    || write(diskfd, &b->u, OSPFS_BLKSIZE) != OSPFS_BLKSIZE) {
+	if (pwrite(diskfd, &b->u, OSPFS_BLKSIZE, (off_t) b->bno * OSPFS_BLKSIZE) != OSPFS_BLKSIZE) {
 		perror("flushb");
 		fprintf(stderr, "\n");
 		abort();
@@ -204,11 +413,32 @@ flushb(struct Block *b)
 	swizzleblock(b);
 }
 
+void
+lru_remove(struct Block *b)
+{
+	if (b->lprev)
+		b->lprev->lnext = b->lnext;
+	else
+		lru_head = b->lnext;
+	if (b->lnext)
+		b->lnext->lprev = b->lprev;
+	else
+		lru_tail = b->lprev;
+	b->lprev = b->lnext = NULL;
+}
+
+void
+hash_remove(struct Block *b)
+{
+	struct Block **pp = &hashtab[b->bno & (nhash - 1)];
+	while (*pp != b)
+		pp = &(*pp)->hnext;
+	*pp = b->hnext;
+}
+
 struct Block*
 getblk(uint32_t bno, int clr, uint32_t type)
 {
-	int i, least;
-	static int t = 1;
 	struct Block *b;
 
 	if (bno >= nblocks) {
@@ -216,28 +446,40 @@ getblk(uint32_t bno, int clr, uint32_t type)
 		abort();
 	}
 
-	least = -1;
-	for (i = 0; i < nelem(cache); i++) {
-		if (cache[i].bno == bno) {
-			b = &cache[i];
-			goto out;
+	if (!hashtab) {
+		for (nhash = 1; nhash < ncache; nhash *= 2)
+			/* do nothing */;
+		if (!(hashtab = calloc(nhash, sizeof(struct Block *)))) {
+			perror("malloc");
+			abort();
 		}
-		if (!cache[i].busy
-		    && (least == -1 || cache[i].used < cache[least].used))
-			least = i;
 	}
 
-	if (least == -1) {
-		fprintf(stderr, "panic: block cache full\n");
-		abort();
-	}
+	for (b = hashtab[bno & (nhash - 1)]; b; b = b->hnext)
+		if (b->bno == bno) {
+			if (b->busy == 0)
+				lru_remove(b);
+			goto out;
+		}
 
-	b = &cache[least];
-	if (b->used)
+	if (ncached >= ncache && lru_tail) {
+		b = lru_tail;
+		lru_remove(b);
+		hash_remove(b);
 		flushb(b);
+	} else {
+		if (!(b = malloc(sizeof(struct Block)))) {
+			perror("malloc");
+			abort();
+		}
+		b->lprev = b->lnext = NULL;
+		ncached++;
+	}
 
-	if (lseek(diskfd, bno*OSPFS_BLKSIZE, 0) < 0
-	    || readn(diskfd, &b->u, OSPFS_BLKSIZE) != OSPFS_BLKSIZE) {
+	// a block that is about to be cleared needn't be read
+	if (!clr
+	    && (lseek(diskfd, (off_t) bno * OSPFS_BLKSIZE, 0) < 0
+		|| readn(diskfd, &b->u, OSPFS_BLKSIZE) != OSPFS_BLKSIZE)) {
 		fprintf(stderr, "read block %d: ", bno);
 		perror("");
 		fprintf(stderr, "\n");
@@ -248,11 +490,12 @@ getblk(uint32_t bno, int clr, uint32_t type)
 		swizzleblock(b);
 	b->busy = 0;
 	b->type = type;
+	b->hnext = hashtab[bno & (nhash - 1)];
+	hashtab[bno & (nhash - 1)] = b;
 
 out:
 	if (clr)
-		memset(&b->u, 0, sizeof(b->u));
-	b->used = ++t;
+		memset(&b->u, 0, OSPFS_BLKSIZE);
 	b->busy++;
 	/* it is important to reset b->type in case we reuse a block for a
 	 * different purpose while it is still in the cache - this can happen
@@ -265,17 +508,22 @@ out:
 void
 putblk(struct Block *b)
 {
-	b->busy--;
+	if (--b->busy == 0) {
+		b->lprev = NULL;
+		b->lnext = lru_head;
+		if (lru_head)
+			lru_head->lprev = b;
+		else
+			lru_tail = b;
+		lru_head = b;
+	}
 }
 
 void
 opendisk(const char *name)
 {
-	int i, r;
+	int r;
 	uint32_t ninodeblock;
-	struct stat s;
-	struct Block *b;
-	struct ospfs_inode *oi;
 
 	if ((diskfd = open(name, O_RDWR | O_CREAT, 0666)) < 0) {
 		fprintf(stderr, "open %s: ", name);
@@ -285,41 +533,102 @@ opendisk(const char *name)
 	}
 
 	if ((r = ftruncate(diskfd, 0)) < 0
-	    || (r = ftruncate(diskfd, nblocks * OSPFS_BLKSIZE)) < 0) {
+	    || (r = ftruncate(diskfd, (off_t) nblocks * OSPFS_BLKSIZE)) < 0) {
 		fprintf(stderr, "truncate %s: ", name);
 		perror("");
 		abort();
 	}
 
+	// The inode table, the reference counts and the journal start out
+	// all zeros, which ftruncate gave us; finishfs writes the free block
+	// bitmap and the reference counts once the data blocks are allocated.
+	// So this costs the same for any size.
 	nbitblock = (nblocks + OSPFS_BLKBITSIZE - 1) / OSPFS_BLKBITSIZE;
-	for (i = 0; i < nbitblock; i++){
-		b = getblk(OSPFS_FREEMAP_BLK + i, 0, BLOCK_BITS);
-		memset(&b->u.b, 0xFF, OSPFS_BLKSIZE);
-		putblk(b);
-	}
-
 	ninodeblock = (ninodes + OSPFS_BLKINODES - 1) / OSPFS_BLKINODES;
-	for (i = 0; i < ninodeblock; i++) {
-		b = getblk(OSPFS_FREEMAP_BLK + nbitblock + i, 1, BLOCK_INODES);
-		putblk(b);
-	}
-
-	nextb = OSPFS_FREEMAP_BLK + nbitblock + ninodeblock;
+	nrefblock = (share_blocks ? ((uint64_t) nblocks + OSPFS_BLKREFS - 1) / OSPFS_BLKREFS : 0);
+	nextb = OSPFS_FREEMAP_BLK + nbitblock + ninodeblock + nrefblock + njournal;
 	nextinode = 0;
+	if (share_blocks && !(blockrefs = calloc(nblocks, sizeof(uint32_t)))) {
+		perror("malloc");
+		abort();
+	}
 
 	super.os_magic = OSPFS_MAGIC;
 	super.os_nblocks = nblocks;
 	super.os_ninodes = ninodes;
 	super.os_firstinob = OSPFS_FREEMAP_BLK + nbitblock;
+	super.os_journalb = (njournal ? super.os_firstinob + ninodeblock + nrefblock : 0);
+	super.os_njournal = njournal;
+	super.os_blksize_bits = ospfs_blksize_bits;
+	super.os_refb = (nrefblock ? super.os_firstinob + ninodeblock : 0);
+	super.os_nref = nrefblock;
 	if (verbose)
-		fprintf(stderr, "superblock, free block bitmap %d, first inode block %d, first data block %d\n", OSPFS_FREEMAP_BLK, super.os_firstinob, nextb);
+		fprintf(stderr, "superblock, free block bitmap %d, first inode block %d, reference counts %d (%d blocks), journal %d (%d blocks), first data block %d\n", OSPFS_FREEMAP_BLK, super.os_firstinob, super.os_refb, nrefblock, super.os_journalb, njournal, nextb);
 }
 
+// Append block 'bno' as block 'nblk' of the extent-mapped file 'xi'
 void
-storeblk(struct ospfs_inode *ino, struct Block *b, int nblk, int indent)
+storeextent(struct ospfs_extent_inode *xi, uint32_t bno, int nblk, int indent)
 {
-	if (nblk < OSPFS_NDIRECT)
-		ino->oi_direct[nblk] = b->bno;
+	struct Block *xb = NULL;
+	struct ospfs_extent_block *x = NULL;
+	struct ospfs_extent *e = NULL;
+
+	if (xi->oi_extblock != 0) {
+		xb = getblk(xi->oi_extblock, 0, BLOCK_BITS);
+		x = (struct ospfs_extent_block *) xb->u.b;
+		while (x->oeb_next != 0) {
+			uint32_t next = x->oeb_next;
+			putblk(xb);
+			xb = getblk(next, 0, BLOCK_BITS);
+			x = (struct ospfs_extent_block *) xb->u.b;
+		}
+	}
+	if (xi->oi_nextents > OSPFS_NIEXTENTS && x->oeb_nextents > 0)
+		e = &x->oeb_extents[x->oeb_nextents - 1];
+	else if (xi->oi_nextents > 0)
+		e = &xi->oi_extents[xi->oi_nextents - 1];
+
+	if (e && e->oe_lblock + e->oe_len == nblk
+	    && e->oe_pblock + e->oe_len == bno) {
+		e->oe_len++;
+		goto done;
+	}
+
+	if (xi->oi_nextents < OSPFS_NIEXTENTS)
+		e = &xi->oi_extents[xi->oi_nextents];
+	else {
+		if (!xb || x->oeb_nextents == OSPFS_NBEXTENTS) {
+			struct Block *nxb = getblk(nextb++, 1, BLOCK_BITS);
+			if (xb) {
+				x->oeb_next = nxb->bno;
+				putblk(xb);
+			} else
+				xi->oi_extblock = nxb->bno;
+			if (verbose)
+				fprintf(stderr, "%*sextent block %d\n", indent, "", nxb->bno);
+			xb = nxb;
+			x = (struct ospfs_extent_block *) xb->u.b;
+		}
+		e = &x->oeb_extents[x->oeb_nextents++];
+	}
+	e->oe_lblock = nblk;
+	e->oe_pblock = bno;
+	e->oe_len = 1;
+	xi->oi_nextents++;
+
+done:
+	if (xb)
+		putblk(xb);
+}
+
+void
+storeblk(struct ospfs_inode *ino, uint32_t bno, int nblk, int indent)
+{
+	if (ino->oi_ftype == OSPFS_FTYPE_XREG)
+		storeextent((struct ospfs_extent_inode *) ino, bno, nblk, indent);
+	else if (nblk < OSPFS_NDIRECT)
+		ino->oi_direct[nblk] = bno;
 	else if (nblk < OSPFS_NDIRECT + OSPFS_NINDIRECT) {
 		struct Block *bindir;
 		if (ino->oi_indirect == 0) {
@@ -329,7 +638,7 @@ storeblk(struct ospfs_inode *ino, struct Block *b, int nblk, int indent)
 				fprintf(stderr, "%*sindirect block %d\n", indent, "", nextb - 1);
 		} else
 			bindir = getblk(ino->oi_indirect, 0, BLOCK_BITS);
-		bindir->u.u[nblk - OSPFS_NDIRECT] = b->bno;
+		bindir->u.u[nblk - OSPFS_NDIRECT] = bno;
 		putblk(bindir);
 	} else if (nblk < OSPFS_MAXFILEBLKS) {
 		struct Block *bindir2;
@@ -350,7 +659,7 @@ storeblk(struct ospfs_inode *ino, struct Block *b, int nblk, int indent)
 				fprintf(stderr, "%*sindirect2-indirect block %d\n", indent, "", nextb - 1);
 		} else
 			bindir = getblk(bindir2->u.u[nblk / OSPFS_NINDIRECT], 0, BLOCK_BITS);
-		bindir->u.u[nblk % OSPFS_NINDIRECT] = b->bno;
+		bindir->u.u[nblk % OSPFS_NINDIRECT] = bno;
 		putblk(bindir);
 		putblk(bindir2);
 	} else {
@@ -414,7 +723,7 @@ new_dirb:
 		od = (struct ospfs_direntry *) ((*dirb)->u.b + i);
 		od->od_ino = 0;
 	}
-	storeblk(dirino, *dirb, ++nblk, indent);
+	storeblk(dirino, (*dirb)->bno, ++nblk, indent);
 	dirino->oi_size += OSPFS_BLKSIZE;
 	assert((nblk + 1) * OSPFS_BLKSIZE == dirino->oi_size);
 	
@@ -425,18 +734,442 @@ gotit:
 	return od;
 }
 
+// Copy the rest of file 'fd' into the image as one contiguous run of
+// data blocks starting at 'nextb', and return the number of bytes copied.
+// The data bypasses the block cache: copy_file_range moves it from file
+// to image without a trip through user space, and if the kernel can't do
+// that (a pipe, or an old kernel), large read/pwrite batches do.
+// The caller maps the blocks and allocates any indirect or extent blocks
+// after the run, so they don't break it up.
+// If 'md5' is not NULL, the data is also hashed into it on the way
+// through, which needs the read/pwrite path.
+#define COPYCHUNK	(1 << 20)
+
+uint64_t
+copydata(int fd, const char *name, MD5_CONTEXT *md5)
+{
+	static char *buf;
+	uint64_t copied = 0;
+	off_t off = (off_t) nextb * OSPFS_BLKSIZE;
+	off_t end = (off_t) nblocks * OSPFS_BLKSIZE;
+	int use_copy_range = (md5 == NULL);
+	ssize_t r;
+
+	while (1) {
+		size_t len = (end - off < COPYCHUNK ? end - off : COPYCHUNK);
+		if (len == 0) {
+			// out of disk, unless the file ends here
+			char c;
+			if (read(fd, &c, 1) == 0)
+				break;
+			fprintf(stderr, "%s: no room on disk\n", name);
+			abort();
+		}
+
+		if (use_copy_range) {
+			r = copy_file_range(fd, NULL, diskfd, &off, len, 0);
+			if (r < 0 && (errno == EXDEV || errno == EINVAL
+				      || errno == ENOSYS || errno == EOPNOTSUPP
+				      || errno == EBADF)) {
+				use_copy_range = 0;
+				continue;
+			}
+		} else {
+			if (!buf && !(buf = malloc(COPYCHUNK))) {
+				perror("malloc");
+				abort();
+			}
+			r = readn(fd, buf, len);
+			if (r > 0 && pwrite(diskfd, buf, r, off) != r) {
+				perror("write");
+				abort();
+			}
+			if (r > 0 && md5)
+				md5_update(md5, (unsigned char *) buf, r);
+			if (r > 0)
+				off += r;
+		}
+		if (r < 0) {
+			fprintf(stderr, "reading %s: ", name);
+			perror("");
+			abort();
+		} else if (r == 0)
+			break;
+		copied += r;
+	}
+	return copied;
+}
+
+// Copy 'len' bytes from 'buf' into the image as a run of data blocks
+// starting at 'nextb', like copydata.
+uint64_t
+writedata(const char *buf, size_t len, const char *name)
+{
+	off_t off = (off_t) nextb * OSPFS_BLKSIZE;
+	ssize_t r;
+
+	if ((uint64_t) off + len > (uint64_t) nblocks * OSPFS_BLKSIZE) {
+		fprintf(stderr, "%s: no room on disk\n", name);
+		abort();
+	}
+	while (len > 0) {
+		if ((r = pwrite(diskfd, buf, len, off)) <= 0) {
+			perror("write");
+			abort();
+		}
+		buf += r, off += r, len -= r;
+	}
+	return off - (off_t) nextb * OSPFS_BLKSIZE;
+}
+
+// Throw away 'len' bytes of data that copydata staged at 'nextb', for a
+// file that turned out to be a hardlink.  Free blocks should read as
+// zeros, so punch the data out of the image (or overwrite it).
+void
+discarddata(uint64_t len)
+{
+	static char zeros[COPYCHUNK];
+	off_t off = (off_t) nextb * OSPFS_BLKSIZE;
+	size_t n;
+
+	len = (len + OSPFS_BLKSIZE - 1) & ~(uint64_t) (OSPFS_BLKSIZE - 1);
+	if (len == 0
+	    || fallocate(diskfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0)
+		return;
+	for (; len > 0; off += n, len -= n) {
+		n = (len < COPYCHUNK ? len : COPYCHUNK);
+		if (pwrite(diskfd, zeros, n, off) != n) {
+			perror("write");
+			abort();
+		}
+	}
+}
+
+// Like copydata, but with -d: store the data of file 'fd', or the 'len'
+// bytes at 'buf' if 'buf' is not NULL, one block at a time.  A block
+// whose contents are already in the image gains a reference; the others
+// are written as a contiguous run starting at 'nextb'.  The block number
+// of each block of the file is left in 'filebnos', and the number of
+// blocks written in '*nnew'.  Returns the number of bytes stored.
+// A short last block is padded with zeros, as it is on disk.
+uint64_t
+sharedata(int fd, const char *buf, size_t len, const char *name, MD5_CONTEXT *md5, uint32_t *nnew)
+{
+	static char *inbuf, *outbuf, *lastblk;
+	uint64_t size = 0;
+	uint32_t nblk = 0, fresh = 0, bno;
+	size_t outlen = 0, i, n;
+	off_t off = (off_t) nextb * OSPFS_BLKSIZE;
+	unsigned char md5_digest[MD5_DIGEST_SIZE];
+	MD5_CONTEXT blkmd5;
+	const char *data, *blk;
+	ssize_t r;
+
+	if (!inbuf && (!(inbuf = malloc(COPYCHUNK)) || !(outbuf = malloc(COPYCHUNK))
+		       || !(lastblk = malloc(OSPFS_MAXBLKSIZE)))) {
+		perror("malloc");
+		abort();
+	}
+
+	while (1) {
+		if (buf) {
+			data = buf + size;
+			n = len - size;
+		} else {
+			data = inbuf;
+			if ((r = readn(fd, inbuf, COPYCHUNK)) < 0) {
+				fprintf(stderr, "reading %s: ", name);
+				perror("");
+				abort();
+			}
+			n = r;
+		}
+		if (n == 0)
+			break;
+		if (md5)
+			md5_update(md5, (unsigned char *) data, n);
+
+		for (i = 0; i < n; i += OSPFS_BLKSIZE, nblk++) {
+			blk = data + i;
+			if (n - i < OSPFS_BLKSIZE) {
+				memcpy(lastblk, blk, n - i);
+				memset(lastblk + n - i, 0, OSPFS_BLKSIZE - (n - i));
+				blk = lastblk;
+			}
+			md5_init(&blkmd5);
+			md5_update(&blkmd5, (unsigned char *) blk, OSPFS_BLKSIZE);
+			md5_final(md5_digest, &blkmd5);
+
+			if ((bno = find_shared(md5_digest)) != 0)
+				blockrefs[bno]++;
+			else {
+				if (nextb + fresh >= nblocks) {
+					fprintf(stderr, "%s: no room on disk\n", name);
+					abort();
+				}
+				bno = nextb + fresh++;
+				add_shared(md5_digest, bno);
+				if (outlen == COPYCHUNK) {
+					if (pwrite(diskfd, outbuf, outlen, off) != outlen) {
+						perror("write");
+						abort();
+					}
+					off += outlen;
+					outlen = 0;
+				}
+				memcpy(outbuf + outlen, blk, OSPFS_BLKSIZE);
+				outlen += OSPFS_BLKSIZE;
+			}
+
+			if (nblk == nfilebnos) {
+				nfilebnos = (nfilebnos ? nfilebnos * 2 : 1024);
+				if (!(filebnos = realloc(filebnos, nfilebnos * sizeof(uint32_t)))) {
+					perror("malloc");
+					abort();
+				}
+			}
+			filebnos[nblk] = bno;
+		}
+		size += n;
+		if (buf)
+			break;
+	}
+
+	if (outlen > 0 && pwrite(diskfd, outbuf, outlen, off) != outlen) {
+		perror("write");
+		abort();
+	}
+	*nnew = fresh;
+	return size;
+}
+
+// Take back what sharedata did for a 'size'-byte file that turned out
+// to be a hardlink: drop the references it added, forget the 'nnew'
+// blocks it wrote, and discard them.  A block the file shares is below
+// its own next new block, so the two are told apart by number.
 void
-writefile(struct ospfs_inode *dirino, const char *name, unsigned long host_ino, int indent, int mode)
+unsharedata(uint64_t size, uint32_t nnew)
+{
+	uint32_t i, fresh = 0;
+	uint32_t nblk = (size + OSPFS_BLKSIZE - 1) >> OSPFS_BLKSIZE_BITS;
+
+	for (i = 0; i < nblk; i++)
+		if (filebnos[i] == nextb + fresh)
+			fresh++;
+		else
+			blockrefs[filebnos[i]]--;
+	for (i = 0; i < nnew; i++)
+		pop_shared();
+	discarddata((uint64_t) nnew * OSPFS_BLKSIZE);
+}
+
+
+/****************************************************************************
+ * Parallel ingestion
+ *
+ *   With -t, writedirectory reads each directory's entries up front and
+ *   hands them to worker threads as a BATCH of ingest jobs.  A worker
+ *   lstats the entry; for a small regular file, it also reads the whole
+ *   file into memory, and with -c computes its MD5 digest.  The main
+ *   (layout) thread still assigns inodes, directory entries and blocks, in
+ *   directory order, waiting for each job as it comes to it.  So the image
+ *   is the same whatever the number of threads.
+ *
+ *   Batches form a stack, since writedirectory recurses: the top batch is
+ *   the directory being laid out, and workers prefer it.  Workers stay at
+ *   most INGEST_WINDOW jobs ahead of the layout thread in each batch, which
+ *   bounds the memory held by small files' contents.
+ *
+ ****************************************************************************/
+
+#define INGEST_SMALL	65536	// Largest file read ahead into memory
+#define INGEST_WINDOW	1024
+
+struct Ingest {
+	char *path;
+	char *name;		// last component of 'path'
+	int stat_ok;
+	struct stat st;
+	char *data;		// file contents, or NULL if not read ahead
+	size_t len;
+	int have_md5;
+	unsigned char md5_digest[MD5_DIGEST_SIZE];
+	int done;
+};
+
+struct Batch {
+	struct Ingest *jobs;
+	int njobs;
+	int next;		// next job to hand to a worker
+	int consumed;		// job the layout thread is waiting for
+	struct Batch *below;
+};
+
+pthread_mutex_t ingest_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ingest_work = PTHREAD_COND_INITIALIZER;
+pthread_cond_t ingest_done = PTHREAD_COND_INITIALIZER;
+struct Batch *batches;
+int ingest_exit;
+
+// Do the work for one job.  Errors are left for the layout thread, which
+// opens and reads any file that wasn't read ahead itself.
+void
+ingest(struct Ingest *in)
 {
 	int fd;
+	ssize_t r;
+
+	if (lstat(in->path, &in->st) < 0)
+		return;
+	in->stat_ok = 1;
+	if (!S_ISREG(in->st.st_mode) || in->st.st_size > INGEST_SMALL
+	    || (fd = open(in->path, O_RDONLY)) < 0)
+		return;
+
+	// read one byte extra, to notice a file that grew
+	if (!(in->data = malloc(in->st.st_size + 1))) {
+		perror("malloc");
+		abort();
+	}
+	r = readn(fd, in->data, in->st.st_size + 1);
+	if (r < 0 || r > in->st.st_size) {
+		free(in->data);
+		in->data = NULL;
+	} else {
+		in->len = r;
+		if (link_contents) {
+			MD5_CONTEXT md5;
+			md5_init(&md5);
+			md5_update(&md5, (unsigned char *) in->data, r);
+			md5_final(in->md5_digest, &md5);
+			in->have_md5 = 1;
+		}
+	}
+	close(fd);
+}
+
+// Find a job that a worker may start, or return NULL.
+struct Ingest *
+ingest_next(void)
+{
+	struct Batch *b;
+	for (b = batches; b; b = b->below)
+		if (b->next < b->njobs && b->next < b->consumed + INGEST_WINDOW)
+			return &b->jobs[b->next++];
+	return NULL;
+}
+
+void *
+ingest_worker(void *arg)
+{
+	struct Ingest *in;
+
+	pthread_mutex_lock(&ingest_lock);
+	while (!ingest_exit) {
+		if (!(in = ingest_next())) {
+			pthread_cond_wait(&ingest_work, &ingest_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&ingest_lock);
+		ingest(in);
+		pthread_mutex_lock(&ingest_lock);
+		in->done = 1;
+		pthread_cond_broadcast(&ingest_done);
+	}
+	pthread_mutex_unlock(&ingest_lock);
+	return NULL;
+}
+
+// Wait for job 'i' of batch 'b', or do it here if there are no workers.
+struct Ingest *
+ingest_wait(struct Batch *b, int i)
+{
+	struct Ingest *in = &b->jobs[i];
+
+	if (nthreads <= 1) {
+		ingest(in);
+		return in;
+	}
+	pthread_mutex_lock(&ingest_lock);
+	b->consumed = i;
+	pthread_cond_broadcast(&ingest_work);
+	while (!in->done)
+		pthread_cond_wait(&ingest_done, &ingest_lock);
+	pthread_mutex_unlock(&ingest_lock);
+	return in;
+}
+
+void
+ingest_push(struct Batch *b)
+{
+	pthread_mutex_lock(&ingest_lock);
+	b->below = batches;
+	batches = b;
+	pthread_cond_broadcast(&ingest_work);
+	pthread_mutex_unlock(&ingest_lock);
+}
+
+void
+ingest_pop(struct Batch *b)
+{
+	pthread_mutex_lock(&ingest_lock);
+	assert(batches == b);
+	batches = b->below;
+	pthread_mutex_unlock(&ingest_lock);
+}
+
+pthread_t *
+ingest_start(void)
+{
+	pthread_t *threads;
+	int i;
+
+	if (nthreads <= 1)
+		return NULL;
+	if (!(threads = malloc(nthreads * sizeof(pthread_t)))) {
+		perror("malloc");
+		abort();
+	}
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, ingest_worker, NULL) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			abort();
+		}
+	return threads;
+}
+
+void
+ingest_stop(pthread_t *threads)
+{
+	int i;
+
+	if (!threads)
+		return;
+	pthread_mutex_lock(&ingest_lock);
+	ingest_exit = 1;
+	pthread_cond_broadcast(&ingest_work);
+	pthread_mutex_unlock(&ingest_lock);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+// 'in' is the file's ingest job, or NULL if it has none.
+void
+writefile(struct ospfs_inode *dirino, const char *name, unsigned long host_ino, int indent, int mode, struct Ingest *in)
+{
+	int fd = -1;
 	const char *last;
 	struct ospfs_direntry *de;
 	struct ospfs_inode *ino;
-	int i, n, nblk, hardlink_ino;
-	struct Block *dirb, *inob, *b, *bindir;
+	int hardlink_ino = 0, staged = 0;
+	uint32_t i, nblk, firstb, nnew = 0;
+	uint64_t size;
+	struct Block *dirb, *inob;
 	unsigned char md5_digest[MD5_DIGEST_SIZE];
+	MD5_CONTEXT md5;
 
-	if ((fd = open(name, O_RDONLY)) < 0) {
+	if ((!in || !in->data) && (fd = open(name, O_RDONLY)) < 0) {
 		fprintf(stderr, "open %s:", name);
 		perror("");
 		abort();
@@ -450,35 +1183,34 @@ writefile(struct ospfs_inode *dirino, const char *name, unsigned long host_ino,
 
 	de = allocdirentry(dirino, last, &dirb, indent);
 
-	if (link_contents) {
-		unsigned char buf[BUFSIZ];
-		ssize_t r;
-		MD5_CONTEXT md5;
-		md5_init(&md5);
-		while (1) {
-			r = read(fd, buf, BUFSIZ);
-			if (r < 0 && r == EAGAIN)
-				/* do nothing */;
-			else if (r == 0)
-				break;
-			else if (r < 0) {
-				perror("read");
-				return;
-			} else
-				md5_update(&md5, buf, r);
+	// Another name for a host file we already copied needn't be read.
+	// Otherwise, with -c, a file that wasn't read ahead is copied to
+	// 'nextb' and hashed in the same pass; if it turns out to be a
+	// hardlink, the copy is thrown away.  (An earlier entry found by
+	// digest can't be newer than one found by host inode, since
+	// they'd have the same contents.)
+	if (host_ino)
+		hardlink_ino = get_hardlink(host_ino, NULL);
+	if (!hardlink_ino && link_contents) {
+		if (in && in->have_md5)
+			memcpy(md5_digest, in->md5_digest, MD5_DIGEST_SIZE);
+		else {
+			md5_init(&md5);
+			if (share_blocks)
+				size = sharedata(fd, NULL, 0, name, &md5, &nnew);
+			else
+				size = copydata(fd, name, &md5);
+			md5_final(md5_digest, &md5);
+			staged = 1;
 		}
-		md5_final(md5_digest, &md5);
-		if (lseek(fd, 0, SEEK_SET) < 0) {
-			perror("seek");
-			return;
+		if ((hardlink_ino = get_hardlink(host_ino, md5_digest)) && staged) {
+			if (share_blocks)
+				unsharedata(size, nnew);
+			else
+				discarddata(size);
 		}
 	}
 
-	if (host_ino || link_contents)
-		hardlink_ino = get_hardlink(host_ino, md5_digest);
-	else
-		hardlink_ino = 0;
-
 	if (!hardlink_ino) {
 		ino = allocinode(&de->od_ino, &inob);
 		ino->oi_nlink = 1;
@@ -495,36 +1227,50 @@ writefile(struct ospfs_inode *dirino, const char *name, unsigned long host_ino,
 	}
 
 	if (!hardlink_ino) {
-		ino->oi_ftype = OSPFS_FTYPE_REG;
+		ino->oi_ftype = (use_extents ? OSPFS_FTYPE_XREG : OSPFS_FTYPE_REG);
 		ino->oi_mode = mode;
 		if (verbose)
 			fprintf(stderr, "%*s%s, directory block %d, inode %d\n", indent, "", last, dirb->bno, de->od_ino);
 
-		n = 0;
-		for (nblk = 0; ; nblk++) {
-			b = getblk(nextb, 1, BLOCK_FILE);
-			n = readn(fd, b->u.b, OSPFS_BLKSIZE);
-			if (verbose)
-				fprintf(stderr, "%*sdata block %d\n", indent, "", nextb);
-			if (n < 0) {
-				fprintf(stderr, "reading %s: ", name);
-				perror("");
-				abort();
-			}
-			if (n == 0) {
-				putblk(b);
-				break;
-			}
-			nextb++;
-			storeblk(ino, b, nblk, indent);
-			putblk(b);
-			if (n < OSPFS_BLKSIZE)
-				break;
+		// Only extent-mapped files have the high 32 bits of a size
+		if (staged)
+			/* already copied */;
+		else if (share_blocks)
+			size = sharedata(fd, (in ? in->data : NULL), (in ? in->len : 0), name, NULL, &nnew);
+		else if (in && in->data)
+			size = writedata(in->data, in->len, name);
+		else
+			size = copydata(fd, name, NULL);
+		if (ino->oi_ftype == OSPFS_FTYPE_XREG)
+			((struct ospfs_extent_inode *) ino)->oi_size_hi = size >> 32;
+		else if (size > OSPFS_MAXFILESIZE) {
+			fprintf(stderr, "%s: file too large (try -e)\n", name);
+			abort();
+		}
+		ino->oi_size = size;
+
+		firstb = nextb;
+		nblk = (size + OSPFS_BLKSIZE - 1) >> OSPFS_BLKSIZE_BITS;
+		if (share_blocks) {
+			// with -d, 'filebnos' says where each block went
+			nextb += nnew;
+			if (verbose && nnew)
+				fprintf(stderr, "%*sdata blocks %d-%d\n", indent, "", firstb, nextb - 1);
+			if (verbose && nblk > nnew)
+				fprintf(stderr, "%*s%u shared data blocks\n", indent, "", nblk - nnew);
+			for (i = 0; i < nblk; i++)
+				storeblk(ino, filebnos[i], i, indent);
+		} else {
+			nextb += nblk;
+			if (verbose && nblk)
+				fprintf(stderr, "%*sdata blocks %d-%d\n", indent, "", firstb, nextb - 1);
+			for (i = 0; i < nblk; i++)
+				storeblk(ino, firstb + i, i, indent);
 		}
-	
-		ino->oi_size = nblk * OSPFS_BLKSIZE + n;
 	}
 
+	if (fd >= 0)
+		close(fd);
 	putblk(dirb);
 	putblk(inob);
 }
@@ -608,8 +1354,10 @@ writedirectory(struct ospfs_inode *parentdirino, char *name, int root, int inden
 	struct dirent *ent;
 	struct stat s;
 	char pathbuf[PATH_MAX];
-	int namelen;
+	int namelen, i;
 	struct Block *dirb = NULL, *inob = NULL;
+	struct Batch batch;
+	struct Ingest *in;
 
 	if ((dir = opendir(name)) == NULL) {
 		fprintf(stderr, "open %s:", name);
@@ -644,55 +1392,97 @@ writedirectory(struct ospfs_inode *parentdirino, char *name, int root, int inden
 		pathbuf[namelen] = 0;
 	}
 
+	// Read the whole directory, then ingest its entries (see above)
+	memset(&batch, 0, sizeof(batch));
 	while ((ent = readdir(dir)) != NULL) {
-		int ent_namlen = strlen(ent->d_name);
+		if (batch.njobs % 64 == 0
+		    && !(batch.jobs = realloc(batch.jobs, (batch.njobs + 64) * sizeof(struct Ingest)))) {
+			perror("malloc");
+			abort();
+		}
+		in = &batch.jobs[batch.njobs++];
+		memset(in, 0, sizeof(*in));
 		strcpy(pathbuf + namelen, ent->d_name);
+		if (!(in->path = strdup(pathbuf))) {
+			perror("malloc");
+			abort();
+		}
+		in->name = in->path + namelen;
+	}
+	closedir(dir);
+	if (nthreads > 1)
+		ingest_push(&batch);
+
+	for (i = 0; i < batch.njobs; i++) {
+		int ent_namlen;
+		char *ent_name;
 
 		// don't depend on unreliable parts of the dirent structure
-		if (lstat(pathbuf, &s) < 0)
+		in = ingest_wait(&batch, i);
+		if (!in->stat_ok)
 			continue;
+		s = in->st;
+		ent_name = in->name;
+		ent_namlen = strlen(ent_name);
 		
 		if (S_ISREG(s.st_mode)) {
 			unsigned long host_ino = (s.st_nlink > 1 ? s.st_ino : 0);
-			writefile(dirino, pathbuf, host_ino, indent + 2, s.st_mode & 0777);
+			writefile(dirino, in->path, host_ino, indent + 2, s.st_mode & 0777, in);
 		} else if (S_ISDIR(s.st_mode)
-			   && (ent_namlen > 1 || ent->d_name[0] != '.')
-			   && (ent_namlen > 2 || ent->d_name[0] != '.' || ent->d_name[1] != '.')
-			   && (ent_namlen > 3 || ent->d_name[0] != 'C' || ent->d_name[1] != 'V' || ent->d_name[2] != 'S')
-			   && (ent_namlen > 4 || ent->d_name[0] != '.' || ent->d_name[1] != 's' || ent->d_name[2] != 'v' || ent->d_name[3] != 'n')
-			   && (ent_namlen > 4 || ent->d_name[0] != '.' || ent->d_name[1] != 'g' || ent->d_name[2] != 'i' || ent->d_name[3] != 't'))
-			writedirectory(dirino, pathbuf, 0, indent + 2, s.st_mode & 0777);
+			   && (ent_namlen > 1 || ent_name[0] != '.')
+			   && (ent_namlen > 2 || ent_name[0] != '.' || ent_name[1] != '.')
+			   && (ent_namlen > 3 || ent_name[0] != 'C' || ent_name[1] != 'V' || ent_name[2] != 'S')
+			   && (ent_namlen > 4 || ent_name[0] != '.' || ent_name[1] != 's' || ent_name[2] != 'v' || ent_name[3] != 'n')
+			   && (ent_namlen > 4 || ent_name[0] != '.' || ent_name[1] != 'g' || ent_name[2] != 'i' || ent_name[3] != 't'))
+			writedirectory(dirino, in->path, 0, indent + 2, s.st_mode & 0777);
 		else if (S_ISLNK(s.st_mode)) {
 			unsigned long host_ino = (s.st_nlink > 1 ? s.st_ino : 0);
-			writesymlink(dirino, pathbuf, host_ino, indent + 2);
+			writesymlink(dirino, in->path, host_ino, indent + 2);
 		}
+		free(in->data);
+		in->data = NULL;
 	}
 
-	closedir(dir);
+	if (nthreads > 1)
+		ingest_pop(&batch);
+	for (i = 0; i < batch.njobs; i++)
+		free(batch.jobs[i].path);
+	free(batch.jobs);
 	if (dirb)
 		putblk(dirb);
 	if (inob)
 		putblk(inob);
 }
 
+// Write the superblock, the free block bitmap and, with -d, the reference
+// counts.  The bitmap is built in memory with whole-word fills: blocks
+// below 'nextb' are in use (0), the rest are free (1), and the bits past
+// the end of the disk are 0.  The superblock is block 1 and the bitmap
+// starts right after it, so one vectored write covers both.  The
+// superblock's buffer is then reused for the reference count blocks.
 void
 finishfs(void)
 {
-	int i;
-	struct Block *b;
-
-	// create free block bitmap
-	for (i = 0; i < nextb; i++) {
-		b = getblk(OSPFS_FREEMAP_BLK + i / OSPFS_BLKBITSIZE, 0, BLOCK_BITS);
-		b->u.u[(i%OSPFS_BLKBITSIZE)/32] &= ~(1<<(i%32));
-		putblk(b);
-	}
-	if (nblocks != nbitblock*OSPFS_BLKBITSIZE) {
-		b = getblk(OSPFS_FREEMAP_BLK + nbitblock - 1, 0, BLOCK_BITS);
-		for (i = nblocks % OSPFS_BLKBITSIZE; i < OSPFS_BLKBITSIZE; i++)
-			b->u.u[i/32] &= ~(1<<(i%32));
-		putblk(b);
+	static struct Block superb;
+	uint32_t *bitmap;
+	size_t nwords = (size_t) nbitblock * OSPFS_BLKSIZE / 4, i;
+	uint32_t b;
+	struct iovec iov[2];
+	ssize_t len = (ssize_t) (1 + nbitblock) * OSPFS_BLKSIZE;
+
+	if (!(bitmap = malloc(nwords * 4))) {
+		perror("malloc");
+		abort();
 	}
+	memset(bitmap, 0, nextb / 32 * 4);
+	memset(bitmap + nextb / 32, 0xFF, (nwords - nextb / 32) * 4);
+	if (nextb % 32)
+		bitmap[nextb / 32] = 0xFFFFFFFFU << (nextb % 32);
+	if (nblocks % 32)
+		bitmap[nblocks / 32] &= 0xFFFFFFFFU >> (32 - nblocks % 32);
+	memset(bitmap + (nblocks + 31) / 32, 0, (nwords - (nblocks + 31) / 32) * 4);
+	for (i = 0; i < nwords; i++)
+		swizzle(&bitmap[i]);
 
 #if 0
 	// create linked list of free blocks
@@ -703,29 +1493,68 @@ finishfs(void)
 	}
 	super.os_firstfree = (nextb < nblocks ? nextb : 0);
 #endif
-	
-	// write superblock
-	b = getblk(1, 1, BLOCK_SUPER);
-	memmove(&b->u, &super, sizeof(struct ospfs_super));
-	putblk(b);
+
+	superb.type = BLOCK_SUPER;
+	memmove(&superb.u, &super, sizeof(struct ospfs_super));
+	swizzleblock(&superb);
+
+	assert(OSPFS_FREEMAP_BLK == 2);
+	iov[0].iov_base = &superb.u;
+	iov[0].iov_len = OSPFS_BLKSIZE;
+	iov[1].iov_base = bitmap;
+	iov[1].iov_len = nwords * 4;
+	if (pwritev(diskfd, iov, 2, (off_t) OSPFS_BLKSIZE) != len) {
+		perror("write superblock and bitmap");
+		abort();
+	}
+	free(bitmap);
+
+	// With -d, write the reference count blocks that aren't all zeros
+	for (b = 0; b < nrefblock; b++) {
+		uint32_t *refs = blockrefs + (size_t) b * OSPFS_BLKREFS;
+		uint32_t n = (nblocks - b * OSPFS_BLKREFS < OSPFS_BLKREFS ? nblocks - b * OSPFS_BLKREFS : OSPFS_BLKREFS);
+		for (i = 0; i < n && refs[i] == 0; i++)
+			/* do nothing */;
+		if (i == n)
+			continue;
+		memset(&superb.u, 0, OSPFS_BLKSIZE);
+		memcpy(&superb.u, refs, n * 4);
+		for (i = 0; i < n; i++)
+			swizzle(&superb.u.u[i]);
+		if (pwrite(diskfd, &superb.u, OSPFS_BLKSIZE, (off_t) (super.os_refb + b) * OSPFS_BLKSIZE) != OSPFS_BLKSIZE) {
+			perror("write reference counts");
+			abort();
+		}
+	}
 }
 
 void
 flushdisk(void)
 {
-	int i;
+	uint32_t i;
+	struct Block *b;
 
-	for (i = 0; i < nelem(cache); i++)
-		if (cache[i].used)
-			flushb(&cache[i]);
+	for (i = 0; i < nhash; i++)
+		for (b = hashtab[i]; b; b = b->hnext)
+			flushb(b);
 }
 
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: ospfsformat [-c] [-l SRC:DST] fs.img NBLOCKS NINODES files...\n\
-       ospfsformat [-c] [-l SRC:DST] fs.img NBLOCKS NINODES -r DIR\n\
+	fprintf(stderr, "Usage: ospfsformat [-b BLKSIZE] [-C NCACHE] [-c] [-d] [-e] [-j NJOURNAL] [-l SRC:DST] [-t NTHREADS] fs.img NBLOCKS NINODES files...\n\
+       ospfsformat [-b BLKSIZE] [-C NCACHE] [-c] [-d] [-e] [-j NJOURNAL] [-l SRC:DST] [-t NTHREADS] fs.img NBLOCKS NINODES -r DIR\n\
+  \"-b BLKSIZE\" means use BLKSIZE-byte blocks: a power of two from 1024\n\
+     (the default) to 65536.  To mount the image from a block device,\n\
+     BLKSIZE must be at most the page size (usually 4096).\n\
+  \"-C NCACHE\" means cache NCACHE blocks in memory (default 64, at most\n\
+     16777216).\n\
   \"-c\" means treat files with identical contents as hard links.\n\
+  \"-d\" means store identical data blocks once, shared between files.\n\
+  \"-e\" means store regular files as extent-mapped files, which may be\n\
+     larger than 4GB.\n\
+  \"-j NJOURNAL\" means reserve NJOURNAL blocks (at least 128) for a journal.\n\
+  \"-t NTHREADS\" means read the files under DIR with NTHREADS threads.\n\
   \"-l SRC:DST\" means add a symbolic link from SRC to DST.\n");
 	abort();
 }
@@ -741,6 +1570,7 @@ main(int argc, char **argv)
 {
 	int i;
 	char *s;
+	unsigned long n;
 	struct Block *rootinob;
 	struct ospfs_inode *rootino;
 	struct linkrecord *links = NULL;
@@ -757,6 +1587,58 @@ main(int argc, char **argv)
 		argc--, argv++, link_contents = 1;
 		goto option;
 	}
+	if (argc > 1 && strcmp(argv[1], "-d") == 0) {
+		argc--, argv++, share_blocks = 1;
+		goto option;
+	}
+	if (argc > 1 && strcmp(argv[1], "-e") == 0) {
+		argc--, argv++, use_extents = 1;
+		goto option;
+	}
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		long blksize;
+		if (argc < 3)
+			usage();
+		blksize = strtol(argv[2], &s, 0);
+		for (ospfs_blksize_bits = OSPFS_MINBLKSIZE_BITS;
+		     ospfs_blksize_bits < OSPFS_MAXBLKSIZE_BITS
+			     && OSPFS_BLKSIZE != blksize;
+		     ospfs_blksize_bits++)
+			/* do nothing */;
+		if (*s || s == argv[2] || OSPFS_BLKSIZE != blksize)
+			usage();
+		argc -= 2, argv += 2;
+		goto option;
+	}
+	if (argc > 1 && strcmp(argv[1], "-C") == 0) {
+		long n;
+		if (argc < 3)
+			usage();
+		n = strtol(argv[2], &s, 0);
+		if (*s || s == argv[2] || n < 1 || n > MAXCACHE)
+			usage();
+		ncache = n;
+		argc -= 2, argv += 2;
+		goto option;
+	}
+	if (argc > 1 && strcmp(argv[1], "-j") == 0) {
+		if (argc < 3)
+			usage();
+		njournal = strtol(argv[2], &s, 0);
+		if (*s || s == argv[2] || njournal < OSPFS_JOURNAL_MINBLOCKS)
+			usage();
+		argc -= 2, argv += 2;
+		goto option;
+	}
+	if (argc > 1 && strcmp(argv[1], "-t") == 0) {
+		if (argc < 3)
+			usage();
+		nthreads = strtol(argv[2], &s, 0);
+		if (*s || s == argv[2] || nthreads < 1)
+			usage();
+		argc -= 2, argv += 2;
+		goto option;
+	}
 	if (argc > 1 && strcmp(argv[1], "-l") == 0) {
 		struct linkrecord *nl;
 		if (argc < 3 || strchr(argv[2], ':') == 0)
@@ -778,14 +1660,18 @@ main(int argc, char **argv)
 	if (argc < 4)
 		usage();
 
-	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 8192)
+	// block numbers are 32 bits wide
+	n = strtoul(argv[2], &s, 0);
+	if (*s || s == argv[2] || n < 2 || n > 0xFFFFFFFFUL)
 		usage();
+	nblocks = n;
 
 	ninodes = strtol(argv[3], &s, 0);
 	if (*s || s == argv[3] || ninodes < 2)
 		usage();
-	if (ninodes >= (nblocks - 2 - nblocks / OSPFS_BLKBITSIZE)) {
+	nrefblock = (share_blocks ? ((uint64_t) nblocks + OSPFS_BLKREFS - 1) / OSPFS_BLKREFS : 0);
+	if (njournal >= nblocks || nrefblock >= nblocks - njournal
+	    || ninodes >= (nblocks - 2 - nblocks / OSPFS_BLKBITSIZE - njournal - nrefblock)) {
 		fprintf(stderr, "Too many inodes, no room for data blocks!\n");
 		usage();
 	}
@@ -805,10 +1691,12 @@ main(int argc, char **argv)
 	if (strcmp(argv[4], "-r") == 0) {
 		if (argc != 6)
 			usage();
+		pthread_t *threads = ingest_start();
 		writedirectory(rootino, argv[5], 1, 0, 0777);
+		ingest_stop(threads);
 	} else {
 		for (i = 4; i < argc; i++)
-			writefile(rootino, argv[i], 0, 0, 0666);
+			writefile(rootino, argv[i], 0, 0, 0666, NULL);
 	}
 	while (links) {
 		struct linkrecord *l = links;
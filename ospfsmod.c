@@ -14,6 +14,19 @@
 #include <asm/uaccess.h>
 #include <linux/kernel.h>
 #include <linux/sched.h>
+#include <linux/bitops.h>
+#include <linux/vmalloc.h>
+#include <linux/dcache.h>
+#include <linux/prefetch.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/spinlock.h>
+#include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/buffer_head.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/crc32.h>
 
 /****************************************************************************
  * ospfsmod
@@ -33,15 +46,53 @@
 
 // The actual disk data is just an array of raw memory.
 // The initial array is defined in fsimg.c, based on your 'base' directory.
+// It is used when OSPFS is mounted from "none"; OSPFS can also be mounted
+// from a block device (see DISK ACCESS).
 extern uint8_t ospfs_data[];
 extern uint32_t ospfs_length;
 
 // A pointer to the superblock; see ospfs.h for details on the struct.
-static ospfs_super_t * const ospfs_super =
-	(ospfs_super_t *) &ospfs_data[OSPFS_BLKSIZE];
-
-static int change_size(ospfs_inode_t *oi, uint32_t want_size);
-static ospfs_direntry_t *find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen);
+// Points into ospfs_data, or into 'disk_meta' for a block device.
+// Set at mount time.
+static ospfs_super_t *ospfs_super;
+
+// log2 of the mounted file system's block size, from its superblock.
+// OSPFS_BLKSIZE and the values derived from it use this (see ospfs.h).
+uint32_t ospfs_blksize_bits = OSPFS_MINBLKSIZE_BITS;
+
+// If nonzero, ospfs_create makes extent-mapped regular files
+// (OSPFS_FTYPE_XREG); see ospfs.h.
+static int use_extents = 0;
+module_param_named(extents, use_extents, int, 0644);
+MODULE_PARM_DESC(extents, "Create new regular files with extent maps");
+
+// If nonzero, regular files are read and written through the page cache
+// (see ADDRESS SPACE OPERATIONS), which also gives them mmap and sendfile.
+// Otherwise ospfs_read and ospfs_write copy straight to and from the disk
+// array.  Fixed at load time, so every inode of a mount agrees.
+static int use_pagecache = 1;
+module_param_named(pagecache, use_pagecache, int, 0444);
+MODULE_PARM_DESC(pagecache, "Access regular files through the page cache");
+
+// Seconds a dirty block may stay in the write-back cache before it is
+// flushed to the block device (see DISK ACCESS).
+static int flush_interval = 5;
+module_param_named(flush_interval, flush_interval, int, 0644);
+MODULE_PARM_DESC(flush_interval, "Seconds between write-back flushes");
+
+// If nonzero, create, link, unlink, symlink and truncate return only once
+// their transaction has committed to the journal.  Otherwise transactions
+// commit with the periodic flush, many operations at a time.
+static int journal_sync = 0;
+module_param_named(journal_sync, journal_sync, int, 0644);
+MODULE_PARM_DESC(journal_sync, "Commit metadata operations before returning");
+
+static int resize_file(struct inode *inode, ospfs_inode_t *oi, uint64_t new_size);
+static inline int block_shared(uint32_t blockno);
+static int freemap_summary_init(void);
+static void freemap_summary_destroy(void);
+static void dirindex_drop(struct inode *dir);
+static ospfs_direntry_t *find_direntry(struct inode *dir, const char *name, int namelen, uint32_t *entry_off);
 
 
 /*****************************************************************************
@@ -80,6 +131,8 @@ static struct file_system_type ospfs_fs_type;
 // Inode and file operations for regular files
 static struct inode_operations ospfs_reg_inode_ops;
 static struct file_operations ospfs_reg_file_ops;
+static struct file_operations ospfs_reg_direct_file_ops;
+static struct address_space_operations ospfs_aops;
 // Inode and file operations for directories
 static struct inode_operations ospfs_dir_inode_ops;
 static struct file_operations ospfs_dir_file_ops;
@@ -133,9 +186,174 @@ bitvector_test(const void *vector, int i)
 //   Returns: a number of blocks
 
 uint32_t
-ospfs_size2nblocks(uint32_t size)
+ospfs_size2nblocks(uint64_t size)
+{
+	return (size + OSPFS_BLKSIZE - 1) >> OSPFS_BLKSIZE_BITS;
+}
+
+
+// ospfs_size(oi), ospfs_set_size(oi, size)
+//	Return or set the size of the file 'oi'.  Extent-mapped files keep the
+//	upper 32 bits of their size in 'oi_size_hi'; other files are smaller
+//	than 4GB (see ospfs_max_size).
+
+static inline uint64_t
+ospfs_size(ospfs_inode_t *oi)
+{
+	uint64_t size = oi->oi_size;
+	if (oi->oi_ftype == OSPFS_FTYPE_XREG)
+		size |= (uint64_t) ((ospfs_extent_inode_t *) oi)->oi_size_hi << 32;
+	return size;
+}
+
+static inline void
+ospfs_set_size(ospfs_inode_t *oi, uint64_t size)
+{
+	oi->oi_size = (uint32_t) size;
+	if (oi->oi_ftype == OSPFS_FTYPE_XREG)
+		((ospfs_extent_inode_t *) oi)->oi_size_hi = size >> 32;
+}
+
+
+// ospfs_max_size(oi)
+//	Returns the largest size file 'oi' can grow to.
+
+static inline uint64_t
+ospfs_max_size(ospfs_inode_t *oi)
+{
+	if (oi->oi_ftype == OSPFS_FTYPE_XREG)
+		return OSPFS_MAXXFILESIZE;
+	return OSPFS_MAXFILESIZE;
+}
+
+
+/*****************************************************************************
+ * DISK ACCESS
+ *
+ *   Mounted from "none", the disk is the 'ospfs_data' array compiled into
+ *   the module, and changes are lost when the module is unloaded.
+ *
+ *   Mounted from a block device, the disk is read through the buffer
+ *   cache and changes are written back to the device:
+ *
+ *   - The METADATA blocks (boot sector, superblock, free-block bitmap and
+ *     inode blocks) are read into 'disk_meta' at mount time.  The code
+ *     treats the bitmap and the inode table as arrays that span several
+ *     blocks, so they must be contiguous in memory.
+ *   - Directory, indirect and extent blocks are read with sb_bread the
+ *     first time ospfs_block asks for them, and their buffer heads are
+ *     kept in 'disk_bh' until unmount, so the pointers ospfs_block returns
+ *     stay valid.  They are few next to the file data.
+ *   - Regular file data is reached with ospfs_data_get, which holds the
+ *     block's buffer head only until the matching ospfs_data_put.  The
+ *     buffer cache can then drop clean data blocks under memory pressure,
+ *     as it does for any other file system, so reading a large file does
+ *     not pin the whole file in memory.
+ *
+ *   Whoever changes a block must call ospfs_block_dirty (or
+ *   ospfs_inode_dirty, or ospfs_data_put for regular file data) so the
+ *   change reaches the device.  All are no-ops for the in-module image.
+ *
+ *   Dirty blocks are not written one at a time.  ospfs_block_dirty only
+ *   sets the block's bit in 'disk_dirty', so a block changed many times
+ *   (the free-block bitmap during a burst of creates, say) is written
+ *   once.  disk_flush walks the bitmap in block order and submits the
+ *   dirty blocks in batches of DISK_FLUSH_BATCH, which the block layer
+ *   can merge into large sequential writes.  It runs 'flush_interval'
+ *   seconds after the first block is dirtied, on sync, and at unmount.
+ *
+ *   If the file system has a journal, disk_flush commits the dirty
+ *   metadata blocks as one transaction (see JOURNAL in ospfs.h) before
+ *   writing them in place, so every operation since the last flush reaches
+ *   the disk completely or not at all.  Operations bracket their changes
+ *   with journal_start and journal_stop, and reserve CREDITS, the most
+ *   journaled blocks they may dirty, so that no operation is ever split
+ *   between transactions: journal_start commits the running transaction
+ *   first if the operation might not fit in it.  A change to a file too
+ *   big for one transaction, like truncating a large file, is made as a
+ *   series of operations, each as big as its credits allow (journal_step,
+ *   resize_file, unshare_file_range).
+ */
+
+static struct super_block *disk_sb;	// NULL unless on a block device
+static uint8_t *disk_meta;		// Metadata blocks
+static uint32_t disk_nmeta;		// Number of metadata blocks
+static unsigned long *disk_dirty;	// Dirty blocks (one bit per block)
+static unsigned long *disk_data_dirty;	// Dirty file data blocks
+static struct buffer_head **disk_bh;	// Buffer heads of directory,
+					// indirect and extent blocks
+// Returned for blocks that can't be read, so callers never see NULL.
+// Blocks on a device are at most a page.
+static uint8_t disk_errblock[PAGE_SIZE];
+
+// Buffers submitted to the block layer at a time by disk_flush, and by
+// ospfs_data_readahead.
+#define DISK_FLUSH_BATCH	64
+
+static DEFINE_MUTEX(disk_flush_mutex);	// Serializes disk_flush
+static void disk_flush_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(disk_flush_work, disk_flush_worker);
+static DECLARE_WORK(disk_kick_work, disk_flush_worker);
+
+// The journal (see JOURNAL in ospfs.h).  'journal_sem' is held for
+// reading by every operation that changes metadata (journal_start and
+// journal_stop), and for writing while a commit takes its snapshot, so a
+// transaction never holds half an operation.
+static DECLARE_RWSEM(journal_sem);
+static uint32_t journal_cap;		// Max blocks per transaction; 0 if
+					// there is no journal
+static uint32_t journal_seq;		// Running transaction's number
+static uint32_t journal_committed;	// Last committed transaction
+static atomic_t journal_ndirty;		// Blocks in running transaction
+static atomic_t journal_reserved;	// Credits of running operations
+
+// Journal credits (see journal_start).  Every operation gets
+// JOURNAL_OP_CREDITS, enough for the inode, directory and bitmap blocks of
+// any directory operation.  An operation on 'nblocks' consecutive blocks
+// of a regular file, whose disk blocks (and the disk blocks of their
+// copies) form 'nruns' contiguous runs, gets JOURNAL_FILE_CREDITS: for each
+// run, JOURNAL_RUN_CREDITS for the bitmap and reference count blocks at
+// its ends and the extent blocks it changes; the bitmap and reference
+// count blocks inside the runs; and the indirect blocks that map the file
+// blocks, with their bitmap blocks.  So a long contiguous run costs little
+// more than one block.  Each operation handles at most JOURNAL_STEP_RUNS
+// runs of blocks it allocates, since it can't know them in advance.
+// OSPFS_JOURNAL_MINBLOCKS leaves room for thousands of blocks in runs
+// that long, so a big write or truncate commits a few megabytes at a time.
+#define JOURNAL_OP_CREDITS	16
+#define JOURNAL_RUN_CREDITS	7
+#define JOURNAL_STEP_RUNS	4
+#define JOURNAL_FILE_CREDITS(nruns, nblocks) \
+	(JOURNAL_OP_CREDITS + (uint64_t) (nruns) * JOURNAL_RUN_CREDITS	\
+	 + (nblocks) / OSPFS_BLKBITSIZE + (nblocks) / OSPFS_BLKREFS	\
+	 + 2 * ((nblocks) / OSPFS_NINDIRECT + 3))
+static uint32_t *journal_blocknos;	// Home blocks of a commit
+static struct buffer_head **journal_bh;	// Journal buffers of a commit
+
+// disk_fetch(blockno)
+//	Reads block 'blockno' from the device and keeps its buffer head until
+//	unmount.  May sleep.
+
+static void *
+disk_fetch(uint32_t blockno)
 {
-	return (size + OSPFS_BLKSIZE - 1) / OSPFS_BLKSIZE;
+	struct buffer_head *bh;
+
+	if (blockno >= ospfs_super->os_nblocks)
+		return disk_errblock;
+	if ((bh = disk_bh[blockno]))
+		return bh->b_data;
+
+	if (!(bh = sb_bread(disk_sb, blockno))) {
+		eprintk("OSPFS: I/O error reading block %u\n", blockno);
+		return disk_errblock;
+	}
+	// Another thread may have fetched the block meanwhile
+	if (cmpxchg(&disk_bh[blockno], NULL, bh) != NULL) {
+		brelse(bh);
+		bh = disk_bh[blockno];
+	}
+	return bh->b_data;
 }
 
 
@@ -144,96 +362,1222 @@ ospfs_size2nblocks(uint32_t size)
 //
 //   Input:   blockno -- block number
 //   Returns: a pointer to that block's data
+//
+//	On a block device, the first use of a directory, indirect or extent
+//	block reads it from the device and may sleep, and the block then stays
+//	in memory until unmount; use ospfs_data_get for regular file data.
+//	Metadata blocks never sleep, so the bitmap and inodes can be used
+//	under spinlocks.
 
 static void *
 ospfs_block(uint32_t blockno)
 {
-	return &ospfs_data[blockno * OSPFS_BLKSIZE];
+	if (!disk_sb)
+		return &ospfs_data[blockno * OSPFS_BLKSIZE];
+	else if (blockno < disk_nmeta)
+		return &disk_meta[blockno * OSPFS_BLKSIZE];
+	else
+		return disk_fetch(blockno);
+}
+
+
+// ospfs_block_dirty(blockno)
+//	Use this function after changing block 'blockno', so the change is
+//	written back to the device.  The block is journaled: use it for
+//	directory, indirect and extent blocks, and for metadata blocks.
+//	Never sleeps.
+
+static void
+ospfs_block_dirty(uint32_t blockno)
+{
+	if (!disk_sb || blockno >= ospfs_super->os_nblocks
+	    || test_and_set_bit(blockno, disk_dirty))
+		return;
+	// Commit early rather than outgrow the journal
+	if (journal_cap
+	    && atomic_inc_return(&journal_ndirty) == journal_cap / 2)
+		schedule_work(&disk_kick_work);
+	else
+		schedule_delayed_work(&disk_flush_work, flush_interval * HZ);
+}
+
+
+// ospfs_data_dirty(blockno)
+//	Like ospfs_block_dirty, for a block of regular file data, which is
+//	written in place rather than journaled.  Never sleeps.
+
+static void
+ospfs_data_dirty(uint32_t blockno)
+{
+	if (!disk_sb || blockno >= ospfs_super->os_nblocks
+	    || test_and_set_bit(blockno, disk_data_dirty))
+		return;
+	schedule_delayed_work(&disk_flush_work, flush_interval * HZ);
+}
+
+
+// ospfs_data_get(blockno, bhp)
+//	Returns a pointer to the contents of regular file data block
+//	'blockno'.  On a block device, '*bhp' is set to the block's buffer
+//	head, which keeps the block in memory until the caller passes it to
+//	ospfs_data_put; otherwise '*bhp' is set to NULL.  May sleep.
+
+static void *
+ospfs_data_get(uint32_t blockno, struct buffer_head **bhp)
+{
+	*bhp = NULL;
+	if (!disk_sb)
+		return ospfs_block(blockno);
+	if (blockno < disk_nmeta || blockno >= ospfs_super->os_nblocks)
+		return disk_errblock;
+	if (!(*bhp = sb_bread(disk_sb, blockno))) {
+		eprintk("OSPFS: I/O error reading block %u\n", blockno);
+		return disk_errblock;
+	}
+	return (*bhp)->b_data;
+}
+
+
+// ospfs_data_new(blockno, bhp)
+//	Like ospfs_data_get, for a data block just allocated, which the caller
+//	will fill completely: the old contents are not read.  May sleep.
+
+static void *
+ospfs_data_new(uint32_t blockno, struct buffer_head **bhp)
+{
+	struct buffer_head *bh;
+
+	*bhp = NULL;
+	if (!disk_sb)
+		return ospfs_block(blockno);
+	if (blockno < disk_nmeta || blockno >= ospfs_super->os_nblocks
+	    || !(bh = sb_getblk(disk_sb, blockno)))
+		return disk_errblock;
+	lock_buffer(bh);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	*bhp = bh;
+	return bh->b_data;
+}
+
+
+// ospfs_data_put(blockno, bh, dirty)
+//	Releases data block 'blockno' and the buffer head 'bh' that
+//	ospfs_data_get or ospfs_data_new returned for it.  If 'dirty' is
+//	nonzero the caller changed the block, which is marked for writing, and
+//	stays in memory until it is written.  Never sleeps.
+
+static void
+ospfs_data_put(uint32_t blockno, struct buffer_head *bh, int dirty)
+{
+	if (dirty && bh) {
+		mark_buffer_dirty(bh);
+		ospfs_data_dirty(blockno);
+	}
+	brelse(bh);
+}
+
+
+// ospfs_data_prefetch(blockno)
+//	Starts loading data block 'blockno', so a later ospfs_data_get finds
+//	it in memory.  Never waits for the device.
+
+static void
+ospfs_data_prefetch(uint32_t blockno)
+{
+	if (!disk_sb)
+		prefetch(ospfs_block(blockno));
+	else if (blockno >= disk_nmeta && blockno < ospfs_super->os_nblocks)
+		sb_breadahead(disk_sb, blockno);
+}
+
+
+// journal_replay(sb, super)
+//	Redoes the transaction left in the journal, if it committed (see
+//	JOURNAL in ospfs.h).  Called by disk_open before it reads any
+//	metadata.
+//
+//   Returns: the sequence number of the transaction in the journal, or 0.
+
+static uint32_t
+journal_replay(struct super_block *sb, const ospfs_super_t *super)
+{
+	struct buffer_head *dbh, *cbh = NULL, *bh, *home;
+	ospfs_journal_header_t *d, *c;
+	uint32_t jb = super->os_journalb;
+	uint32_t i, n, seq = 0, crc = ~0;
+
+	if (!(dbh = sb_bread(sb, jb)))
+		return 0;
+	d = (ospfs_journal_header_t *) dbh->b_data;
+	if (d->oj_magic != OSPFS_JOURNAL_MAGIC
+	    || d->oj_type != OSPFS_JOURNAL_DESCRIPTOR
+	    || (n = d->oj_nblocks) > journal_cap)
+		goto out;
+	seq = d->oj_seq;
+
+	if (!(cbh = sb_bread(sb, jb + 1 + n)))
+		goto out;
+	c = (ospfs_journal_header_t *) cbh->b_data;
+	if (c->oj_magic != OSPFS_JOURNAL_MAGIC
+	    || c->oj_type != OSPFS_JOURNAL_COMMIT
+	    || c->oj_seq != seq || c->oj_nblocks != n)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		if (!(bh = sb_bread(sb, jb + 1 + i)))
+			goto out;
+		crc = crc32_le(crc, bh->b_data, OSPFS_BLKSIZE);
+		brelse(bh);
+	}
+	crc = crc32_le(crc, dbh->b_data, OSPFS_BLKSIZE);
+	if (crc != c->oj_checksum)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		uint32_t b = d->oj_blocknos[i];
+		if (b >= super->os_nblocks
+		    || (b >= jb && b < jb + super->os_njournal))
+			continue;
+		if (!(bh = sb_bread(sb, jb + 1 + i)))
+			continue;
+		if ((home = sb_getblk(sb, b))) {
+			lock_buffer(home);
+			memcpy(home->b_data, bh->b_data, OSPFS_BLKSIZE);
+			set_buffer_uptodate(home);
+			unlock_buffer(home);
+			mark_buffer_dirty(home);
+			brelse(home);
+		}
+		brelse(bh);
+	}
+	sync_blockdev(sb->s_bdev);
+	eprintk("OSPFS: replayed journal transaction %u (%u blocks)\n", seq, n);
+
+    out:
+	brelse(cbh);
+	brelse(dbh);
+	return seq;
+}
+
+
+// ospfs_super_ok(super, bits)
+//	Returns nonzero if 'super', found in the second block of a disk with
+//	2^'bits'-byte blocks, is an OSPFS superblock for that block size
+//	(see FILE SYSTEM LAYOUT in ospfs.h).
+
+static int
+ospfs_super_ok(const ospfs_super_t *super, uint32_t bits)
+{
+	return super->os_magic == OSPFS_MAGIC
+		&& (super->os_blksize_bits == bits
+		    || (super->os_blksize_bits == 0
+			&& bits == OSPFS_MINBLKSIZE_BITS));
+}
+
+
+// ram_open()
+//	Sets up the in-module image for a mount: finds its superblock, which
+//	sets the block size.
+//
+//   Returns: 0 on success, -EINVAL if the image isn't an OSPFS.
+
+static int
+ram_open(void)
+{
+	uint32_t bits;
+
+	for (bits = OSPFS_MINBLKSIZE_BITS; bits <= OSPFS_MAXBLKSIZE_BITS; bits++)
+		if ((2U << bits) <= ospfs_length
+		    && ospfs_super_ok((ospfs_super_t *) &ospfs_data[1 << bits], bits)) {
+			ospfs_blksize_bits = bits;
+			ospfs_super = (ospfs_super_t *) &ospfs_data[OSPFS_BLKSIZE];
+			return 0;
+		}
+	eprintk("OSPFS: no OSPFS found in the module's image\n");
+	return -EINVAL;
+}
+
+
+// disk_open(sb)
+//	Sets up block device access for a mount (see DISK ACCESS).
+//	Blocks go through the buffer cache, so they can't be bigger than a
+//	page.
+//
+//   Returns: 0 on success, -EINVAL if the device doesn't hold an OSPFS,
+//	      -EIO or -ENOMEM on error.
+
+static int
+disk_open(struct super_block *sb)
+{
+	struct buffer_head *bh;
+	ospfs_super_t super;
+	uint32_t b, bits;
+	int r = -ENOMEM;
+
+	for (bits = OSPFS_MINBLKSIZE_BITS; bits <= PAGE_SHIFT; bits++) {
+		// Smaller than the device's sector size?
+		if (!sb_set_blocksize(sb, 1 << bits))
+			continue;
+		if (!(bh = sb_bread(sb, 1)))
+			return -EIO;
+		memcpy(&super, bh->b_data, sizeof(super));
+		brelse(bh);
+		if (ospfs_super_ok(&super, bits))
+			break;
+	}
+	if (bits > PAGE_SHIFT) {
+		eprintk("OSPFS: no OSPFS with blocks of a page or less found on device\n");
+		return -EINVAL;
+	}
+	ospfs_blksize_bits = bits;
+
+	disk_nmeta = super.os_firstinob
+		+ (super.os_ninodes + OSPFS_BLKINODES - 1) / OSPFS_BLKINODES;
+	// The reference counts follow the inode blocks, and are kept in
+	// memory with them
+	if (super.os_nref) {
+		if (super.os_refb != disk_nmeta || super.os_nref > super.os_nblocks
+		    || (uint64_t) super.os_nref * OSPFS_BLKREFS < super.os_nblocks) {
+			eprintk("OSPFS: no OSPFS found on device\n");
+			return -EINVAL;
+		}
+		disk_nmeta += super.os_nref;
+	}
+	if (super.os_nblocks > (i_size_read(sb->s_bdev->bd_inode) >> OSPFS_BLKSIZE_BITS)
+	    || disk_nmeta > super.os_nblocks
+	    || (super.os_njournal
+		&& (super.os_njournal < 3 || super.os_journalb < disk_nmeta
+		    || super.os_njournal > super.os_nblocks - super.os_journalb))) {
+		eprintk("OSPFS: no OSPFS found on device\n");
+		return -EINVAL;
+	}
+	if (super.os_njournal && super.os_njournal < OSPFS_JOURNAL_MINBLOCKS) {
+		eprintk("OSPFS: journal of %u blocks is too small (needs %u)\n",
+			super.os_njournal, OSPFS_JOURNAL_MINBLOCKS);
+		return -EINVAL;
+	}
+
+	disk_meta = vmalloc(disk_nmeta * OSPFS_BLKSIZE);
+	disk_dirty = vmalloc(BITS_TO_LONGS(super.os_nblocks) * sizeof(long));
+	disk_data_dirty = vmalloc(BITS_TO_LONGS(super.os_nblocks) * sizeof(long));
+	disk_bh = vmalloc(super.os_nblocks * sizeof(*disk_bh));
+	if (!disk_meta || !disk_dirty || !disk_data_dirty || !disk_bh)
+		goto fail;
+	memset(disk_dirty, 0, BITS_TO_LONGS(super.os_nblocks) * sizeof(long));
+	memset(disk_data_dirty, 0, BITS_TO_LONGS(super.os_nblocks) * sizeof(long));
+	memset(disk_bh, 0, super.os_nblocks * sizeof(*disk_bh));
+
+	if (super.os_njournal) {
+		journal_cap = min_t(uint32_t, OSPFS_JOURNAL_MAXBLOCKS,
+				    super.os_njournal - 2);
+		journal_blocknos = kmalloc(journal_cap * sizeof(uint32_t), GFP_KERNEL);
+		journal_bh = kmalloc((journal_cap + 1) * sizeof(*journal_bh), GFP_KERNEL);
+		if (!journal_blocknos || !journal_bh)
+			goto fail;
+		journal_committed = journal_replay(sb, &super);
+		journal_seq = journal_committed + 1;
+		atomic_set(&journal_ndirty, 0);
+		atomic_set(&journal_reserved, 0);
+	}
+
+	r = -EIO;
+	for (b = 0; b < disk_nmeta; b++) {
+		if (!(bh = sb_bread(sb, b))) {
+			eprintk("OSPFS: I/O error reading block %u\n", b);
+			goto fail;
+		}
+		memcpy(&disk_meta[b * OSPFS_BLKSIZE], bh->b_data, OSPFS_BLKSIZE);
+		brelse(bh);
+	}
+
+	disk_sb = sb;
+	ospfs_super = (ospfs_super_t *) &disk_meta[OSPFS_BLKSIZE];
+	return 0;
+
+    fail:
+	kfree(journal_blocknos);
+	kfree(journal_bh);
+	vfree(disk_meta);
+	vfree(disk_dirty);
+	vfree(disk_data_dirty);
+	vfree(disk_bh);
+	journal_blocknos = NULL;
+	journal_bh = NULL;
+	journal_cap = 0;
+	return r;
+}
+
+
+// disk_getbh(blockno)
+//	Returns a buffer head, with a reference, holding the current contents
+//	of block 'blockno'; or NULL if a block past the metadata is not in
+//	memory (it was never read, or it was written and then dropped), or on
+//	error.  May sleep.
+
+static struct buffer_head *
+disk_getbh(uint32_t blockno)
+{
+	struct buffer_head *bh;
+
+	if (blockno >= disk_nmeta) {
+		if ((bh = disk_bh[blockno]))
+			get_bh(bh);
+		else
+			bh = __find_get_block(disk_sb->s_bdev, blockno,
+					      OSPFS_BLKSIZE);
+	} else if ((bh = sb_getblk(disk_sb, blockno))) {
+		lock_buffer(bh);
+		memcpy(bh->b_data, &disk_meta[blockno * OSPFS_BLKSIZE],
+		       OSPFS_BLKSIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+	}
+	return bh;
+}
+
+
+// disk_write_batch(batch, n, wait)
+//	Submits the 'n' dirty buffers in 'batch' and drops their references.
+//	If 'wait' is nonzero, waits for the writes to finish.
+//
+//   Returns: 0, or -EIO if 'wait' is nonzero and a write failed.
+
+static int
+disk_write_batch(struct buffer_head **batch, int n, int wait)
+{
+	int i, r = 0;
+
+	ll_rw_block(SWRITE, n, batch);
+	for (i = 0; i < n; i++) {
+		if (wait) {
+			wait_on_buffer(batch[i]);
+			if (!buffer_uptodate(batch[i])) {
+				eprintk("OSPFS: I/O error writing block %llu\n",
+					(unsigned long long) batch[i]->b_blocknr);
+				r = -EIO;
+			}
+		}
+		brelse(batch[i]);
+	}
+	return r;
+}
+
+
+// disk_write_dirty(dirty, wait)
+//	Writes the blocks whose bits are set in bitmap 'dirty' to their homes,
+//	in block order and in batches, and clears the bits.
+//	If 'wait' is nonzero, returns only after the writes finish.
+//	Called with disk_flush_mutex held.  May sleep.
+
+static void
+disk_write_dirty(unsigned long *dirty, int wait)
+{
+	struct buffer_head *batch[DISK_FLUSH_BATCH];
+	struct buffer_head *bh;
+	uint32_t nblocks = ospfs_super->os_nblocks;
+	unsigned long b;
+	int n = 0;
+
+	for (b = find_first_bit(dirty, nblocks); b < nblocks;
+	     b = find_next_bit(dirty, nblocks, b + 1)) {
+		// Clear the bit first: a change made during the copy dirties
+		// the block again rather than being lost.
+		if (!test_and_clear_bit(b, dirty))
+			continue;
+		if (!(bh = disk_getbh(b))) {
+			if (b < disk_nmeta)
+				set_bit(b, dirty);
+			continue;
+		}
+		mark_buffer_dirty(bh);
+		batch[n++] = bh;
+		if (n == DISK_FLUSH_BATCH) {
+			disk_write_batch(batch, n, wait);
+			n = 0;
+		}
+	}
+	if (n)
+		disk_write_batch(batch, n, wait);
+}
+
+
+// journal_commit()
+//	Commits the running transaction (see JOURNAL in ospfs.h).  Copies the
+//	journaled dirty blocks into the journal while no operation is running,
+//	then writes the dirty file data, the journal, the commit block, and
+//	finally the blocks' homes, waiting for each step.  Called with
+//	disk_flush_mutex held.  May sleep.
+//
+//   Returns: the number of blocks committed, or -EIO or -ENOMEM on error.
+//	      On error the blocks stay dirty.  Credits keep every transaction
+//	      within the journal (see journal_start).
+
+static int
+journal_commit(void)
+{
+	ospfs_journal_header_t *jh;
+	struct buffer_head *bh;
+	uint32_t nblocks = ospfs_super->os_nblocks;
+	uint32_t jb = ospfs_super->os_journalb;
+	uint32_t seq, n = 0, i, k, crc = ~0;
+	unsigned long b;
+	int r;
+
+	if (!(journal_bh[0] = sb_getblk(disk_sb, jb)))
+		return -ENOMEM;
+
+	down_write(&journal_sem);
+	seq = journal_seq++;
+	for (b = find_first_bit(disk_dirty, nblocks);
+	     b < nblocks && n < journal_cap;
+	     b = find_next_bit(disk_dirty, nblocks, b + 1)) {
+		if (!(bh = sb_getblk(disk_sb, jb + 1 + n)))
+			break;
+		clear_bit(b, disk_dirty);
+		lock_buffer(bh);
+		memcpy(bh->b_data, ospfs_block(b), OSPFS_BLKSIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		crc = crc32_le(crc, bh->b_data, OSPFS_BLKSIZE);
+		journal_blocknos[n] = b;
+		journal_bh[++n] = bh;
+	}
+	// An operation dirtied more blocks than it reserved
+	WARN_ON_ONCE(n == journal_cap && b < nblocks);
+	atomic_set(&journal_ndirty, 0);
+	up_write(&journal_sem);
+
+	// File data first, so committed metadata never points at stale data
+	disk_write_dirty(disk_data_dirty, 1);
+	if (n == 0) {
+		brelse(journal_bh[0]);
+		journal_committed = seq;
+		return 0;
+	}
+
+	bh = journal_bh[0];
+	jh = (ospfs_journal_header_t *) bh->b_data;
+	lock_buffer(bh);
+	memset(jh, 0, OSPFS_BLKSIZE);
+	jh->oj_magic = OSPFS_JOURNAL_MAGIC;
+	jh->oj_type = OSPFS_JOURNAL_DESCRIPTOR;
+	jh->oj_seq = seq;
+	jh->oj_nblocks = n;
+	memcpy(jh->oj_blocknos, journal_blocknos, n * sizeof(uint32_t));
+	crc = crc32_le(crc, bh->b_data, OSPFS_BLKSIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	if ((r = disk_write_batch(journal_bh, n + 1, 1)) < 0)
+		goto fail;
+
+	r = -ENOMEM;
+	if (!(bh = sb_getblk(disk_sb, jb + 1 + n)))
+		goto fail;
+	jh = (ospfs_journal_header_t *) bh->b_data;
+	lock_buffer(bh);
+	memset(jh, 0, OSPFS_BLKSIZE);
+	jh->oj_magic = OSPFS_JOURNAL_MAGIC;
+	jh->oj_type = OSPFS_JOURNAL_COMMIT;
+	jh->oj_seq = seq;
+	jh->oj_nblocks = n;
+	jh->oj_checksum = crc;
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	if ((r = disk_write_batch(&bh, 1, 1)) < 0)
+		goto fail;
+	journal_committed = seq;
+
+	// Checkpoint.  A failure here is repaired by replay at next mount.
+	for (i = k = 0; i < n; i++)
+		if ((bh = disk_getbh(journal_blocknos[i]))) {
+			mark_buffer_dirty(bh);
+			journal_bh[k++] = bh;
+		}
+	disk_write_batch(journal_bh, k, 1);
+	return n;
+
+    fail:
+	for (i = 0; i < n; i++)
+		set_bit(journal_blocknos[i], disk_dirty);
+	return r;
+}
+
+
+// disk_flush(wait)
+//	Writes every dirty block back to the device, in block order, through
+//	the journal if there is one.  If 'wait' is nonzero, returns only after
+//	the writes finish (journal commits always wait).  May sleep.
+
+static void
+disk_flush(int wait)
+{
+	if (!disk_sb)
+		return;
+	mutex_lock(&disk_flush_mutex);
+	if (journal_cap)
+		journal_commit();
+	else {
+		disk_write_dirty(disk_dirty, wait);
+		disk_write_dirty(disk_data_dirty, wait);
+	}
+	mutex_unlock(&disk_flush_mutex);
+}
+
+static void
+disk_flush_worker(struct work_struct *work)
+{
+	disk_flush(0);
+}
+
+
+// journal_start(credits), journal_stop(credits, sync)
+//	Bracket every operation that changes metadata, so that no commit sees
+//	half of it.  'credits' is the most journaled blocks the operation may
+//	dirty (see JOURNAL_OP_CREDITS), and must be the same for both calls; if
+//	the running transaction might not hold that many more, journal_start
+//	commits it first.  Credits beyond the journal's capacity reserve all of
+//	it.  Take journal_start before the inode's 'ii_sem', and don't nest
+//	operations.  If 'sync' is nonzero and the 'journal_sync' parameter is
+//	set, journal_stop waits until the operation commits; operations that
+//	finish together share one commit.  Both are no-ops without a journal.
+//	May sleep.
+
+static void
+journal_start(uint32_t credits)
+{
+	if (!journal_cap)
+		return;
+	credits = min(credits, journal_cap);
+	for (;;) {
+		down_read(&journal_sem);
+		// Blocks dirtied by running operations count twice here, as
+		// dirty and as credits, so this errs on the safe side
+		if (atomic_add_return(credits, &journal_reserved)
+		    + atomic_read(&journal_ndirty) <= journal_cap)
+			return;
+		atomic_sub(credits, &journal_reserved);
+		up_read(&journal_sem);
+
+		mutex_lock(&disk_flush_mutex);
+		journal_commit();
+		mutex_unlock(&disk_flush_mutex);
+	}
+}
+
+static void
+journal_stop(uint32_t credits, int sync)
+{
+	uint32_t seq;
+
+	if (!journal_cap)
+		return;
+	atomic_sub(min(credits, journal_cap), &journal_reserved);
+	seq = journal_seq;
+	up_read(&journal_sem);
+	if (!sync || !journal_sync)
+		return;
+
+	mutex_lock(&disk_flush_mutex);
+	// Another thread's commit may already have covered this operation
+	if ((int32_t) (journal_committed - seq) < 0)
+		journal_commit();
+	mutex_unlock(&disk_flush_mutex);
+}
+
+
+// journal_file_blocks(nruns)
+//	Returns the most file blocks an operation on 'nruns' runs of disk
+//	blocks may cover, so that its JOURNAL_FILE_CREDITS fit in the journal;
+//	or 0, meaning no limit, if there is no journal.  The bitmap, reference
+//	count and indirect blocks cost 1/OSPFS_BLKBITSIZE, 1/OSPFS_BLKREFS
+//	and 2/OSPFS_NINDIRECT credits per file block.
+
+static uint64_t
+journal_file_blocks(uint32_t nruns)
+{
+	uint64_t room;
+
+	if (!journal_cap)
+		return 0;
+	room = journal_cap - JOURNAL_FILE_CREDITS(nruns, 0);
+	return max_t(uint64_t, 1, room * OSPFS_BLKBITSIZE
+		     / (1 + OSPFS_BLKBITSIZE / OSPFS_BLKREFS
+			+ 2 * OSPFS_BLKBITSIZE / OSPFS_NINDIRECT));
+}
+
+
+// disk_close()
+//	Writes back the metadata and releases block device access.
+
+static void
+disk_close(void)
+{
+	uint32_t b;
+
+	if (!disk_sb)
+		return;
+	cancel_delayed_work_sync(&disk_flush_work);
+	cancel_work_sync(&disk_kick_work);
+	disk_flush(1);
+	for (b = 0; b < ospfs_super->os_nblocks; b++)
+		brelse(disk_bh[b]);
+	kfree(journal_blocknos);
+	kfree(journal_bh);
+	vfree(disk_bh);
+	vfree(disk_dirty);
+	vfree(disk_data_dirty);
+	vfree(disk_meta);
+	journal_blocknos = NULL;
+	journal_bh = NULL;
+	journal_cap = 0;
+	disk_bh = NULL;
+	disk_dirty = NULL;
+	disk_data_dirty = NULL;
+	disk_meta = NULL;
+	disk_sb = NULL;
+	ospfs_super = NULL;
+}
+
+
+// ospfs_inode(ino)
+//	Use this function to load a 'ospfs_inode' structure from "disk".
+//
+//   Input:   ino -- inode number
+//   Returns: a pointer to the corresponding ospfs_inode structure
+
+static inline ospfs_inode_t *
+ospfs_inode(ino_t ino)
+{
+	ospfs_inode_t *oi;
+	if (ino >= ospfs_super->os_ninodes)
+		return 0;
+	oi = ospfs_block(ospfs_super->os_firstinob);
+	return &oi[ino];
+}
+
+
+// ospfs_inode_ino(oi)
+//	Returns the inode number of the 'ospfs_inode' structure 'oi'.
+//	(The inverse of 'ospfs_inode'.)
+
+static inline ino_t
+ospfs_inode_ino(ospfs_inode_t *oi)
+{
+	return oi - (ospfs_inode_t *) ospfs_block(ospfs_super->os_firstinob);
+}
+
+
+// ospfs_inode_dirty(oi)
+//	Use this function after changing inode 'oi' (see ospfs_block_dirty).
+
+static inline void
+ospfs_inode_dirty(ospfs_inode_t *oi)
+{
+	ospfs_block_dirty(ospfs_super->os_firstinob
+			  + ospfs_inode_ino(oi) / OSPFS_BLKINODES);
+}
+
+
+// ospfs_extent_find(xi, blockno)
+//	Finds the extent of extent-mapped inode 'xi' that maps file block
+//	'blockno'.  Lock-free readers may call this while the extent list is
+//	changing, so it never follows a bogus extent block number or count.
+//	An extent is filled in before the count that covers it grows (see
+//	extent_append), so the counts are read before the extents.  The
+//	extent blocks are a chain (see EXTENT-MAPPED INODES in ospfs.h), so
+//	the cost grows with the number of extent blocks before the one that
+//	maps 'blockno'.
+//
+//   Inputs:  xi      -- pointer to an extent-mapped OSPFS inode
+//	      blockno -- zero-based index of the file block
+//	      xbnop   -- if not NULL, set to the extent block holding the
+//			 extent, or 0 if the inode holds it
+//   Returns: a pointer to the extent, or NULL if no extent maps 'blockno'
+
+static ospfs_extent_t *
+ospfs_extent_find(ospfs_extent_inode_t *xi, uint32_t blockno, uint32_t *xbnop)
+{
+	uint32_t i, hops, nextents = xi->oi_nextents, xbno = xi->oi_extblock;
+
+	smp_rmb();
+	if (xbnop)
+		*xbnop = 0;
+	for (i = 0; i < nextents && i < OSPFS_NIEXTENTS; i++) {
+		ospfs_extent_t *e = &xi->oi_extents[i];
+		if (blockno >= e->oe_lblock && blockno < e->oe_lblock + e->oe_len)
+			return e;
+	}
+
+	// Skip extent blocks that end before 'blockno', then binary search
+	for (hops = 0; xbno != 0 && hops < ospfs_super->os_nblocks; hops++) {
+		ospfs_extent_block_t *xb;
+		ospfs_extent_t *last;
+		uint32_t lo = 0, hi;
+
+		if (xbno >= ospfs_super->os_nblocks)
+			return NULL;
+		xb = ospfs_block(xbno);
+		hi = xb->oeb_nextents;
+		smp_rmb();
+		if (hi == 0 || hi > OSPFS_NBEXTENTS
+		    || blockno < xb->oeb_extents[0].oe_lblock)
+			return NULL;
+		last = &xb->oeb_extents[hi - 1];
+		if (blockno >= last->oe_lblock + last->oe_len) {
+			xbno = xb->oeb_next;
+			continue;
+		}
+
+		while (hi - lo > 1) {
+			uint32_t mid = (lo + hi) / 2;
+			if (xb->oeb_extents[mid].oe_lblock <= blockno)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		if (blockno < xb->oeb_extents[lo].oe_lblock + xb->oeb_extents[lo].oe_len) {
+			if (xbnop)
+				*xbnop = xbno;
+			return &xb->oeb_extents[lo];
+		}
+		return NULL;
+	}
+	return NULL;
+}
+
+
+// ospfs_inode_blockno(oi, offset)
+//	Use this function to look up the blocks that are part of a file's
+//	contents.
+//
+//   Inputs:  oi     -- pointer to a OSPFS inode
+//	      offset -- byte offset into that inode
+//   Returns: the block number of the block that contains the 'offset'th byte
+//	      of the file
+
+static inline uint32_t
+ospfs_inode_blockno(ospfs_inode_t *oi, uint64_t offset)
+{
+	uint32_t blockno = offset >> OSPFS_BLKSIZE_BITS;
+	if (offset >= ospfs_size(oi) || oi->oi_ftype == OSPFS_FTYPE_SYMLINK)
+		return 0;
+	else if (oi->oi_ftype == OSPFS_FTYPE_XREG) {
+		ospfs_extent_t *e = ospfs_extent_find((ospfs_extent_inode_t *) oi, blockno, NULL);
+		return (e ? e->oe_pblock + (blockno - e->oe_lblock) : 0);
+	} else if (blockno >= OSPFS_NDIRECT + OSPFS_NINDIRECT) {
+		uint32_t blockoff = blockno - (OSPFS_NDIRECT + OSPFS_NINDIRECT);
+		uint32_t *indirect2_block = ospfs_block(oi->oi_indirect2);
+		uint32_t *indirect_block = ospfs_block(indirect2_block[blockoff / OSPFS_NINDIRECT]);
+		return indirect_block[blockoff % OSPFS_NINDIRECT];
+	} else if (blockno >= OSPFS_NDIRECT) {
+		uint32_t *indirect_block = ospfs_block(oi->oi_indirect);
+		return indirect_block[blockno - OSPFS_NDIRECT];
+	} else
+		return oi->oi_direct[blockno];
+}
+
+
+// ospfs_inode_data(oi, offset)
+//	Use this function to load part of inode's data from "disk",
+//	where 'offset' is relative to the first byte of inode data.
+//
+//   Inputs:  oi     -- pointer to a OSPFS inode
+//	      offset -- byte offset into 'oi's data contents
+//   Returns: a pointer to the 'offset'th byte of 'oi's data contents
+//
+//	Be careful: the returned pointer is only valid within a single block.
+//	This function is a simple combination of 'ospfs_inode_blockno'
+//	and 'ospfs_block'.
+
+static inline void *
+ospfs_inode_data(ospfs_inode_t *oi, uint32_t offset)
+{
+	uint32_t blockno = ospfs_inode_blockno(oi, offset);
+	return (uint8_t *) ospfs_block(blockno) + (offset % OSPFS_BLKSIZE);
+}
+
+
+// Block-map cursors
+//	Looking up a block under the doubly indirect block takes two dependent
+//	pointer chases.  A block-map cursor remembers the last pointer array
+//	(the inode's direct pointers, or one indirect block) that a lookup
+//	went through, so sequential reads and writes only visit each indirect
+//	block once.  For extent-mapped files, the cursor remembers the last
+//	extent instead.  Each open regular file has a cursor in its
+//	'private_data' (see ospfs_open).
+//
+//	'blockmap_gen' is incremented whenever a block is freed.  A cursor
+//	filled under an older generation might point at a freed indirect
+//	block, so it is refilled before use.
+//
+//	Lock-free readers (see ospfs_read) can see a block map in the middle
+//	of a change, so ospfs_cursor_blockno checks every block number it
+//	follows and returns 0 rather than leave the disk array.
+
+typedef struct ospfs_blockmap_cursor {
+	ospfs_inode_t *bc_oi;		// Inode the cursor was filled for
+	uint32_t bc_gen;		// 'blockmap_gen' when it was filled
+	uint32_t bc_first;		// File block number of bc_ptrs[0]
+	uint32_t bc_nptrs;		// Number of pointers in bc_ptrs
+	uint32_t *bc_ptrs;		// Direct pointers or an indirect block,
+					// or NULL for an extent
+	uint32_t bc_pblock;		// Disk block of an extent's bc_first
+	spinlock_t bc_lock;		// Protects a file's shared cursor
+} ospfs_blockmap_cursor_t;
+
+static uint32_t blockmap_gen;
+
+
+// cursor_get(filp, bc), cursor_put(filp, bc)
+//	Threads sharing an open file also share its cursor.  ospfs_read and
+//	ospfs_write work on a private copy, 'bc', taken with cursor_get and
+//	handed back with cursor_put, so a lookup never sees a half-updated
+//	cursor.
+
+static void
+cursor_get(struct file *filp, ospfs_blockmap_cursor_t *bc)
+{
+	ospfs_blockmap_cursor_t *fbc = filp->private_data;
+	spin_lock(&fbc->bc_lock);
+	*bc = *fbc;
+	spin_unlock(&fbc->bc_lock);
+}
+
+static void
+cursor_put(struct file *filp, ospfs_blockmap_cursor_t *bc)
+{
+	ospfs_blockmap_cursor_t *fbc = filp->private_data;
+	spin_lock(&fbc->bc_lock);
+	fbc->bc_oi = bc->bc_oi;
+	fbc->bc_gen = bc->bc_gen;
+	fbc->bc_first = bc->bc_first;
+	fbc->bc_nptrs = bc->bc_nptrs;
+	fbc->bc_ptrs = bc->bc_ptrs;
+	fbc->bc_pblock = bc->bc_pblock;
+	spin_unlock(&fbc->bc_lock);
+}
+
+
+// ospfs_cursor_blockno(bc, oi, offset)
+//	Like ospfs_inode_blockno, but reuses the pointer array cached in the
+//	cursor 'bc' when it covers 'offset', and caches the array it used.
+//
+//   Inputs:  bc     -- pointer to a block-map cursor
+//	      oi     -- pointer to a OSPFS inode
+//	      offset -- byte offset into that inode.  The caller keeps it
+//			below the file's size: lock-free readers use i_size,
+//			since 'oi's size may change under them.
+//   Returns: the block number of the block that contains the 'offset'th byte
+//	      of the file
+
+static uint32_t
+ospfs_cursor_blockno(ospfs_blockmap_cursor_t *bc, ospfs_inode_t *oi, uint64_t offset)
+{
+	uint32_t blockno = offset >> OSPFS_BLKSIZE_BITS;
+	if (oi->oi_ftype == OSPFS_FTYPE_SYMLINK)
+		return 0;
+
+	if (bc->bc_oi != oi || bc->bc_gen != blockmap_gen
+	    || blockno < bc->bc_first
+	    || blockno >= bc->bc_first + bc->bc_nptrs) {
+		if (oi->oi_ftype == OSPFS_FTYPE_XREG) {
+			ospfs_extent_t *e = ospfs_extent_find((ospfs_extent_inode_t *) oi, blockno, NULL);
+			if (!e)
+				return 0;
+			bc->bc_ptrs = NULL;
+			bc->bc_first = e->oe_lblock;
+			bc->bc_nptrs = e->oe_len;
+			bc->bc_pblock = e->oe_pblock;
+		} else if (blockno >= OSPFS_NDIRECT + OSPFS_NINDIRECT) {
+			uint32_t blockoff = blockno - (OSPFS_NDIRECT + OSPFS_NINDIRECT);
+			uint32_t indirect2 = oi->oi_indirect2, indirect;
+			if (indirect2 == 0 || indirect2 >= ospfs_super->os_nblocks)
+				return 0;
+			indirect = ((uint32_t *) ospfs_block(indirect2))[blockoff / OSPFS_NINDIRECT];
+			if (indirect == 0 || indirect >= ospfs_super->os_nblocks)
+				return 0;
+			bc->bc_ptrs = ospfs_block(indirect);
+			bc->bc_first = blockno - blockoff % OSPFS_NINDIRECT;
+			bc->bc_nptrs = OSPFS_NINDIRECT;
+		} else if (blockno >= OSPFS_NDIRECT) {
+			uint32_t indirect = oi->oi_indirect;
+			if (indirect == 0 || indirect >= ospfs_super->os_nblocks)
+				return 0;
+			bc->bc_ptrs = ospfs_block(indirect);
+			bc->bc_first = OSPFS_NDIRECT;
+			bc->bc_nptrs = OSPFS_NINDIRECT;
+		} else {
+			bc->bc_ptrs = oi->oi_direct;
+			bc->bc_first = 0;
+			bc->bc_nptrs = OSPFS_NDIRECT;
+		}
+		bc->bc_oi = oi;
+		bc->bc_gen = blockmap_gen;
+	}
+
+	if (!bc->bc_ptrs)
+		blockno = bc->bc_pblock + (blockno - bc->bc_first);
+	else
+		blockno = bc->bc_ptrs[blockno - bc->bc_first];
+	return (blockno < ospfs_super->os_nblocks ? blockno : 0);
+}
+
+
+// The free-inode index
+//	'inode_freemap' has one bit per inode, set to 1 if the inode is free
+//	(its link count is 0).  It is built at mount time, so allocate_inode
+//	doesn't have to walk the inode table.  Inodes 0 and 1 are never free.
+//	'inode_cursor' is the bitmap word where the last search succeeded;
+//	searches start there, so a burst of creates finds each free inode in
+//	constant time.
+//
+//	'inode_freemap_lock' protects the index, so two creators can never be
+//	handed the same inode.
+
+static DEFINE_SPINLOCK(inode_freemap_lock);
+static uint32_t *inode_freemap;
+static uint32_t inode_nfree;
+static uint32_t inode_cursor;
+
+// inode_freemap_init()
+//	Builds the free-inode index from the inode table.
+//
+//   Returns: 0 on success, -ENOMEM if the index can't be allocated.
+
+static int
+inode_freemap_init(void)
+{
+	uint32_t nwords = (ospfs_super->os_ninodes + 31) / 32;
+	uint32_t ino;
+
+	if (!(inode_freemap = vmalloc(nwords * 4)))
+		return -ENOMEM;
+	memset(inode_freemap, 0, nwords * 4);
+
+	inode_nfree = 0;
+	inode_cursor = 0;
+	// Inode number 1 is the inode for the root directory of the file system.
+	// Inode number 0 is reserved and must never be used.
+	for (ino = 2; ino < ospfs_super->os_ninodes; ino++)
+		if (ospfs_inode(ino)->oi_nlink == 0) {
+			bitvector_set(inode_freemap, ino);
+			inode_nfree++;
+		}
+	return 0;
+}
+
+// inode_freemap_destroy()
+//	Frees the free-inode index.
+
+static void
+inode_freemap_destroy(void)
+{
+	vfree(inode_freemap);
+	inode_freemap = NULL;
+}
+
+// reclaim_orphans()
+//	Frees the blocks of regular files that were unlinked while still in
+//	use.  ospfs_delete_inode frees them once the last user is done, so
+//	a crash in between leaves an inode with link count 0 that still has
+//	a size.  Called at mount, before any Linux inode exists.
+
+static void
+reclaim_orphans(void)
+{
+	ospfs_inode_t *oi;
+	uint32_t ino;
+
+	for (ino = 2; ino < ospfs_super->os_ninodes; ino++) {
+		oi = ospfs_inode(ino);
+		if (oi->oi_nlink == 0 && ospfs_size(oi) != 0
+		    && (oi->oi_ftype == OSPFS_FTYPE_REG
+			|| oi->oi_ftype == OSPFS_FTYPE_XREG)) {
+			resize_file(NULL, oi, 0);
+		}
+	}
+}
+
+// allocate_inode()
+//	Use this function to allocate an inode.
+//
+//   Returns: the inode number of a free inode, or 0 if there are none.
+//	      The inode is marked as in use in the free-inode index; the
+//	      caller must set its link count, or release it with free_inode.
+
+static uint32_t
+allocate_inode(void)
+{
+	uint32_t nwords = (ospfs_super->os_ninodes + 31) / 32;
+	uint32_t i, w, ino = 0;
+
+	spin_lock(&inode_freemap_lock);
+	for (i = 0; inode_nfree > 0 && i < nwords; i++) {
+		w = (inode_cursor + i) % nwords;
+		if (inode_freemap[w] == 0)
+			continue;
+
+		ino = w * 32 + __ffs(inode_freemap[w]);
+		bitvector_clear(inode_freemap, ino);
+		inode_nfree--;
+		inode_cursor = w;
+		break;
+	}
+	spin_unlock(&inode_freemap_lock);
+	return ino;
+}
+
+// free_inode(ino)
+//	Use this function to mark inode 'ino' free in the free-inode index.
+//	Call it when the inode's link count drops to 0.
+
+static void
+free_inode(uint32_t ino)
+{
+	if (ino < 2 || ino >= ospfs_super->os_ninodes)
+		return;
+	spin_lock(&inode_freemap_lock);
+	if (!bitvector_test(inode_freemap, ino)) {
+		bitvector_set(inode_freemap, ino);
+		inode_nfree++;
+	}
+	spin_unlock(&inode_freemap_lock);
+}
+
+
+/*****************************************************************************
+ * LOCKING
+ *
+ *   - The free-block bitmap, its summary and the block reference counts
+ *     are protected by 'freemap_lock', and the free-inode index by
+ *     'inode_freemap_lock'.
+ *     Both are spinlocks held only inside the allocate and free functions.
+ *   - Each regular file's block map and size are protected by a per-inode
+ *     read-write semaphore, 'ii_sem' in 'struct ospfs_inode_info'.
+ *     Whoever changes them holds it for writing (resize_lock); writes and
+ *     page-cache writeback hold it for reading while they look up blocks.
+ *     Page locks are always taken before 'ii_sem', never after.
+ *   - Readers take no lock at all.  They read no further than the Linux
+ *     inode's i_size, and the block map always covers i_size: a file
+ *     grows its block map before i_size (resize_publish), and shrinks
+ *     i_size before its block map (resize_shrink).  'ii_seq' is a
+ *     sequence count bumped whenever blocks a reader may be copying stop
+ *     belonging to the file: by resize_shrink, and around each pointer or
+ *     extent unshare_range changes.  ospfs_read and readpage look up and
+ *     copy a run of blocks, then check 'ii_seq', and redo the run if it
+ *     moved.  Nothing in a 'ii_seq' write section sleeps, so a reader
+ *     that finds one in progress just spins.  Many readers can stream one
+ *     file without writing to any shared cache line.
+ *   - Operations that change metadata run between journal_start and
+ *     journal_stop (see DISK ACCESS).  journal_start comes before any
+ *     lock OSPFS takes, and never under a page lock: truncate takes page
+ *     locks inside it.  A resize or unshare too big for one operation
+ *     (resize_file, unshare_file_range) drops 'ii_sem' between its steps;
+ *     the file's i_mutex keeps other resizes out meanwhile.  The VFS holds
+ *     i_mutex around truncate and page-cache writes, and ospfs_write
+ *     takes it itself.
+ *   - Directories are protected by the Linux directory inode's i_mutex,
+ *     which the VFS holds around lookup, readdir, create, link, symlink
+ *     and unlink.  The VFS also holds the target inode's i_mutex around
+ *     link and unlink, which protects 'oi_nlink'.  A directory's i_mutex
+ *     also protects its in-memory index, 'ii_dirindex'.
+ *     OSPFS dentries stay in the dcache, so repeated lookups of a name are
+ *     answered there without calling ospfs_dir_lookup or taking i_mutex.
+ */
+
+// OSPFS's in-memory inode: the Linux inode plus OSPFS locking state.
+typedef struct ospfs_inode_info {
+	struct rw_semaphore ii_sem;	// Protects block map and size
+	seqcount_t ii_seq;		// Bumped when blocks leave the file
+	int ii_wmapped;			// Ever mapped shared and writable
+	struct ospfs_dirindex *ii_dirindex;	// Directory's index, or NULL
+						// (see DIRECTORY INDEX)
+	struct inode ii_vfs_inode;
+} ospfs_inode_info_t;
+
+static inline ospfs_inode_info_t *
+ospfs_inode_info(struct inode *inode)
+{
+	return container_of(inode, ospfs_inode_info_t, ii_vfs_inode);
+}
+
+static inline struct rw_semaphore *
+ospfs_inode_sem(struct inode *inode)
+{
+	return &ospfs_inode_info(inode)->ii_sem;
+}
+
+// resize_lock(inode), resize_unlock(inode)
+//	Bracket any change to the block map or size of regular file 'inode'
+//	by taking its 'ii_sem' for writing.
+
+static void
+resize_lock(struct inode *inode)
+{
+	down_write(ospfs_inode_sem(inode));
 }
 
+static void
+resize_unlock(struct inode *inode)
+{
+	up_write(ospfs_inode_sem(inode));
+}
 
-// ospfs_inode(ino)
-//	Use this function to load a 'ospfs_inode' structure from "disk".
-//
-//   Input:   ino -- inode number
-//   Returns: a pointer to the corresponding ospfs_inode structure
+// resize_publish(inode, size)
+//	Lets lock-free readers of regular file 'inode' see its first 'size'
+//	bytes, once change_size has mapped the blocks that hold them.
 
-static inline ospfs_inode_t *
-ospfs_inode(ino_t ino)
+static void
+resize_publish(struct inode *inode, loff_t size)
 {
-	ospfs_inode_t *oi;
-	if (ino >= ospfs_super->os_ninodes)
-		return 0;
-	oi = ospfs_block(ospfs_super->os_firstinob);
-	return &oi[ino];
+	smp_wmb();
+	i_size_write(inode, size);
 }
 
+// resize_shrink(inode, size)
+//	Before change_size shrinks regular file 'inode' to 'size' bytes:
+//	stops lock-free readers at 'size', and makes any reader that started
+//	before retry, so none copies a block after it is freed.
 
-// ospfs_inode_blockno(oi, offset)
-//	Use this function to look up the blocks that are part of a file's
-//	contents.
-//
-//   Inputs:  oi     -- pointer to a OSPFS inode
-//	      offset -- byte offset into that inode
-//   Returns: the block number of the block that contains the 'offset'th byte
-//	      of the file
-
-static inline uint32_t
-ospfs_inode_blockno(ospfs_inode_t *oi, uint32_t offset)
+static void
+resize_shrink(struct inode *inode, loff_t size)
 {
-	uint32_t blockno = offset / OSPFS_BLKSIZE;
-	if (offset >= oi->oi_size || oi->oi_ftype == OSPFS_FTYPE_SYMLINK)
-		return 0;
-	else if (blockno >= OSPFS_NDIRECT + OSPFS_NINDIRECT) {
-		uint32_t blockoff = blockno - (OSPFS_NDIRECT + OSPFS_NINDIRECT);
-		uint32_t *indirect2_block = ospfs_block(oi->oi_indirect2);
-		uint32_t *indirect_block = ospfs_block(indirect2_block[blockoff / OSPFS_NINDIRECT]);
-		return indirect_block[blockoff % OSPFS_NINDIRECT];
-	} else if (blockno >= OSPFS_NDIRECT) {
-		uint32_t *indirect_block = ospfs_block(oi->oi_indirect);
-		return indirect_block[blockno - OSPFS_NDIRECT];
-	} else
-		return oi->oi_direct[blockno];
-}
+	seqcount_t *seq = &ospfs_inode_info(inode)->ii_seq;
 
+	i_size_write(inode, size);
+	write_seqcount_begin(seq);
+	write_seqcount_end(seq);
+}
 
-// ospfs_inode_data(oi, offset)
-//	Use this function to load part of inode's data from "disk",
-//	where 'offset' is relative to the first byte of inode data.
-//
-//   Inputs:  oi     -- pointer to a OSPFS inode
-//	      offset -- byte offset into 'oi's data contents
-//   Returns: a pointer to the 'offset'th byte of 'oi's data contents
-//
-//	Be careful: the returned pointer is only valid within a single block.
-//	This function is a simple combination of 'ospfs_inode_blockno'
-//	and 'ospfs_block'.
+// ospfs_alloc_inode, ospfs_destroy_inode
+//	Linux calls these functions to allocate and free 'struct inode's
+//	for OSPFS, so that each one is part of a 'struct ospfs_inode_info'.
+//	A directory's index goes with its inode, whether the directory was
+//	deleted or just evicted from the inode cache.
 
-static inline void *
-ospfs_inode_data(ospfs_inode_t *oi, uint32_t offset)
+static struct inode *
+ospfs_alloc_inode(struct super_block *sb)
 {
-	uint32_t blockno = ospfs_inode_blockno(oi, offset);
-	return (uint8_t *) ospfs_block(blockno) + (offset % OSPFS_BLKSIZE);
+	ospfs_inode_info_t *ii = kmalloc(sizeof(*ii), GFP_KERNEL);
+	if (!ii)
+		return NULL;
+	inode_init_once(&ii->ii_vfs_inode);
+	init_rwsem(&ii->ii_sem);
+	seqcount_init(&ii->ii_seq);
+	ii->ii_wmapped = 0;
+	ii->ii_dirindex = NULL;
+	return &ii->ii_vfs_inode;
 }
 
-static inline uint32_t
-find_free_inode(void)
+static void
+ospfs_destroy_inode(struct inode *inode)
 {
-	uint32_t inode_no;
-	ospfs_inode_t *symlink_ino;
-	
-	// Determine what inode we can use
-	// Start at 2 since the first two inodes are special
-	// Inode number 1 is the inode for the root directory of the file system.
-	// Inode number 0 is reserved and must never be used. 
-	for (inode_no = 2; inode_no < ospfs_super->os_ninodes; inode_no++) {
-	symlink_ino = ospfs_inode(inode_no); //load inode structure corresponding to inode number from disk
-	
-	if (symlink_ino->oi_nlink == 0) //inode is free if link count reaches 0 => no hard links
-	return inode_no;
-	}
-	//no free
-	return 0;
+	dirindex_drop(inode);
+	kfree(container_of(inode, ospfs_inode_info_t, ii_vfs_inode));
 }
 
 
@@ -249,8 +1593,10 @@ find_free_inode(void)
 //	notion of inodes on disk, and for such file systems, Linux's
 //	'struct inode's are like a cache of on-disk inodes.
 //
-//	This function takes an inode number for the OSPFS and constructs
-//	and returns the corresponding Linux 'struct inode'.
+//	This function takes an inode number for the OSPFS and returns the
+//	corresponding Linux 'struct inode', constructing it if it is not
+//	already cached.  There is at most one 'struct inode' per OSPFS inode,
+//	so every open file shares the same page cache.
 //
 //   Inputs:  sb  -- the relevant Linux super_block structure (one per mount)
 //	      ino -- OSPFS inode number
@@ -264,19 +1610,24 @@ ospfs_mk_linux_inode(struct super_block *sb, ino_t ino)
 
 	if (!oi)
 		return 0;
-	if (!(inode = new_inode(sb)))
+	if (!(inode = iget_locked(sb, ino)))
 		return 0;
+	if (!(inode->i_state & I_NEW))
+		return inode;
 
-	inode->i_ino = ino;
 	// Make it look like everything was created by root.
 	inode->i_uid = inode->i_gid = 0;
-	inode->i_size = oi->oi_size;
+	inode->i_size = ospfs_size(oi);
 
-	if (oi->oi_ftype == OSPFS_FTYPE_REG) {
+	if (oi->oi_ftype == OSPFS_FTYPE_REG || oi->oi_ftype == OSPFS_FTYPE_XREG) {
 		// Make an inode for a regular file.
 		inode->i_mode = oi->oi_mode | S_IFREG;
 		inode->i_op = &ospfs_reg_inode_ops;
-		inode->i_fop = &ospfs_reg_file_ops;
+		if (use_pagecache) {
+			inode->i_fop = &ospfs_reg_file_ops;
+			inode->i_mapping->a_ops = &ospfs_aops;
+		} else
+			inode->i_fop = &ospfs_reg_direct_file_ops;
 		inode->i_nlink = oi->oi_nlink;
 
 	} else if (oi->oi_ftype == OSPFS_FTYPE_DIR) {
@@ -299,6 +1650,7 @@ ospfs_mk_linux_inode(struct super_block *sb, ino_t ino)
 
 	// Access and modification times are now.
 	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME;
+	unlock_new_inode(inode);
 	return inode;
 }
 
@@ -308,40 +1660,330 @@ ospfs_mk_linux_inode(struct super_block *sb, ino_t ino)
 //	the OSPFS onto some directory.  They help construct a Linux
 //	'struct super_block' for that file system.
 
+// OSPFS keeps its state in global variables, so only one OSPFS can be
+// mounted at a time.
+static unsigned long ospfs_mounted;
+
 static int
 ospfs_fill_super(struct super_block *sb, void *data, int flags)
 {
 	struct inode *root_inode;
+	int r = -ENOMEM;
+
+	if (test_and_set_bit(0, &ospfs_mounted))
+		return -EBUSY;
+
+	if ((r = (sb->s_bdev ? disk_open(sb) : ram_open())) < 0)
+		goto out;
+	r = -ENOMEM;
 
 	sb->s_blocksize = OSPFS_BLKSIZE;
 	sb->s_blocksize_bits = OSPFS_BLKSIZE_BITS;
+	sb->s_maxbytes = min_t(uint64_t, OSPFS_MAXXFILESIZE, MAX_LFS_FILESIZE);
 	sb->s_magic = OSPFS_MAGIC;
 	sb->s_op = &ospfs_superblock_ops;
 
+	if (freemap_summary_init() < 0)
+		goto out_disk;
+	if (inode_freemap_init() < 0)
+		goto out_freemap;
+	reclaim_orphans();
+
 	if (!(root_inode = ospfs_mk_linux_inode(sb, OSPFS_ROOT_INO))
 	    || !(sb->s_root = d_alloc_root(root_inode))) {
 		iput(root_inode);
-		sb->s_dev = 0;
-		return -ENOMEM;
+		inode_freemap_destroy();
+		goto out_freemap;
 	}
 
 	return 0;
+
+    out_freemap:
+	freemap_summary_destroy();
+    out_disk:
+	disk_close();
+    out:
+	if (!sb->s_bdev)
+		sb->s_dev = 0;
+	clear_bit(0, &ospfs_mounted);
+	return r;
 }
 
+// ospfs_get_sb
+//	Mounting from "none" uses the image compiled into the module;
+//	anything else names a block device holding an OSPFS image, such as a
+//	loop device set up on a file made by ospfsformat.
+
 static int
 ospfs_get_sb(struct file_system_type *fs_type, int flags, const char *dev_name, void *data, struct vfsmount *mount)
 {
-	return get_sb_single(fs_type, flags, data, ospfs_fill_super, mount);
+	if (!dev_name || strcmp(dev_name, "none") == 0)
+		return get_sb_single(fs_type, flags, data, ospfs_fill_super, mount);
+	return get_sb_bdev(fs_type, flags, dev_name, data, ospfs_fill_super, mount);
+}
+
+static void
+ospfs_kill_sb(struct super_block *sb)
+{
+	if (sb->s_bdev)
+		kill_block_super(sb);
+	else
+		kill_anon_super(sb);
+}
+
+
+// ospfs_put_super
+//	Called by Linux when the file system is unmounted.  Releases the
+//	in-memory state built by ospfs_fill_super.
+
+static void
+ospfs_put_super(struct super_block *sb)
+{
+	inode_freemap_destroy();
+	freemap_summary_destroy();
+	disk_close();
+	clear_bit(0, &ospfs_mounted);
+}
+
+
+// ospfs_delete_inode(inode)
+//	Called by Linux when the last reference to an inode with no links
+//	goes away: the file is no longer open or mapped by anyone.  Frees its
+//	blocks, if it is a regular file, and then the inode itself.
+
+static void
+ospfs_delete_inode(struct inode *inode)
+{
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+
+	truncate_inode_pages(&inode->i_data, 0);
+	if (oi && (oi->oi_ftype == OSPFS_FTYPE_REG
+		   || oi->oi_ftype == OSPFS_FTYPE_XREG))
+		resize_file(inode, oi, 0);
+	free_inode(inode->i_ino);
+	clear_inode(inode);
+}
+
+
+// ospfs_sync_fs(sb, wait)
+//	Called by Linux on sync to write back the dirty blocks.
+
+static int
+ospfs_sync_fs(struct super_block *sb, int wait)
+{
+	disk_flush(wait);
+	return 0;
 }
 
 
 // ospfs_delete_dentry
-//	Another bookkeeping function.
+//	Another bookkeeping function.  Returning 0 keeps unused dentries in
+//	the dcache, so lookups of hot names don't reach ospfs_dir_lookup.
+//	This is safe because each OSPFS inode has a single Linux inode whose
+//	link count is kept up to date.
 
 static int
 ospfs_delete_dentry(struct dentry *dentry)
 {
-	return 1;
+	return 0;
+}
+
+
+/*****************************************************************************
+ * DIRECTORY INDEX
+ *
+ *   Searching a directory entry by entry is linear in the size of the
+ *   directory, which makes bulk creates in big directories quadratic.
+ *   So OSPFS keeps an in-memory hash index for each directory it searches,
+ *   mapping the hash of each name to the offset of its directory entry.
+ *   A directory's index hangs off its in-memory inode ('ii_dirindex'), is
+ *   built the first time the directory is searched, and goes away with
+ *   the inode (ospfs_destroy_inode).  Create, link, symlink and unlink keep
+ *   it up to date.  The directory's i_mutex, which the VFS holds around
+ *   all of these, protects it.  Nothing is stored on disk, so this works
+ *   with any OSPFS image.
+ *
+ *   If memory runs out, the directory's index is dropped and the
+ *   directory is searched linearly instead.
+ */
+
+typedef struct ospfs_dirindex_entry {
+	uint32_t de_hash;			// Hash of the entry's name
+	uint32_t de_off;			// Offset of the entry
+	struct ospfs_dirindex_entry *de_next;
+} ospfs_dirindex_entry_t;
+
+typedef struct ospfs_dirindex {
+	uint32_t di_nentries;
+	uint32_t di_nbuckets;			// Always a power of 2
+	uint32_t di_freehint;			// No empty entries before this
+	ospfs_dirindex_entry_t **di_buckets;
+} ospfs_dirindex_t;
+
+#define DIRINDEX_MINBUCKETS	16
+
+// dirindex_find(dir)
+//	Returns the index for directory 'dir', or NULL if it has none.
+
+static inline ospfs_dirindex_t *
+dirindex_find(struct inode *dir)
+{
+	return ospfs_inode_info(dir)->ii_dirindex;
+}
+
+// dirindex_free(di)
+//	Frees an index that no directory points to.
+
+static void
+dirindex_free(ospfs_dirindex_t *di)
+{
+	uint32_t b;
+	ospfs_dirindex_entry_t *de;
+
+	for (b = 0; b < di->di_nbuckets; b++)
+		while ((de = di->di_buckets[b])) {
+			di->di_buckets[b] = de->de_next;
+			kfree(de);
+		}
+	vfree(di->di_buckets);
+	kfree(di);
+}
+
+// dirindex_drop(dir)
+//	Throws away the index for directory 'dir', if it has one.
+
+static void
+dirindex_drop(struct inode *dir)
+{
+	ospfs_inode_info_t *ii = ospfs_inode_info(dir);
+	if (ii->ii_dirindex) {
+		dirindex_free(ii->ii_dirindex);
+		ii->ii_dirindex = NULL;
+	}
+}
+
+// dirindex_insert(di, hash, off)
+//	Adds the entry at offset 'off', whose name hashes to 'hash', to 'di'.
+//	Doubles the number of buckets when the chains get long.
+//
+//   Returns: 0 on success, -ENOMEM if out of memory.
+
+static int
+dirindex_insert(ospfs_dirindex_t *di, uint32_t hash, uint32_t off)
+{
+	ospfs_dirindex_entry_t *de;
+
+	if (di->di_nentries >= 2 * di->di_nbuckets) {
+		uint32_t nbuckets = 2 * di->di_nbuckets, b;
+		ospfs_dirindex_entry_t **buckets =
+			vmalloc(nbuckets * sizeof(*buckets));
+		if (!buckets)
+			return -ENOMEM;
+		memset(buckets, 0, nbuckets * sizeof(*buckets));
+		for (b = 0; b < di->di_nbuckets; b++)
+			while ((de = di->di_buckets[b])) {
+				di->di_buckets[b] = de->de_next;
+				de->de_next = buckets[de->de_hash & (nbuckets - 1)];
+				buckets[de->de_hash & (nbuckets - 1)] = de;
+			}
+		vfree(di->di_buckets);
+		di->di_buckets = buckets;
+		di->di_nbuckets = nbuckets;
+	}
+
+	if (!(de = kmalloc(sizeof(*de), GFP_KERNEL)))
+		return -ENOMEM;
+	de->de_hash = hash;
+	de->de_off = off;
+	de->de_next = di->di_buckets[hash & (di->di_nbuckets - 1)];
+	di->di_buckets[hash & (di->di_nbuckets - 1)] = de;
+	di->di_nentries++;
+	return 0;
+}
+
+// dirindex_get(dir)
+//	Returns the index for directory 'dir', building it if necessary.
+//	Returns NULL if there isn't enough memory; the caller should then
+//	search the directory linearly.
+
+static ospfs_dirindex_t *
+dirindex_get(struct inode *dir)
+{
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
+	ospfs_dirindex_t *di = dirindex_find(dir);
+	uint32_t off;
+
+	if (di)
+		return di;
+
+	if (!(di = kmalloc(sizeof(*di), GFP_KERNEL)))
+		return NULL;
+	di->di_nentries = 0;
+	di->di_nbuckets = DIRINDEX_MINBUCKETS;
+	di->di_freehint = dir_oi->oi_size;
+	if (!(di->di_buckets = vmalloc(di->di_nbuckets * sizeof(*di->di_buckets)))) {
+		kfree(di);
+		return NULL;
+	}
+	memset(di->di_buckets, 0, di->di_nbuckets * sizeof(*di->di_buckets));
+
+	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
+		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
+		if (od->od_ino == 0) {
+			if (off < di->di_freehint)
+				di->di_freehint = off;
+			continue;
+		}
+		if (dirindex_insert(di, full_name_hash((const unsigned char *) od->od_name, strlen(od->od_name)), off) < 0) {
+			dirindex_free(di);
+			return NULL;
+		}
+	}
+
+	ospfs_inode_info(dir)->ii_dirindex = di;
+	return di;
+}
+
+// dirindex_add(dir, off, name, namelen)
+//	Records that directory 'dir' has an entry called 'name' at offset
+//	'off'.  Call this after filling in a new directory entry.
+
+static void
+dirindex_add(struct inode *dir, uint32_t off, const char *name, int namelen)
+{
+	ospfs_dirindex_t *di = dirindex_find(dir);
+	if (di && dirindex_insert(di, full_name_hash((const unsigned char *) name, namelen), off) < 0)
+		dirindex_drop(dir);
+}
+
+// dirindex_remove(dir, od)
+//	Removes directory entry 'od' from the index for 'dir'.  Call this
+//	before clearing the directory entry.
+
+static void
+dirindex_remove(struct inode *dir, ospfs_direntry_t *od)
+{
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
+	ospfs_dirindex_t *di = dirindex_find(dir);
+	ospfs_dirindex_entry_t **pde;
+	uint32_t hash;
+
+	if (!di)
+		return;
+
+	hash = full_name_hash((const unsigned char *) od->od_name, strlen(od->od_name));
+	for (pde = &di->di_buckets[hash & (di->di_nbuckets - 1)]; *pde;
+	     pde = &(*pde)->de_next)
+		if ((*pde)->de_hash == hash
+		    && ospfs_inode_data(dir_oi, (*pde)->de_off) == od) {
+			ospfs_dirindex_entry_t *de = *pde;
+			*pde = de->de_next;
+			if (de->de_off < di->di_freehint)
+				di->di_freehint = de->de_off;
+			di->di_nentries--;
+			kfree(de);
+			return;
+		}
 }
 
 
@@ -371,7 +2013,7 @@ ospfs_dir_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *ign
 	// Find the OSPFS inode corresponding to 'dir'
 	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
 	struct inode *entry_inode = NULL;
-	int entry_off;
+	ospfs_direntry_t *od;
 
 	// Make sure filename is not too long
 	if (dentry->d_name.len > OSPFS_MAXNAMELEN)
@@ -380,21 +2022,14 @@ ospfs_dir_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *ign
 	// Mark with our operations
 	dentry->d_op = &ospfs_dentry_ops;
 
-	// Search through the directory block
-	for (entry_off = 0; entry_off < dir_oi->oi_size;
-	     entry_off += OSPFS_DIRENTRY_SIZE) {
-		// Find the OSPFS inode for the entry
-		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, entry_off);
-
-		// Set 'entry_inode' if we find the file we are looking for
-		if (od->od_ino > 0
-		    && strlen(od->od_name) == dentry->d_name.len
-		    && memcmp(od->od_name, dentry->d_name.name, dentry->d_name.len) == 0) {
-			entry_inode = ospfs_mk_linux_inode(dir->i_sb, od->od_ino);
-			if (!entry_inode)
-				return (struct dentry *) ERR_PTR(-EINVAL);
-			break;
-		}
+	// Search through the directory
+	od = find_direntry(dir, dentry->d_name.name, dentry->d_name.len, NULL);
+
+	// Set 'entry_inode' if we find the file we are looking for
+	if (od) {
+		entry_inode = ospfs_mk_linux_inode(dir->i_sb, od->od_ino);
+		if (!entry_inode)
+			return (struct dentry *) ERR_PTR(-EINVAL);
 	}
 
 	// We return a dentry whether or not the file existed.
@@ -516,6 +2151,7 @@ ospfs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
 		 {
 			//Regular file
 		 	case OSPFS_FTYPE_REG: 
+		 	case OSPFS_FTYPE_XREG: 
 		 		file_type = DT_REG;
 		 		break;
 			// Directory
@@ -560,35 +2196,31 @@ static int
 ospfs_unlink(struct inode *dirino, struct dentry *dentry)
 {
 	ospfs_inode_t *oi = ospfs_inode(dentry->d_inode->i_ino);
-	ospfs_inode_t *dir_oi = ospfs_inode(dentry->d_parent->d_inode->i_ino);
-	int entry_off;
+	struct inode *dir = dentry->d_parent->d_inode;
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
 	ospfs_direntry_t *od;
+	uint32_t entry_off;
 
-	od = NULL; // silence compiler warning; entry_off indicates when !od
-	for (entry_off = 0; entry_off < dir_oi->oi_size;
-	     entry_off += OSPFS_DIRENTRY_SIZE) {
-		od = ospfs_inode_data(dir_oi, entry_off);
-		if (od->od_ino > 0
-		    && strlen(od->od_name) == dentry->d_name.len
-		    && memcmp(od->od_name, dentry->d_name.name, dentry->d_name.len) == 0)
-			break;
-	}
-
-	if (entry_off == dir_oi->oi_size) {
+	od = find_direntry(dir, dentry->d_name.name, dentry->d_name.len, &entry_off);
+	if (!od) {
 		printk("<1>ospfs_unlink should not fail!\n");
 		return -ENOENT;
 	}
 
+	dirindex_remove(dir, od);
 	od->od_ino = 0;
+	ospfs_block_dirty(ospfs_inode_blockno(dir_oi, entry_off));
 	oi->oi_nlink--;
+	drop_nlink(dentry->d_inode);
+	ospfs_inode_dirty(oi);
 
 	//lower the link count of parent dir
 	dir_oi->oi_nlink--;
+	ospfs_inode_dirty(dir_oi);
 
-	//no more link and if file type is not symbolic
-	if (oi->oi_nlink == 0 && oi->oi_ftype != OSPFS_FTYPE_SYMLINK)
-		change_size(oi, 0);
-
+	//a file with no more links may still be open or mapped; its blocks
+	//and its inode are freed when the last user lets go of it (see
+	//ospfs_delete_inode)
 	return 0;
 }
 
@@ -600,40 +2232,22 @@ ospfs_unlink(struct inode *dirino, struct dentry *dentry)
  * COMPLETED EXERCISE: Implement these functions.
  */
 
-// allocate_block()
-//	Use this function to allocate a block.
-//
-//   Inputs:  none
-//   Returns: block number of the allocated block,
-//	      or 0 if the disk is full
-//
-//   This function searches the free-block bitmap, which starts at Block 2, for
-//   a free block, allocates it (by marking it non-free), and returns the block
-//   number to the caller.  The block itself is not touched.
-//
-//   Note:  A value of 0 for a bit indicates the corresponding block is
-//      allocated; a value of 1 indicates the corresponding block is free.
-//
-//   You can use the functions bitvector_set(), bitvector_clear(), and
-//   bitvector_test() to do bit operations on the map.
+// The allocator itself is in ospfsalloc.h, so that allocbench.c can
+// measure it in user space.
+#include "ospfsalloc.h"
 
-static uint32_t
-allocate_block(void)
-{
-	void *freemap = ospfs_block(OSPFS_FREEMAP_BLK);
-	uint32_t i;
-	uint32_t r = 0;
 
-	for(i = OSPFS_FREEMAP_BLK; i < ospfs_super->os_nblocks; i++)
-	{
-		if(bitvector_test(freemap, i))
-		{
-			bitvector_clear(freemap, i);
-			r = i;
-			break;
-		}
-	}
-	return r;
+// ospfs_refcounts()
+//	Returns the reference count table (see SHARED BLOCKS in ospfs.h), an
+//	array indexed by block number, or NULL if the file system has none.
+//	The table is metadata, so using it never sleeps.
+
+static inline uint32_t *
+ospfs_refcounts(void)
+{
+	if (ospfs_super->os_nref == 0)
+		return NULL;
+	return ospfs_block(ospfs_super->os_refb);
 }
 
 
@@ -647,20 +2261,37 @@ allocate_block(void)
 //   bitmap.  (You might want to program defensively and make sure the block
 //   number isn't obviously bogus: the boot sector, superblock, free-block
 //   bitmap, and inode blocks must never be freed.  But this is not required.)
+//
+//   A shared block (see SHARED BLOCKS in ospfs.h) is not freed: it loses
+//   one reference instead.
 
 static void
 free_block(uint32_t blockno)
 {
-	// We can't free any block after the last inode block
-	uint32_t last_inode_block = ospfs_super->os_firstinob + OSPFS_BLKINODES;
-	void *freemap = ospfs_block(OSPFS_FREEMAP_BLK);
+	// We can't free the inode blocks, the reference counts, or anything
+	// before them
+	uint32_t first_data_block = ospfs_super->os_firstinob
+		+ (ospfs_super->os_ninodes + OSPFS_BLKINODES - 1) / OSPFS_BLKINODES
+		+ ospfs_super->os_nref;
+	uint32_t *freemap = ospfs_block(OSPFS_FREEMAP_BLK);
+	uint32_t *refs = ospfs_refcounts();
 
 	//sanity check
-	if(blockno >= ospfs_super->os_ninodes || blockno <= last_inode_block)
+	if (blockno < first_data_block || blockno >= ospfs_super->os_nblocks)
 		return;
 
-	// Free the block
-	bitvector_set(freemap, blockno);
+	spin_lock(&freemap_lock);
+	if (refs && refs[blockno] > 0) {
+		// Another file still uses the block.  This one's block map
+		// changed, so cursors are refilled as if it had been freed.
+		refs[blockno]--;
+		blockmap_gen++;
+		ospfs_block_dirty(ospfs_super->os_refb + blockno / OSPFS_BLKREFS);
+	} else if (!bitvector_test(freemap, blockno)) {
+		release_block(blockno);
+		blockmap_gen++;
+	}
+	spin_unlock(&freemap_lock);
 }
 
 
@@ -669,7 +2300,7 @@ free_block(uint32_t blockno)
  *
  * COMPLETED EXERCISE: Finish off change_size, read, and write.
  *
- * The find_*, add_block, and remove_block functions are only there to support
+ * The find_*, add_blocks, and remove_block functions are only there to support
  * the change_size function.  If you prefer to code change_size a different
  * way, then you may not need these functions.
  *
@@ -738,231 +2369,333 @@ indir_index(uint32_t b)
 // Returns: the index of block b in the relevant indirect block or the direct
 //	    block array.
 //
-// COMPLETED EXERCISE: Fill in this function.
+// COMPLETED EXERCISE: Fill in this function.
+
+static int32_t
+direct_index(uint32_t b)
+{
+	if(b < OSPFS_NDIRECT)
+		return b;
+
+	b -= OSPFS_NDIRECT;
+	return b % OSPFS_NINDIRECT;
+}
+
+
+// map_slots(oi, n, slot, slot_end)
+//   Finds where the block pointer for file block 'n' is stored, allocating
+//   the indirect and doubly-indirect blocks needed to hold it.  (Helper
+//   function for add_blocks.)
+//
+// Inputs:  oi       -- pointer to the file we want to grow
+//	    n        -- the zero-based index of the file block
+//	    slot     -- set to the address of block n's pointer
+//	    slot_end -- set to the end of the pointer array containing 'slot'
+// Returns: 0 if successful, < 0 on error.  Specifically:
+//	    -ENOSPC if an indirect block can't be allocated, or if the file
+//	    can't grow any larger, or
+//	    -EIO for any other error.
+//	    Newly allocated indirect blocks are erased and linked into the
+//	    inode.  On error, any blocks allocated by this call are freed.
+//
+// Block pointers n through n + (*slot_end - *slot) - 1 are stored
+// consecutively, so the caller can fill a whole run of them without
+// calling map_slots again.  The block holding them is marked dirty here,
+// since the caller is about to fill them; the caller marks the inode.
+
+static int
+map_slots(ospfs_inode_t *oi, uint32_t n, uint32_t **slot, uint32_t **slot_end)
+{
+	uint32_t *indir_data;
+	uint32_t *double_indir_data;
+	uint32_t indir_block;
+	uint32_t allocated2 = 0;
+
+	if (n >= OSPFS_MAXFILEBLKS)
+		return -ENOSPC;
+
+	if (indir_index(n) == -1) {
+		*slot = &oi->oi_direct[n];
+		*slot_end = &oi->oi_direct[OSPFS_NDIRECT];
+		return 0;
+	}
+
+	if (indir2_index(n) == -1) {
+		if (oi->oi_indirect == 0) {
+			if ((oi->oi_indirect = allocate_block()) == 0)
+				return -ENOSPC;
+			memset(ospfs_block(oi->oi_indirect), 0, OSPFS_BLKSIZE);
+		}
+		indir_block = oi->oi_indirect;
+	} else {
+		if (oi->oi_indirect2 == 0) {
+			if ((allocated2 = allocate_block()) == 0)
+				return -ENOSPC;
+			memset(ospfs_block(allocated2), 0, OSPFS_BLKSIZE);
+			oi->oi_indirect2 = allocated2;
+		}
+		double_indir_data = ospfs_block(oi->oi_indirect2);
+
+		if (double_indir_data[indir_index(n)] == 0) {
+			indir_block = allocate_block();
+			if (indir_block == 0) {
+				if (allocated2) {
+					free_block(allocated2);
+					oi->oi_indirect2 = 0;
+				}
+				return -ENOSPC;
+			}
+			memset(ospfs_block(indir_block), 0, OSPFS_BLKSIZE);
+			double_indir_data[indir_index(n)] = indir_block;
+			ospfs_block_dirty(oi->oi_indirect2);
+		}
+		indir_block = double_indir_data[indir_index(n)];
+	}
+
+	indir_data = ospfs_block(indir_block);
+	if (indir_data[direct_index(n)] != 0)
+		return -EIO;
+	ospfs_block_dirty(indir_block);
+	*slot = &indir_data[direct_index(n)];
+	*slot_end = &indir_data[OSPFS_NINDIRECT];
+	return 0;
+}
+
+
+// extent_append(xi, n, blockno, count)
+//   Maps file blocks n through n + count - 1 of an extent-mapped file to
+//   disk blocks blockno through blockno + count - 1.  Block n must be the
+//   block right after the file's last mapped block.  (Helper function for
+//   add_blocks.)
+//
+// Inputs:  xi      -- pointer to the extent-mapped file we want to grow
+//	    n       -- the zero-based index of the first file block
+//	    blockno -- the first disk block
+//	    count   -- the number of blocks
+// Returns: 0 if successful, -ENOSPC if a new extent block is needed and
+//	    the disk is full.
+//
+// If the new blocks continue the file's last extent on disk, that extent
+// just gets longer.  Otherwise a new extent is added, in the inode if
+// there is room, or else at the end of the extent block chain.
+
+static int
+extent_append(ospfs_extent_inode_t *xi, uint32_t n, uint32_t blockno, uint32_t count)
+{
+	ospfs_extent_block_t *xb = NULL;
+	ospfs_extent_t *e = NULL;
+	uint32_t xbno = 0;
+
+	// Find the last extent, and the last extent block if there is one
+	if (xi->oi_extblock != 0) {
+		xb = ospfs_block(xbno = xi->oi_extblock);
+		while (xb->oeb_next != 0)
+			xb = ospfs_block(xbno = xb->oeb_next);
+	}
+	if (xi->oi_nextents > OSPFS_NIEXTENTS && xb->oeb_nextents > 0)
+		e = &xb->oeb_extents[xb->oeb_nextents - 1];
+	else if (xi->oi_nextents > 0)
+		e = &xi->oi_extents[xi->oi_nextents - 1];
+
+	if (e && e->oe_lblock + e->oe_len == n
+	    && e->oe_pblock + e->oe_len == blockno) {
+		e->oe_len += count;
+		if (xi->oi_nextents > OSPFS_NIEXTENTS)
+			ospfs_block_dirty(xbno);
+		return 0;
+	}
+
+	if (xi->oi_nextents < OSPFS_NIEXTENTS)
+		e = &xi->oi_extents[xi->oi_nextents];
+	else {
+		if (!xb || xb->oeb_nextents == OSPFS_NBEXTENTS) {
+			uint32_t new_xbno = allocate_block();
+			if (new_xbno == 0)
+				return -ENOSPC;
+			memset(ospfs_block(new_xbno), 0, OSPFS_BLKSIZE);
+			if (xb) {
+				xb->oeb_next = new_xbno;
+				ospfs_block_dirty(xbno);
+			} else
+				xi->oi_extblock = new_xbno;
+			xb = ospfs_block(xbno = new_xbno);
+		}
+		e = &xb->oeb_extents[xb->oeb_nextents];
+		ospfs_block_dirty(xbno);
+	}
+
+	// Lock-free readers see the extent only once it is filled in
+	e->oe_lblock = n;
+	e->oe_pblock = blockno;
+	e->oe_len = count;
+	smp_wmb();
+	if (xi->oi_nextents >= OSPFS_NIEXTENTS)
+		xb->oeb_nextents++;
+	xi->oi_nextents++;
+	return 0;
+}
+
+
+// extent_trim(e, want_blocks)
+//   Frees the blocks of extent 'e' that map file blocks at or after
+//   'want_blocks', and shortens 'e' to match.  (Helper function for
+//   extent_truncate.)
+//
+// Returns: 1 if 'e' still maps any blocks, 0 if it is now empty.
+
+static int
+extent_trim(ospfs_extent_t *e, uint32_t want_blocks)
+{
+	while (e->oe_len > 0 && e->oe_lblock + e->oe_len > want_blocks) {
+		e->oe_len--;
+		free_block(e->oe_pblock + e->oe_len);
+	}
+	return e->oe_len > 0;
+}
+
+
+// extent_truncate(oi, want_blocks)
+//   Shrinks an extent-mapped file to 'want_blocks' blocks in one pass over
+//   its extents, freeing data blocks and any extent blocks that become
+//   empty.  (Helper function for remove_block and change_size.)
+//
+// Inputs:  oi          -- pointer to the extent-mapped file
+//	    want_blocks -- the number of blocks the file should keep
+// Returns: 0.  oi->oi_size is set to the maximum file size that could fit
+//	    in the remaining blocks, if that is smaller than the current size.
 
-static int32_t
-direct_index(uint32_t b)
+static int
+extent_truncate(ospfs_inode_t *oi, uint32_t want_blocks)
 {
-	if(b < OSPFS_NDIRECT)
-		return b;
+	ospfs_extent_inode_t *xi = (ospfs_extent_inode_t *) oi;
+	uint32_t *link = &xi->oi_extblock;
+	uint32_t link_bno = 0;		// Block holding 'link', 0 for the inode
+	uint32_t i, kept = 0;
+
+	for (i = 0; i < xi->oi_nextents && i < OSPFS_NIEXTENTS; i++)
+		kept += extent_trim(&xi->oi_extents[i], want_blocks);
+
+	while (*link != 0) {
+		uint32_t xbno = *link;
+		ospfs_extent_block_t *xb = ospfs_block(xbno);
+		uint32_t nkept = 0, changed = 0;
+
+		// Extents are sorted, so the block changes only if its last
+		// extent ends past 'want_blocks', and the empty ones are at
+		// the end
+		if (xb->oeb_nextents > 0) {
+			ospfs_extent_t *last = &xb->oeb_extents[xb->oeb_nextents - 1];
+			changed = (last->oe_lblock + last->oe_len > want_blocks);
+		}
+		for (i = 0; i < xb->oeb_nextents; i++)
+			nkept += extent_trim(&xb->oeb_extents[i], want_blocks);
+		xb->oeb_nextents = nkept;
+		kept += nkept;
+
+		if (nkept == 0) {
+			*link = xb->oeb_next;
+			if (link_bno)
+				ospfs_block_dirty(link_bno);
+			free_block(xbno);
+		} else {
+			if (changed)
+				ospfs_block_dirty(xbno);
+			link = &xb->oeb_next;
+			link_bno = xbno;
+		}
+	}
 
-	b -= OSPFS_NDIRECT;
-	return b % OSPFS_NINDIRECT;
+	xi->oi_nextents = kept;
+	if (ospfs_size(oi) > (uint64_t) want_blocks << OSPFS_BLKSIZE_BITS)
+		ospfs_set_size(oi, (uint64_t) want_blocks << OSPFS_BLKSIZE_BITS);
+	return 0;
 }
 
 
-// add_block(ospfs_inode_t *oi)
-//   Adds a single data block to a file, adding indirect and
+// add_blocks(ospfs_inode_t *oi, uint32_t want_blocks, uint32_t max_runs)
+//   Grows a file to 'want_blocks' data blocks, adding indirect and
 //   doubly-indirect blocks if necessary. (Helper function for
-//   change_size).
+//   change_size and resize_file).
 //
-// Inputs: oi -- pointer to the file we want to grow
+// Inputs: oi          -- pointer to the file we want to grow
+//	   want_blocks -- the number of data blocks the file should have
+//	   max_runs    -- if not 0, stop after allocating this many runs,
+//			  even if the file is still short of 'want_blocks'
 // Returns: 0 if successful, < 0 on error.  Specifically:
 //          -ENOSPC if you are unable to allocate a block
 //          due to the disk being full or
 //          -EIO for any other error.
-//          If the function is successful, then oi->oi_size
-//          should be set to the maximum file size in bytes that could
-//          fit in oi's data blocks.  If the function returns an error,
-//          then oi->oi_size should remain unchanged. Any newly
-//          allocated blocks should be erased (set to zero).
-//
-// COMPLETED EXERCISE: Finish off this function.
-//
-// Remember that allocating a new data block may require allocating
-// as many as three disk blocks, depending on whether a new indirect
-// block and/or a new indirect^2 block is required. If the function
-// fails with -ENOSPC or -EIO, then you need to make sure that you
-// free any indirect (or indirect^2) blocks you may have allocated!
+//          After each block is added, oi->oi_size is set to the maximum
+//          file size in bytes that could fit in oi's data blocks, so on
+//          error the blocks added so far can be removed with remove_block.
+//          Any newly allocated blocks are erased (set to zero).
 //
-// Also, make sure you:
-//  1) zero out any new blocks that you allocate
-//  2) store the disk block number of any newly allocated block
-//     in the appropriate place in the inode or one of the
-//     indirect blocks.
-//  3) update the oi->oi_size field
+// Data blocks are allocated as contiguous runs with allocate_blocks,
+// starting just after the file's current last block when possible, and
+// each run is stored into the direct/indirect/doubly-indirect pointer
+// arrays in one pass.  This way a large write costs one bitmap search per
+// run rather than one per block.  For an extent-mapped file, each run
+// becomes (or extends) a single extent.
 
 static int
-add_block(ospfs_inode_t *oi)
+add_blocks(ospfs_inode_t *oi, uint32_t want_blocks, uint32_t max_runs)
 {
 	// current number of blocks in file
-	uint32_t n = ospfs_size2nblocks(oi->oi_size);
-
-	// keep track of allocations to free in case of -ENOSPC
-	uint32_t allocated[2] = { 0, 0 };
-
-	int32_t index_indir2;
-	int32_t index_indir;
-	int32_t index_direct;
-
-	uint32_t indir_block = 0;
-	uint32_t double_indir_block = 0;
-	//uint32_t data_block;
-	
-	uint32_t *indir_data = NULL;
-	uint32_t *double_indir_data = NULL;
-
-	const int INDIR_2_CONST = 0;
-	const int INDIR_1_CONST = 1;
-	int r = -ENOSPC;
-
-	/* COMPLETED EXERCISE: Your code here */
-
-	if(n == OSPFS_MAXFILEBLKS)
-		return -ENOSPC;
-
-	index_indir2 = indir2_index(n);
-	index_indir  = indir_index(n);
-	index_direct = direct_index(n);
-
-	
-	//eprintk("index_indir2 is :%d\n",index_indir2 );
-	//eprintk("index_indir  is :%d\n",index_indir );
-	//eprintk("index_direct is :%d\n",index_direct);
-	
-	if(index_indir == -1) //data block in inode->direct
-	{
-		// Sanity check
-		if(oi->oi_direct[index_direct] != 0)
-			return -EIO;
-
-		if((allocated[0] = allocate_block()) == 0)
-		{
-			free_block(allocated[0]);
+	uint32_t n = ospfs_size2nblocks(ospfs_size(oi));
+	uint32_t *slot = NULL, *slot_end = NULL;
+	uint32_t hint = 0, nruns = 0;
+	int r;
+
+	if (n > 0)
+		hint = ospfs_inode_blockno(oi, (uint64_t) (n - 1) << OSPFS_BLKSIZE_BITS) + 1;
+
+	while (n < want_blocks && (!max_runs || nruns < max_runs)) {
+		uint32_t count;
+		uint32_t b = allocate_blocks(want_blocks - n, hint, &count);
+		if (b == 0)
 			return -ENOSPC;
+		hint = b + count;
+		nruns++;
+
+		if (oi->oi_ftype == OSPFS_FTYPE_XREG) {
+			uint32_t i;
+			if ((r = extent_append((ospfs_extent_inode_t *) oi, n, b, count)) < 0) {
+				for (; count > 0; count--, b++)
+					free_block(b);
+				return r;
+			}
+			for (i = 0; i < count; i++) {
+				struct buffer_head *bh;
+				memset(ospfs_data_new(b + i, &bh), 0, OSPFS_BLKSIZE);
+				ospfs_data_put(b + i, bh, 1);
+			}
+			n += count;
+			ospfs_set_size(oi, (uint64_t) n << OSPFS_BLKSIZE_BITS);
+			continue;
 		}
-		memset(ospfs_block(allocated[0]), 0, OSPFS_BLKSIZE);
-		oi->oi_direct[index_direct] = allocated[0];
-		eprintk("allocating direct block of index %d, using block:%d.\n",index_direct,allocated[0]);
-		oi->oi_size = (n + 1) * OSPFS_BLKSIZE;
-		return 0;
-	}
-	//indir mechanisms
-	if(index_indir2 == 0) // If we need the double indirect block
-	{
-		if(oi->oi_indirect2 == 0) // and it is null, allocate it
-		{
-			if((allocated[INDIR_2_CONST] = allocate_block()) == 0)
-				goto ERR_HANDLE;
-
-			double_indir_block = allocated[INDIR_2_CONST];
-			double_indir_data = ospfs_block(double_indir_block);
-			//eprintk("allocating indir2 ptr, using block:%d.\n",double_indir_block);
-			//zero out
-			memset(double_indir_data, 0, OSPFS_BLKSIZE);
-		}
-		else // otherwise use the existing indirect2
-		{
-			double_indir_block = oi->oi_indirect2;
-			//eprintk("using existed indir2 ptr, using block:%d.\n",double_indir_block);
-			double_indir_data = ospfs_block(double_indir_block);
-		}
-
-		// Allocate the indirect block if needed
-		if(double_indir_data[index_indir] == 0)
-		{
-			if((allocated[INDIR_1_CONST] = allocate_block()) == 0)
-				goto ERR_HANDLE;
-
-			indir_block = allocated[INDIR_1_CONST];
-			indir_data = ospfs_block(indir_block);
-			//eprintk("allocating dir2->indir ptr, using block:%d.\n",indir_block);
-			//zero out
-			memset(indir_data, 0, OSPFS_BLKSIZE);
-		}
-		
-		if((indir_data[index_direct] = allocate_block()) == 0)
-			goto ERR_HANDLE;
-		memset(ospfs_block(indir_data[index_direct]), 0, OSPFS_BLKSIZE);
-		//update size linkage
-		oi->oi_size = (n + 1) * OSPFS_BLKSIZE;
-		
-		if(oi->oi_indirect2 == 0)
-			oi->oi_indirect2 = double_indir_block;
 
-		if(double_indir_data[index_indir] == 0)
-			double_indir_data[index_indir] = indir_block;
-			
-		eprintk("allocating indirect2 block using block:%d.\n",double_indir_block);
-		eprintk("allocating direct block using block:%d.\n",indir_data[index_direct]);
-	}
-
-	// not using dir2 nor do we have enough direct
-	// we use the indirect block
-	else
-	{
-		//if indir not created yet
-		if(oi->oi_indirect == 0)
-		{
-			if((oi->oi_indirect = allocate_block()) == 0)
-				goto ERR_HANDLE;
-			eprintk("allocating indirect1 block using block:%d.\n",oi->oi_indirect);
-			indir_block = oi->oi_indirect;
-			memset(ospfs_block(indir_block), 0, OSPFS_BLKSIZE);
+		for (; count > 0; count--, b++, n++) {
+			if (slot == slot_end
+			    && (r = map_slots(oi, n, &slot, &slot_end)) < 0) {
+				// free the part of the run we couldn't map
+				for (; count > 0; count--, b++)
+					free_block(b);
+				return r;
+			}
+			if (oi->oi_ftype == OSPFS_FTYPE_DIR) {
+				memset(ospfs_block(b), 0, OSPFS_BLKSIZE);
+				ospfs_block_dirty(b);
+			} else {
+				struct buffer_head *bh;
+				memset(ospfs_data_new(b, &bh), 0, OSPFS_BLKSIZE);
+				ospfs_data_put(b, bh, 1);
+			}
+			*slot++ = b;
+			oi->oi_size = (n + 1) * OSPFS_BLKSIZE;
 		}
-		else//already have indir
-			indir_block = oi->oi_indirect;
-			
-		//indir_block = allocated[INDIR_1_CONST];
-		indir_data = ospfs_block(indir_block);
-		//zero ou
-		//adding
-		if((indir_data[index_direct] = allocate_block()) == 0)
-			goto ERR_HANDLE;
-		memset(ospfs_block(indir_data[index_direct]), 0, OSPFS_BLKSIZE);
-		//update size linkage
-		oi->oi_size = (n + 1) * OSPFS_BLKSIZE;
-		
-		eprintk("allocating direct under indirect: %d, data block using block:%d.\n",oi->oi_indirect,indir_data[index_direct]);
 	}
 
-	// Sanity check that there is no existing allocated block
-	/*if(indir_data[index_direct] != 0)
-	{
-		r = -EIO;
-		goto ERR_HANDLE;
-	}
-	*/
-	// Allocate the actual block
-	//if((indir_data[index_direct] = allocate_block()) == 0)
-	//	goto ERR_HANDLE;
-
-	//zero out
-	//memset(ospfs_block(indir_data[index_direct]), 0, OSPFS_BLKSIZE);
-
-	//update size
-	//oi->oi_size = (n + 1) * OSPFS_BLKSIZE;
-
-	//update linkage
-	//doubly
-	/*if(index_indir2 == 0)
-	{
-		if(oi->oi_indirect2 == 0)
-			oi->oi_indirect2 = double_indir_block;
-
-		if(double_indir_data[index_indir] == 0)
-			double_indir_data[index_indir] = indir_block;
-			
-		eprintk("allocating indirect2 block using block:%d.\n",double_indir_block);
-	}
-	//singly
-	else if(oi->oi_indirect == 0)
-	{
-		oi->oi_indirect = indir_block;
-		eprintk("allocating indirect1 block using block:%d.\n",indir_block);
-	}
-	eprintk("allocating direct block using block:%d.\n",indir_data[index_direct]);
-	*/
 	return 0;
-
-	ERR_HANDLE:
-		if(allocated[INDIR_2_CONST] != 0)
-			free_block(allocated[INDIR_2_CONST]);
-
-		if(allocated[INDIR_1_CONST] != 0)
-			free_block(allocated[INDIR_1_CONST]);
-
-		return r;
 }
 
 
@@ -992,7 +2725,7 @@ static int
 remove_block(ospfs_inode_t *oi)
 {
 	// current number of blocks in file
-	uint32_t n = ospfs_size2nblocks(oi->oi_size);
+	uint32_t n = ospfs_size2nblocks(ospfs_size(oi));
 
 	int32_t index_indir2;
 	int32_t index_indir;
@@ -1012,6 +2745,9 @@ remove_block(ospfs_inode_t *oi)
 	else
 		n--;
 
+	if (oi->oi_ftype == OSPFS_FTYPE_XREG)
+		return extent_truncate(oi, n);
+
 	index_indir2 = indir2_index(n);
 	index_indir  = indir_index(n);
 	index_direct = direct_index(n);
@@ -1052,6 +2788,7 @@ remove_block(ospfs_inode_t *oi)
 	// Free the last data block
 	free_block(indir_data[index_direct]);
 	indir_data[index_direct] = 0;
+	ospfs_block_dirty(indir_block);
 	oi->oi_size = n * OSPFS_BLKSIZE;
 
 	//if the last data block is the only on for indir
@@ -1062,8 +2799,10 @@ remove_block(ospfs_inode_t *oi)
 
 		if(index_indir2 == -1)
 			oi->oi_indirect = 0;
-		else
+		else {
 			double_indir_data[index_indir] = 0;
+			ospfs_block_dirty(double_indir_block);
+		}
 
 		//if the dir block being removed is the only indir that indir2 has
 		//we remove indir2 with it
@@ -1084,8 +2823,12 @@ remove_block(ospfs_inode_t *oi)
 //
 //   Inputs:  oi	-- pointer to the file whose size we're changing
 //	      want_size -- the requested size in bytes
+//   Locking: the caller must hold the file's 'ii_sem' for writing, or the
+//	      i_mutex of a directory (see LOCKING), and be between
+//	      journal_start and journal_stop.
 //   Returns: 0 on success, < 0 on error.  In particular:
 //		-ENOSPC: if there are no free blocks available
+//		-EFBIG:  if want_size is past ospfs_max_size(oi)
 //		-EIO:    an I/O error -- for example an indirect block should
 //			 exist, but doesn't
 //	      If the function succeeds, the file's oi_size member should be
@@ -1101,47 +2844,793 @@ remove_block(ospfs_inode_t *oi)
 //   is good -- the function is pretty easy.  But the function might have
 //   to add or remove blocks.
 //
-//   If you need to grow the file, then do so by adding one block at a time
-//   using the add_block function you coded above. If one of these additions
-//   fails with -ENOSPC, you must shrink the file back to its original size!
+//   If you need to grow the file, then do so with the add_blocks function
+//   above, which adds whole runs of blocks at once. If it fails with
+//   -ENOSPC, you must shrink the file back to its original size!
 //
 //   If you need to shrink the file, remove blocks from the end of
 //   the file one at a time using the remove_block function you coded above.
 //
 //   Also: Don't forget to change the size field in the metadata of the file.
-//         (The value that the final add_block or remove_block set it to
+//         (The value that the final add_blocks or remove_block set it to
 //          is probably not correct).
 //
 //   COMPLETED EXERCISE: Finish off this function.
 
 static int
-change_size(ospfs_inode_t *oi, uint32_t new_size)
+change_size(ospfs_inode_t *oi, uint64_t new_size)
 {
-	uint32_t old_size = oi->oi_size;
+	uint64_t old_size = ospfs_size(oi);
 	int r = 0;
 
-	while (ospfs_size2nblocks(oi->oi_size) < ospfs_size2nblocks(new_size)) {
-		r = add_block(oi);
+	if (new_size > ospfs_max_size(oi))
+		return -EFBIG;
+
+	if (ospfs_size2nblocks(old_size) < ospfs_size2nblocks(new_size)) {
+		r = add_blocks(oi, ospfs_size2nblocks(new_size), 0);
+
+		//if we don't have enough free blocks too accommandate,
+		//set new_size to old size and shrink it back to its original
+		if(r == -ENOSPC)
+			new_size = old_size;
+
+		if(r == -EIO) {
+			ospfs_inode_dirty(oi);
+			return -EIO;
+		}
+	}
+	// Extent-mapped files can drop all the blocks at once
+	if (oi->oi_ftype == OSPFS_FTYPE_XREG
+	    && ospfs_size2nblocks(ospfs_size(oi)) > ospfs_size2nblocks(new_size))
+		extent_truncate(oi, ospfs_size2nblocks(new_size));
+	while (ospfs_size2nblocks(ospfs_size(oi)) > ospfs_size2nblocks(new_size)) {
+		if(remove_block(oi) == -EIO) {
+			ospfs_inode_dirty(oi);
+			return -EIO;
+		}
+	}
+
+	// Reset the size back to what it was if the file grew, or down to what it shrank to
+	ospfs_set_size(oi, new_size);
+	ospfs_inode_dirty(oi);
+	return r;
+}
+
+
+// journal_step(oi, from, to, nruns, shared)
+//	Plans one journal operation of a change to regular file 'oi' that
+//	works through its blocks from file block 'from' toward file block
+//	'to': up through 'to' - 1, or, if 'to' < 'from', down through 'to'
+//	from 'from' - 1, as a shrink does.  Counts the runs of contiguous disk
+//	blocks among them (among the shared ones only, if 'shared' is set),
+//	and stops where the next block would make the operation's
+//	JOURNAL_FILE_CREDITS outgrow the journal.  '*nruns' comes in as the
+//	runs the operation needs besides these, and goes out with them added.
+//
+//   Locking: the caller keeps the file's block map from changing.
+//   Returns: the block the operation should stop at: 'to' if all of them
+//	      fit, and never 'from' unless 'from' == 'to'.
+
+static uint64_t
+journal_step(ospfs_inode_t *oi, uint64_t from, uint64_t to, uint32_t *nruns,
+	     int shared)
+{
+	ospfs_blockmap_cursor_t bc;
+	uint32_t prev = 0, prev_first = 0;
+	uint64_t b;
+
+	if (!journal_cap)
+		return to;
+	memset(&bc, 0, sizeof(bc));
+	for (b = from; b != to; b = (to < from ? b - 1 : b + 1)) {
+		uint64_t n = (to < from ? b - 1 : b);
+		uint64_t span = (to < from ? from - n : n + 1 - from);
+		uint32_t blockno = ospfs_cursor_blockno(&bc, oi, n << OSPFS_BLKSIZE_BITS);
+		uint32_t more = 0;
+
+		// A new run starts at a jump on disk, or at a new extent or
+		// indirect block
+		if (blockno && (!shared || block_shared(blockno)))
+			more = (!prev || bc.bc_first != prev_first
+				|| blockno != (to < from ? prev - 1 : prev + 1));
+		if (b != from && JOURNAL_FILE_CREDITS(*nruns + more, span) > journal_cap)
+			break;
+		*nruns += more;
+		if (blockno && (!shared || block_shared(blockno))) {
+			prev = blockno;
+			prev_first = bc.bc_first;
+		}
+	}
+	return b;
+}
+
+
+// resize_file(inode, oi, new_size)
+//	change_size for regular file 'oi', as a series of journal operations
+//	that each add or remove as many blocks as their credits allow (see
+//	journal_step), so that a resize of any size fits in the journal.  Each
+//	step takes the resize lock of 'inode', if it isn't NULL, so other
+//	operations can run in between.  A file that can't grow all the way
+//	shrinks back to its old size, as with change_size.
+//
+//   Locking: the caller is not in a journal operation, and keeps other
+//	      resizes out (with i_mutex, or because nothing else can use
+//	      the file), so the block map holds still between steps.
+//	      Lock-free readers must already be kept out of blocks that will
+//	      be removed (resize_shrink); the caller shows them growth
+//	      (resize_publish).
+//   Returns: 0 on success, < 0 on error, as for change_size.
+
+static int
+resize_file(struct inode *inode, ospfs_inode_t *oi, uint64_t new_size)
+{
+	uint64_t old_size = ospfs_size(oi);
+	uint64_t want = ospfs_size2nblocks(new_size);
+	int r;
+
+	if (new_size > ospfs_max_size(oi))
+		return -EFBIG;
+	do {
+		uint64_t n = ospfs_size2nblocks(ospfs_size(oi));
+		uint64_t m = want, credits;
+		uint32_t nruns = 0;
+
+		// Growth allocates runs that can't be counted in advance, so
+		// it is done a few runs at a time
+		if (want > n) {
+			uint64_t chunk;
+			nruns = min_t(uint64_t, want - n, JOURNAL_STEP_RUNS);
+			chunk = journal_file_blocks(nruns);
+			if (chunk && want > n + chunk)
+				m = n + chunk;
+		} else if (want < n)
+			m = journal_step(oi, n, want, &nruns, 0);
+		credits = JOURNAL_FILE_CREDITS(nruns, m > n ? m - n : n - m);
+
+		journal_start(credits);
+		if (inode)
+			resize_lock(inode);
+		if (m > n) {
+			r = add_blocks(oi, m, nruns);
+			if (r != -EIO)
+				ospfs_set_size(oi, min(new_size, ospfs_size(oi)));
+			ospfs_inode_dirty(oi);
+		} else
+			r = change_size(oi, m == want ? new_size : m << OSPFS_BLKSIZE_BITS);
+		if (inode)
+			resize_unlock(inode);
+		journal_stop(credits, 0);
+	} while (r == 0 && ospfs_size(oi) != new_size);
+
+	if (r == -ENOSPC && new_size > old_size)
+		resize_file(inode, oi, old_size);
+	return r;
+}
+
+
+// Shared blocks
+//	On a file system with a reference count table (see SHARED BLOCKS in
+//	ospfs.h), a data block of a regular file may belong to other files
+//	too.  Whatever changes file data first calls unshare_range, which
+//	gives the file its own copy of each shared block it is about to
+//	change and points the file's block map at the copy.  free_block
+//	drops a reference to a shared block rather than freeing it, so
+//	change_size, truncate and unlink need nothing more.
+//
+//	The counts change under 'freemap_lock'.  Only clone_blockmap adds
+//	references, and it keeps the source file's writers out while it does
+//	(see ospfs_ioctl), so a file's writer may test its blocks' counts
+//	without the lock: a count seen as 0 stays 0 until the writer is done.
+
+// block_shared(blockno)
+//	Returns nonzero if block 'blockno' belongs to more than one file.
+
+static inline int
+block_shared(uint32_t blockno)
+{
+	uint32_t *refs = ospfs_refcounts();
+	return refs && blockno < ospfs_super->os_nblocks && refs[blockno] > 0;
+}
+
+
+// block_slot(oi, n, slot_bno)
+//	Returns the address of the pointer to file block 'n' of the
+//	direct/indirect-mapped file 'oi', which must exist, and sets
+//	'*slot_bno' to the indirect block holding it, or 0 for the inode.
+
+static uint32_t *
+block_slot(ospfs_inode_t *oi, uint32_t n, uint32_t *slot_bno)
+{
+	if (n < OSPFS_NDIRECT) {
+		*slot_bno = 0;
+		return &oi->oi_direct[n];
+	} else if (n < OSPFS_NDIRECT + OSPFS_NINDIRECT) {
+		*slot_bno = oi->oi_indirect;
+		return (uint32_t *) ospfs_block(oi->oi_indirect) + (n - OSPFS_NDIRECT);
+	} else {
+		uint32_t blockoff = n - (OSPFS_NDIRECT + OSPFS_NINDIRECT);
+		uint32_t *indirect2_block = ospfs_block(oi->oi_indirect2);
+		*slot_bno = indirect2_block[blockoff / OSPFS_NINDIRECT];
+		return (uint32_t *) ospfs_block(*slot_bno) + blockoff % OSPFS_NINDIRECT;
+	}
+}
+
+
+// extent_dirty(xi, xbno)
+//	Marks extent block 'xbno' dirty, or inode 'xi' if 'xbno' is 0.
+
+static inline void
+extent_dirty(ospfs_extent_inode_t *xi, uint32_t xbno)
+{
+	if (xbno)
+		ospfs_block_dirty(xbno);
+	else
+		ospfs_inode_dirty((ospfs_inode_t *) xi);
+}
+
+
+// extent_put(ext, count, e, n, blockno)
+//   Appends extent 'e' to the array 'ext', which holds 'count' extents.
+//   If 'e' maps file block 'n', it is split in up to three so that 'n'
+//   maps to disk block 'blockno'.  (Helper function for extent_split.)
+//
+// Returns: the new number of extents in 'ext'.
+
+static uint32_t
+extent_put(ospfs_extent_t *ext, uint32_t count, const ospfs_extent_t *e,
+	   uint32_t n, uint32_t blockno)
+{
+	uint32_t k = n - e->oe_lblock;
+
+	if (n < e->oe_lblock || k >= e->oe_len) {
+		ext[count++] = *e;
+		return count;
+	}
+	if (k > 0) {
+		ext[count].oe_lblock = e->oe_lblock;
+		ext[count].oe_pblock = e->oe_pblock;
+		ext[count++].oe_len = k;
+	}
+	ext[count].oe_lblock = n;
+	ext[count].oe_pblock = blockno;
+	ext[count++].oe_len = 1;
+	if (k + 1 < e->oe_len) {
+		ext[count].oe_lblock = n + 1;
+		ext[count].oe_pblock = e->oe_pblock + k + 1;
+		ext[count++].oe_len = e->oe_len - (k + 1);
+	}
+	return count;
+}
+
+
+// extent_insert(ext, count, i, piece, npieces)
+//   Replaces extent 'i' of the array 'ext', which holds '*count' extents,
+//   with the 'npieces' extents in 'piece', and updates '*count'.  The
+//   array must have room.  (Helper function for extent_split.)
+
+static void
+extent_insert(ospfs_extent_t *ext, uint32_t *count, uint32_t i,
+	      const ospfs_extent_t *piece, uint32_t npieces)
+{
+	memmove(&ext[i + npieces], &ext[i + 1], (*count - i - 1) * sizeof(*ext));
+	memcpy(&ext[i], piece, npieces * sizeof(*ext));
+	*count += npieces - 1;
+}
+
+
+// extent_split(xi, seq, n, blockno)
+//   Maps file block 'n' of extent-mapped file 'xi' to disk block 'blockno'
+//   by splitting the extent that maps it in up to three.  Only the array
+//   holding that extent changes.  If an extent block has no room, its
+//   second half moves to a new extent block linked after it; if the inode
+//   has no room, the extents pushed out of it go to the front of the
+//   chain.  So a split changes the inode and at most two extent blocks,
+//   however long the chain is.  The change is made inside a write section
+//   of 'seq' (see LOCKING).  (Helper function for extent_remap.)
+//
+// Returns: 0 if successful, or < 0 on error, leaving the extents as they
+//	    were.  Specifically:
+//	    -ENOSPC if another extent block is needed and the disk is full, or
+//	    -EIO if no extent maps 'n'.
+
+static int
+extent_split(ospfs_extent_inode_t *xi, seqcount_t *seq, uint32_t n, uint32_t blockno)
+{
+	ospfs_extent_t piece[3], ext[OSPFS_NIEXTENTS + 2], *e;
+	ospfs_extent_block_t *xb = NULL, *nb = NULL;
+	uint32_t xbno, nbno = 0, npieces, count, over = 0, i, k;
+
+	if (!(e = ospfs_extent_find(xi, n, &xbno)))
+		return -EIO;
+	npieces = extent_put(piece, 0, e, n, blockno);
+
+	if (xbno) {
+		xb = ospfs_block(xbno);
+		i = e - xb->oeb_extents;
+		if (xb->oeb_nextents + npieces - 1 > OSPFS_NBEXTENTS) {
+			if ((nbno = allocate_block()) == 0)
+				return -ENOSPC;
+			nb = ospfs_block(nbno);
+			memset(nb, 0, OSPFS_BLKSIZE);
+		}
+
+		write_seqcount_begin(seq);
+		if (nb) {
+			k = xb->oeb_nextents / 2;
+			nb->oeb_nextents = xb->oeb_nextents - k;
+			memcpy(nb->oeb_extents, &xb->oeb_extents[k],
+			       nb->oeb_nextents * sizeof(*e));
+			nb->oeb_next = xb->oeb_next;
+			xb->oeb_next = nbno;
+			xb->oeb_nextents = k;
+			if (i >= k) {
+				xb = nb;
+				i -= k;
+			}
+		}
+		extent_insert(xb->oeb_extents, &xb->oeb_nextents, i, piece, npieces);
+		xi->oi_nextents += npieces - 1;
+		write_seqcount_end(seq);
+
+		ospfs_block_dirty(xbno);
+		if (nbno)
+			ospfs_block_dirty(nbno);
+		ospfs_inode_dirty((ospfs_inode_t *) xi);
+		return 0;
+	}
+
+	// The extent is in the inode.  Work out the inode's new extents, and
+	// where the ones that no longer fit go.
+	i = e - xi->oi_extents;
+	count = min_t(uint32_t, xi->oi_nextents, OSPFS_NIEXTENTS);
+	memcpy(ext, xi->oi_extents, count * sizeof(*e));
+	extent_insert(ext, &count, i, piece, npieces);
+	if (count > OSPFS_NIEXTENTS) {
+		over = count - OSPFS_NIEXTENTS;
+		if (xi->oi_extblock)
+			xb = ospfs_block(xi->oi_extblock);
+		if (!xb || xb->oeb_nextents + over > OSPFS_NBEXTENTS) {
+			if ((nbno = allocate_block()) == 0)
+				return -ENOSPC;
+			nb = ospfs_block(nbno);
+			memset(nb, 0, OSPFS_BLKSIZE);
+		}
+	}
+
+	write_seqcount_begin(seq);
+	if (nb) {
+		memcpy(nb->oeb_extents, &ext[OSPFS_NIEXTENTS], over * sizeof(*e));
+		nb->oeb_nextents = over;
+		nb->oeb_next = xi->oi_extblock;
+		xi->oi_extblock = nbno;
+	} else if (over) {
+		memmove(&xb->oeb_extents[over], xb->oeb_extents,
+			xb->oeb_nextents * sizeof(*e));
+		memcpy(xb->oeb_extents, &ext[OSPFS_NIEXTENTS], over * sizeof(*e));
+		xb->oeb_nextents += over;
+	}
+	memcpy(xi->oi_extents, ext, (count - over) * sizeof(*e));
+	xi->oi_nextents += npieces - 1;
+	write_seqcount_end(seq);
+
+	if (nbno)
+		ospfs_block_dirty(nbno);
+	else if (over)
+		ospfs_block_dirty(xi->oi_extblock);
+	ospfs_inode_dirty((ospfs_inode_t *) xi);
+	return 0;
+}
+
+
+// extent_remap(xi, seq, n, blockno)
+//   Maps file block 'n' of extent-mapped file 'xi', which must exist, to
+//   disk block 'blockno', inside a write section of 'seq'.  (Helper
+//   function for unshare_block.)
+//
+//   Copying a run of blocks in order to a run of new blocks usually just
+//   moves the boundary between the extent of the copies and the extent
+//   of the originals, so the extent list only grows at the first block.
+//
+// Returns: 0 if successful, < 0 on error (see extent_split).
+
+static int
+extent_remap(ospfs_extent_inode_t *xi, seqcount_t *seq, uint32_t n, uint32_t blockno)
+{
+	uint32_t xbno, prev_xbno;
+	ospfs_extent_t *e = ospfs_extent_find(xi, n, &xbno), *prev;
+
+	if (!e)
+		return -EIO;
+	if (e->oe_len == 1) {
+		write_seqcount_begin(seq);
+		e->oe_pblock = blockno;
+		write_seqcount_end(seq);
+		extent_dirty(xi, xbno);
+		return 0;
+	}
+
+	// Move the first block of 'e' to the end of the extent before it
+	if (n == e->oe_lblock && n > 0
+	    && (prev = ospfs_extent_find(xi, n - 1, &prev_xbno))
+	    && prev->oe_pblock + prev->oe_len == blockno) {
+		write_seqcount_begin(seq);
+		prev->oe_len++;
+		e->oe_lblock++;
+		e->oe_pblock++;
+		e->oe_len--;
+		write_seqcount_end(seq);
+		extent_dirty(xi, prev_xbno);
+		extent_dirty(xi, xbno);
+		return 0;
+	}
+
+	return extent_split(xi, seq, n, blockno);
+}
+
+
+// unshare_block(oi, seq, n, hint)
+//   Gives file 'oi' its own copy of file block 'n', if that block is
+//   shared.  The copy goes at block '*hint' if that is free, and '*hint'
+//   is set to the block after the copy, so that copying a run of blocks
+//   makes a contiguous run.  The file's block map changes inside a write
+//   section of 'seq', before the file's reference to the original is
+//   dropped.  (Helper function for unshare_range.)
+//
+// Returns: 0 if successful, -ENOSPC if the disk is full, or < 0 on other
+//	    errors.  On error the file is unchanged.
+
+static int
+unshare_block(ospfs_inode_t *oi, seqcount_t *seq, uint32_t n, uint32_t *hint)
+{
+	uint32_t blockno = ospfs_inode_blockno(oi, (uint64_t) n << OSPFS_BLKSIZE_BITS);
+	uint32_t copy, count, slot_bno, *slot;
+	struct buffer_head *bh, *copy_bh;
+	int r;
+
+	if (!block_shared(blockno))
+		return 0;
+	if ((copy = allocate_blocks(1, *hint, &count)) == 0)
+		return -ENOSPC;
+	memcpy(ospfs_data_new(copy, &copy_bh), ospfs_data_get(blockno, &bh),
+	       OSPFS_BLKSIZE);
+	ospfs_data_put(blockno, bh, 0);
+	ospfs_data_put(copy, copy_bh, 1);
+
+	if (oi->oi_ftype == OSPFS_FTYPE_XREG) {
+		if ((r = extent_remap((ospfs_extent_inode_t *) oi, seq, n, copy)) < 0) {
+			free_block(copy);
+			return r;
+		}
+	} else {
+		slot = block_slot(oi, n, &slot_bno);
+		write_seqcount_begin(seq);
+		*slot = copy;
+		write_seqcount_end(seq);
+		if (slot_bno)
+			ospfs_block_dirty(slot_bno);
+		else
+			ospfs_inode_dirty(oi);
+	}
+
+	// Lock-free readers that might still be copying the original have
+	// seen 'seq' move, so this file's reference to it can go
+	free_block(blockno);
+	*hint = copy + 1;
+	return 0;
+}
+
+
+// unshare_range(oi, seq, pos, count, max_runs)
+//	Gives file 'oi' its own copy of each shared block that holds any of
+//	bytes 'pos' through 'pos + count - 1' (see Shared blocks above),
+//	including the last block of the file even if 'pos' is past the end.
+//	Blocks past the last are left alone.  If 'max_runs' isn't 0, stops
+//	once the copies have started that many runs of disk blocks (see
+//	JOURNAL_FILE_CREDITS).
+//
+//   Locking: as for change_size.  'seq' is the file's 'ii_seq'.
+//   Returns: the number of bytes from 'pos' it got through ('count', or
+//	      less if it stopped early), or < 0 on error, for example -ENOSPC
+//	      if the disk fills up.  Blocks copied before the error stay
+//	      copied.
+
+static int64_t
+unshare_range(ospfs_inode_t *oi, seqcount_t *seq, uint64_t pos, uint64_t count,
+	      uint32_t max_runs)
+{
+	// An append may change the unused tail of the last block
+	uint64_t end = min_t(uint64_t, pos + count,
+			     (uint64_t) ospfs_size2nblocks(ospfs_size(oi)) << OSPFS_BLKSIZE_BITS);
+	uint32_t n, hint = 0, nruns = 0;
+	int r;
+
+	if (!ospfs_refcounts() || pos >= end)
+		return count;
+	for (n = pos >> OSPFS_BLKSIZE_BITS; n < ospfs_size2nblocks(end); n++) {
+		uint32_t old_hint = hint;
+		if (max_runs && nruns == max_runs)
+			return ((uint64_t) n << OSPFS_BLKSIZE_BITS) - pos;
+		if ((r = unshare_block(oi, seq, n, &hint)) < 0)
+			return r;
+		// A copy that didn't land at the hint started a new run
+		if (hint != old_hint && hint != old_hint + 1)
+			nruns++;
+	}
+	return count;
+}
+
+
+// range_shared(oi, pos, count)
+//	Returns nonzero if unshare_range(oi, seq, pos, count) has any block to
+//	copy.  The caller must keep the file's block map from changing, but
+//	needn't bump 'ii_seq', so writes to unshared files don't make
+//	readers retry.
+
+static int
+range_shared(ospfs_inode_t *oi, uint64_t pos, uint64_t count)
+{
+	uint64_t end = min_t(uint64_t, pos + count,
+			     (uint64_t) ospfs_size2nblocks(ospfs_size(oi)) << OSPFS_BLKSIZE_BITS);
+	uint32_t n;
+
+	if (!ospfs_refcounts() || pos >= end)
+		return 0;
+	for (n = pos >> OSPFS_BLKSIZE_BITS; n < ospfs_size2nblocks(end); n++)
+		if (block_shared(ospfs_inode_blockno(oi, (uint64_t) n << OSPFS_BLKSIZE_BITS)))
+			return 1;
+	return 0;
+}
+
+
+// unshare_file_range(inode, pos, count)
+//	unshare_range for regular file 'inode', as a series of journal
+//	operations that each copy as many blocks as their credits allow (see
+//	journal_step), with the file's resize lock held during each.  A range
+//	with no shared blocks, the usual case, costs no journal operation, and
+//	parts of it that have none are left alone without bumping 'ii_seq'.
+//
+//   Locking: the caller is not in a journal operation.
+//   Returns: 0 on success, or < 0 on error, as for unshare_range.
+
+static int
+unshare_file_range(struct inode *inode, uint64_t pos, uint64_t count)
+{
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	uint64_t end = pos + count;
+	int64_t r;
+
+	if (!ospfs_refcounts())
+		return 0;
+	down_read(ospfs_inode_sem(inode));
+	r = range_shared(oi, pos, count);
+	up_read(ospfs_inode_sem(inode));
+	if (!r)
+		return 0;
+
+	for (r = 0; r >= 0 && pos < end; ) {
+		// The copies' runs can't be counted in advance (see add_blocks)
+		uint32_t nruns = JOURNAL_STEP_RUNS;
+		uint64_t first = pos >> OSPFS_BLKSIZE_BITS, step_end = end, stop, credits;
+
+		down_read(ospfs_inode_sem(inode));
+		stop = journal_step(oi, first, ospfs_size2nblocks(end), &nruns, 1);
+		up_read(ospfs_inode_sem(inode));
+		if (stop < ospfs_size2nblocks(end))
+			step_end = stop << OSPFS_BLKSIZE_BITS;
+		credits = JOURNAL_FILE_CREDITS(nruns, stop - first);
+
+		journal_start(credits);
+		resize_lock(inode);
+		r = step_end - pos;
+		if (range_shared(oi, pos, step_end - pos))
+			r = unshare_range(oi, &ospfs_inode_info(inode)->ii_seq,
+					  pos, step_end - pos, JOURNAL_STEP_RUNS);
+		resize_unlock(inode);
+		journal_stop(credits, 0);
+		if (r >= 0)
+			pos += r;
+	}
+	return (r < 0 ? r : 0);
+}
+
+
+// clone_block(blockno)
+//	Returns a new copy of indirect or extent block 'blockno', or 0 if the
+//	disk is full.  (Helper function for clone_blockmap.)
+
+static uint32_t
+clone_block(uint32_t blockno)
+{
+	uint32_t copy = allocate_block();
+	if (copy) {
+		memcpy(ospfs_block(copy), ospfs_block(blockno), OSPFS_BLKSIZE);
+		ospfs_block_dirty(copy);
+	}
+	return copy;
+}
+
+
+// clone_blockmap_undo(oi)
+//	Frees the indirect or extent blocks clone_blockmap gave the empty file
+//	'oi' before it ran out of space, and empties its block map again.
+
+static void
+clone_blockmap_undo(ospfs_inode_t *oi)
+{
+	uint32_t i, xbno, *indirect2_block;
+
+	if (oi->oi_ftype == OSPFS_FTYPE_XREG) {
+		ospfs_extent_inode_t *xi = (ospfs_extent_inode_t *) oi;
+		for (xbno = xi->oi_extblock; xbno != 0; ) {
+			uint32_t next = ((ospfs_extent_block_t *) ospfs_block(xbno))->oeb_next;
+			free_block(xbno);
+			xbno = next;
+		}
+		xi->oi_nextents = xi->oi_extblock = 0;
+		return;
+	}
+	if (oi->oi_indirect2) {
+		indirect2_block = ospfs_block(oi->oi_indirect2);
+		for (i = 0; i < OSPFS_NINDIRECT; i++)
+			if (indirect2_block[i])
+				free_block(indirect2_block[i]);
+		free_block(oi->oi_indirect2);
+	}
+	if (oi->oi_indirect)
+		free_block(oi->oi_indirect);
+	memset(oi->oi_direct, 0, sizeof(oi->oi_direct));
+	oi->oi_indirect = oi->oi_indirect2 = 0;
+}
+
+
+// clone_credits(src)
+//	Returns the journal credits (see journal_start) clone_blockmap needs
+//	to clone regular file 'src': a copy of each indirect or extent block
+//	and its bitmap block, and the reference count blocks of the data
+//	blocks.  Like clone_blockmap, it walks the whole block map; a run of
+//	data blocks under one reference count block counts once.
+//
+//   Locking: the caller holds 'ii_sem' on 'src'.
+
+static uint64_t
+clone_credits(ospfs_inode_t *src)
+{
+	uint32_t nblocks = ospfs_size2nblocks(ospfs_size(src));
+	uint32_t n, end, xbno, refb = ~0U;
+	uint64_t credits = JOURNAL_OP_CREDITS;
+	ospfs_blockmap_cursor_t bc;
+
+	if (src->oi_ftype == OSPFS_FTYPE_XREG) {
+		for (xbno = ((ospfs_extent_inode_t *) src)->oi_extblock; xbno != 0;
+		     xbno = ((ospfs_extent_block_t *) ospfs_block(xbno))->oeb_next)
+			credits += 2;
+	} else {
+		if (src->oi_indirect)
+			credits += 2;
+		if (src->oi_indirect2) {
+			uint32_t *src2 = ospfs_block(src->oi_indirect2);
+			credits += 2;
+			for (n = 0; n < OSPFS_NINDIRECT; n++)
+				if (src2[n])
+					credits += 2;
+		}
+	}
 
-		//if we don't have enough free blocks too accommandate,
-		//set new_size to old size and shrink it back to its original
-		if(r == -ENOSPC)
-		{
-			new_size = old_size;
+	memset(&bc, 0, sizeof(bc));
+	for (n = 0; n < nblocks; n = end) {
+		if (ospfs_cursor_blockno(&bc, src, (uint64_t) n << OSPFS_BLKSIZE_BITS) == 0)
 			break;
+		end = min_t(uint32_t, bc.bc_first + bc.bc_nptrs, nblocks);
+		for (; n < end; n++) {
+			uint32_t blockno = (bc.bc_ptrs ? bc.bc_ptrs[n - bc.bc_first]
+					    : bc.bc_pblock + (n - bc.bc_first));
+			if (blockno / OSPFS_BLKREFS != refb)
+				credits++;
+			refb = blockno / OSPFS_BLKREFS;
 		}
+	}
+	return credits;
+}
 
-		if(r == -EIO)
-			return -EIO;
+
+// clone_blockmap(dst, src)
+//	Makes the empty regular file 'dst' a clone of regular file 'src' (see
+//	SHARED BLOCKS in ospfs.h): 'dst' takes the file type and size of
+//	'src', and each of its data blocks gains a reference.  Indirect and
+//	extent blocks are copied, since a file changes them in place.
+//
+//   Locking: the caller holds 'ii_sem' on both files, for writing on
+//	      'dst', and is between journal_start and journal_stop.
+//   Returns: 0 on success, or < 0 on error, leaving 'dst' empty:
+//	      -ENOSPC if there is no room for the copied indirect or extent
+//	      blocks, or -EIO if 'src' has a bad block pointer.
+
+static int
+clone_blockmap(ospfs_inode_t *dst, ospfs_inode_t *src)
+{
+	uint32_t *refs = ospfs_refcounts();
+	uint64_t size = ospfs_size(src);
+	uint32_t nblocks = ospfs_size2nblocks(size);
+	uint32_t n, end, xbno, *link;
+	ospfs_blockmap_cursor_t bc;
+
+	dst->oi_ftype = src->oi_ftype;
+	if (src->oi_ftype == OSPFS_FTYPE_XREG) {
+		ospfs_extent_inode_t *sx = (ospfs_extent_inode_t *) src;
+		ospfs_extent_inode_t *dx = (ospfs_extent_inode_t *) dst;
+		dx->oi_nextents = sx->oi_nextents;
+		memcpy(dx->oi_extents, sx->oi_extents, sizeof(dx->oi_extents));
+		link = &dx->oi_extblock;
+		*link = 0;
+		for (xbno = sx->oi_extblock; xbno != 0;
+		     xbno = ((ospfs_extent_block_t *) ospfs_block(xbno))->oeb_next) {
+			// Each copy ends the chain until the next one is linked
+			if ((*link = clone_block(xbno)) == 0)
+				goto nospace;
+			link = &((ospfs_extent_block_t *) ospfs_block(*link))->oeb_next;
+			*link = 0;
+		}
+	} else {
+		memcpy(dst->oi_direct, src->oi_direct, sizeof(dst->oi_direct));
+		dst->oi_indirect = dst->oi_indirect2 = 0;
+		if (src->oi_indirect
+		    && (dst->oi_indirect = clone_block(src->oi_indirect)) == 0)
+			goto nospace;
+		if (src->oi_indirect2) {
+			uint32_t *src2 = ospfs_block(src->oi_indirect2), *dst2;
+			if ((dst->oi_indirect2 = allocate_block()) == 0)
+				goto nospace;
+			dst2 = ospfs_block(dst->oi_indirect2);
+			memset(dst2, 0, OSPFS_BLKSIZE);
+			ospfs_block_dirty(dst->oi_indirect2);
+			for (n = 0; n < OSPFS_NINDIRECT; n++)
+				if (src2[n] && (dst2[n] = clone_block(src2[n])) == 0)
+					goto nospace;
+		}
 	}
-	while (ospfs_size2nblocks(oi->oi_size) > ospfs_size2nblocks(new_size)) {
-		if(remove_block(oi) == -EIO)
-			return -EIO;
+
+	// Every data block of 'src' gets another owner, a cursor run (one
+	// pointer array or extent) at a time: looking up a run may sleep
+	// reading an indirect block, so it is done outside the lock
+	memset(&bc, 0, sizeof(bc));
+	for (n = 0; n < nblocks; n = end) {
+		if (ospfs_cursor_blockno(&bc, src, (uint64_t) n << OSPFS_BLKSIZE_BITS) == 0)
+			goto badblock;
+		end = min_t(uint32_t, bc.bc_first + bc.bc_nptrs, nblocks);
+		spin_lock(&freemap_lock);
+		for (; n < end; n++) {
+			uint32_t blockno = (bc.bc_ptrs ? bc.bc_ptrs[n - bc.bc_first]
+					    : bc.bc_pblock + (n - bc.bc_first));
+			if (blockno == 0 || blockno >= ospfs_super->os_nblocks) {
+				spin_unlock(&freemap_lock);
+				goto badblock;
+			}
+			refs[blockno]++;
+			ospfs_block_dirty(ospfs_super->os_refb + blockno / OSPFS_BLKREFS);
+		}
+		spin_unlock(&freemap_lock);
 	}
 
-	// Reset the size back to what it was if the file grew, or down to what it shrank to
-	oi->oi_size = new_size;
-	return r;
+	// Cursors on 'dst' may remember a block map of another file type
+	spin_lock(&freemap_lock);
+	blockmap_gen++;
+	spin_unlock(&freemap_lock);
+
+	ospfs_set_size(dst, size);
+	ospfs_inode_dirty(dst);
+	return 0;
+
+    nospace:
+	clone_blockmap_undo(dst);
+	ospfs_inode_dirty(dst);
+	return -ENOSPC;
+
+    badblock:
+	// As in change_size, a damaged file isn't put back exactly: the
+	// blocks counted so far keep their extra reference
+	clone_blockmap_undo(dst);
+	ospfs_inode_dirty(dst);
+	return -EIO;
 }
 
 
@@ -1158,27 +3647,113 @@ ospfs_notify_change(struct dentry *dentry, struct iattr *attr)
 	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
 	int retval = 0;
 
-	if (attr->ia_valid & ATTR_SIZE) {
+	if ((attr->ia_valid & ATTR_SIZE) && oi->oi_ftype == OSPFS_FTYPE_DIR)
 		// We should not be able to change directory size
-		if (oi->oi_ftype == OSPFS_FTYPE_DIR)
-			return -EPERM;
-		if ((retval = change_size(oi, attr->ia_size)) < 0)
-			goto out;
+		return -EPERM;
+
+	if (attr->ia_valid & ATTR_SIZE) {
+		if (attr->ia_size < i_size_read(inode)) {
+			resize_lock(inode);
+			resize_shrink(inode, attr->ia_size);
+			resize_unlock(inode);
+		}
+		if ((retval = resize_file(inode, oi, attr->ia_size)) < 0)
+			return retval;
 	}
 
-	if (attr->ia_valid & ATTR_MODE)
+	journal_start(JOURNAL_OP_CREDITS);
+
+	if (attr->ia_valid & ATTR_MODE) {
 		// Set this inode's mode to the value 'attr->ia_mode'.
 		oi->oi_mode = attr->ia_mode;
+		ospfs_inode_dirty(oi);
+	}
 
 	if ((retval = inode_change_ok(inode, attr)) < 0
 	    || (retval = inode_setattr(inode, attr)) < 0)
 		goto out;
 
     out:
+	journal_stop(JOURNAL_OP_CREDITS, 1);
 	return retval;
 }
 
 
+// ospfs_open, ospfs_release
+//	Linux calls these functions when a regular file is opened and when
+//	its last reference is closed.  They allocate and free the file's
+//	block-map cursor.
+
+static int
+ospfs_open(struct inode *inode, struct file *filp)
+{
+	ospfs_blockmap_cursor_t *bc = kzalloc(sizeof(*bc), GFP_KERNEL);
+	if (!bc)
+		return -ENOMEM;
+	spin_lock_init(&bc->bc_lock);
+	filp->private_data = bc;
+	return 0;
+}
+
+static int
+ospfs_release(struct inode *inode, struct file *filp)
+{
+	kfree(filp->private_data);
+	return 0;
+}
+
+
+// ospfs_fsync(filp, dentry, datasync)
+//	Linux calls this function for fsync() and fdatasync(), after writing
+//	back the file's dirty pages.  It is the file_operations.fsync callback
+//	for files and directories.  disk_flush commits the journal and writes
+//	the dirty blocks; a flush that didn't wait may still be writing some
+//	of the file's data, so we then wait on each of its data blocks that is
+//	in the buffer cache.  Nothing to do for the in-module image.
+//
+//   Returns: 0 on success, -EIO if a write failed.
+
+static int
+ospfs_fsync(struct file *filp, struct dentry *dentry, int datasync)
+{
+	struct inode *inode = dentry->d_inode;
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	ospfs_blockmap_cursor_t bc;
+	uint32_t n, end, nblocks;
+	int r = 0;
+
+	if (!disk_sb)
+		return 0;
+	disk_flush(1);
+	if (!S_ISREG(inode->i_mode))
+		return 0;
+
+	down_read(ospfs_inode_sem(inode));
+	nblocks = ospfs_size2nblocks(ospfs_size(oi));
+	memset(&bc, 0, sizeof(bc));
+	for (n = 0; n < nblocks; n = end) {
+		if (ospfs_cursor_blockno(&bc, oi, (uint64_t) n << OSPFS_BLKSIZE_BITS) == 0)
+			break;
+		end = min_t(uint32_t, bc.bc_first + bc.bc_nptrs, nblocks);
+		for (; n < end; n++) {
+			uint32_t blockno = (bc.bc_ptrs ? bc.bc_ptrs[n - bc.bc_first]
+					    : bc.bc_pblock + (n - bc.bc_first));
+			struct buffer_head *bh;
+			if (blockno == 0 || blockno >= ospfs_super->os_nblocks
+			    || !(bh = __find_get_block(disk_sb->s_bdev, blockno,
+						       OSPFS_BLKSIZE)))
+				continue;
+			wait_on_buffer(bh);
+			if (!buffer_uptodate(bh))
+				r = -EIO;
+			brelse(bh);
+		}
+	}
+	up_read(ospfs_inode_sem(inode));
+	return r;
+}
+
+
 // ospfs_read
 //	Linux calls this function to read data from a file.
 //	It is the file_operations.read callback.
@@ -1195,61 +3770,119 @@ ospfs_notify_change(struct dentry *dentry, struct iattr *attr)
 //   as 'f_pos'; read data starting at that position, and update the position
 //   when you're done.
 //
+//   Readers take no lock (see LOCKING).  They stop at i_size, and each run
+//   is looked up and copied into a kernel page, then checked against the
+//   inode's 'ii_seq'; if any of the file's blocks left it meanwhile, the
+//   run is copied again.  Only checked bytes are copied to user space, so
+//   a block freed and reused by another file mid-copy can't leak out.
+//
 //   EXERCISE(x): Complete this function.
 
 static ssize_t
 ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 {
+	ospfs_inode_info_t *ii = ospfs_inode_info(filp->f_dentry->d_inode);
 	ospfs_inode_t *oi = ospfs_inode(filp->f_dentry->d_inode->i_ino);
+	ospfs_blockmap_cursor_t cursor, *bc = &cursor;
 	int retval = 0;
 	size_t amount = 0;
+	char *bounce;
 	
 	if (*f_pos + count < *f_pos) { //overflow detection
 		return -EIO;
 	}
 	
-	if (*f_pos >= oi->oi_size) {
-		count = 0;
-	} else if (*f_pos + count > oi->oi_size)
-		count = oi->oi_size - *f_pos;
-	
+	bounce = (char *) __get_free_page(GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+	cursor_get(filp, bc);
 	
-	// Copy the data to user block by block
+	// Copy the data to user one run of physically contiguous blocks
+	// at a time
 	while (amount < count && retval >= 0) {
-		uint32_t blockno = ospfs_inode_blockno(oi, *f_pos);
-		uint32_t n;
+		unsigned seq = read_seqcount_begin(&ii->ii_seq);
+		uint64_t size = i_size_read(&ii->ii_vfs_inode);
+		uint32_t blockno;
+		uint32_t next = 0;
+		size_t n;
 		char *data;
+		struct buffer_head *bh;
 		
 		uint32_t data_offset; // Data offset from the start of the block
-		uint32_t bytes_left_to_copy = count - amount;
+		size_t bytes_left_to_copy = count - amount;
+		
+		// Stop at the end of the file, which may move under us.  The
+		// block map covers 'size' (see resize_publish).
+		smp_rmb();
+		if (*f_pos >= size)
+			break;
+		if (bytes_left_to_copy > size - *f_pos)
+			bytes_left_to_copy = size - *f_pos;
 		
-		// ospfs_inode_blockno returns 0 on error
+		// ospfs_inode_blockno returns 0 on error, or if the block
+		// map changed under a lock-free lookup
+		blockno = ospfs_cursor_blockno(bc, oi, *f_pos);
 		if (blockno == 0) {
+			if (read_seqcount_retry(&ii->ii_seq, seq)) {
+				bc->bc_oi = NULL;
+				continue;
+			}
 			retval = -EIO;
 			goto done;
 		}
 		
-		data = ospfs_block(blockno);
-		
 		// Figure out how much data is left in this block to read.
 		// Copy data into user space. Return -EFAULT if unable to write
 		// into user space.
 		// Use variable 'n' to track number of bytes moved.
 		/* COMPLETED EXERCISE: Your code here */
 		
-		data_offset = *f_pos % OSPFS_BLKSIZE; //block size is 1024 bytes
+		data_offset = *f_pos & (OSPFS_BLKSIZE - 1);
 		
 		n = OSPFS_BLKSIZE - data_offset;
 		
+		// Extend the run while the following file blocks are the
+		// following disk blocks, up to a page.  'next' ends up as the
+		// first disk block of the next run (or 0).  On a block device
+		// each block is a separate buffer, so a run is a single block.
+		while (n < bytes_left_to_copy && n < PAGE_SIZE) {
+			next = ospfs_cursor_blockno(bc, oi, *f_pos + n);
+			if (disk_sb
+			    || next != blockno + ((data_offset + n) >> OSPFS_BLKSIZE_BITS))
+				break;
+			next = 0;
+			n += OSPFS_BLKSIZE;
+		}
+		
 		// Copy bytes either until we hit the end
-		// of the block or satisfy the user
+		// of the run or satisfy the user
 		if (n > bytes_left_to_copy) {
 			n = bytes_left_to_copy;
 		}
+		if (n > PAGE_SIZE)
+			n = PAGE_SIZE;
+		
+		// Looking up 'next' already loaded the next run's indirect
+		// block into the cursor; start loading its first data block
+		// too, so it is warm when the copy below finishes.
+		if (next)
+			ospfs_data_prefetch(next);
+		
+		data = ospfs_data_get(blockno, &bh);
+		memcpy(bounce, data + data_offset, n);
+		ospfs_data_put(blockno, bh, 0);
+		
+		// The blocks might have been freed and reused during the
+		// copy; if so, copy this run again
+		if (read_seqcount_retry(&ii->ii_seq, seq)) {
+			bc->bc_oi = NULL;
+			continue;
+		}
 		
 		// Copy_to_user return the number of bytes that could not be copied. On success, this will be 0
-		if (copy_to_user(buffer, data + data_offset, n) > 0) {//copy to buffer
-			return -EFAULT;
+		if (copy_to_user(buffer, bounce, n) > 0) {//copy to buffer
+			retval = -EFAULT;
+			goto done;
 		}
 		
 		buffer += n;
@@ -1258,6 +3891,8 @@ ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 	}
 	
 	done:
+	cursor_put(filp, bc);
+	free_page((unsigned long) bounce);
 	return (retval >= 0 ? amount : retval);
 }
 
@@ -1282,17 +3917,24 @@ ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 static ssize_t
 ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *f_pos)
 {
-	ospfs_inode_t *oi = ospfs_inode(filp->f_dentry->d_inode->i_ino);
+	struct inode *inode = filp->f_dentry->d_inode;
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	ospfs_blockmap_cursor_t cursor, *bc = &cursor;
 	int retval = 0;
 	//amount written
 	size_t amount = 0;
-	size_t newsize;
+	loff_t newsize;
+
+	// Writers may change the block map, so they exclude each other (see
+	// LOCKING); lock-free readers see the new size only once it is mapped
+	mutex_lock(&inode->i_mutex);
+
 	// Support files opened with the O_APPEND flag.  To detect O_APPEND,
 	// use struct file's f_flags field and the O_APPEND bit.
 	/* EXERCISE: Your code here */
 
 	if(filp->f_flags & O_APPEND)
-		*f_pos = oi->oi_size;
+		*f_pos = ospfs_size(oi);
 	newsize = *f_pos + count;
 	// If the user is writing past the end of the file, change the file's
 	// size to accomodate the request.  (Use change_size().)
@@ -1302,14 +3944,23 @@ ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *
 	//if(*f_pos + count < *f_pos)
 	//	return -EIO;
 
+	// Copy any shared blocks we are about to overwrite (see Shared blocks)
+	if ((retval = unshare_file_range(inode, *f_pos, count)) < 0)
+		goto out;
+
 	//change size as needed
 	//we need enough blocks so we can copy data from user
-	if(newsize >= oi->oi_size)
+	if(newsize >= ospfs_size(oi))
 	{
-		retval = change_size(oi, newsize);
+		retval = resize_file(inode, oi, newsize);
 		if(retval != 0)
-			return retval;
+			goto out;
+		resize_publish(inode, ospfs_size(oi));
 	}
+
+	// The copy changes only file data, so it needs no journal operation
+	down_read(ospfs_inode_sem(inode));
+	cursor_get(filp, bc);
 		
 	// Copy data block by block
 	while (amount < count && retval >= 0) {
@@ -1317,27 +3968,26 @@ ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *
 		uint32_t n;
 		//int32_t added = 0;
 		char *data;
+		struct buffer_head *bh;
 
 		uint32_t data_offset; // Data offset from the start of the block
-		uint32_t bytes_left_to_copy = count - amount;
+		size_t bytes_left_to_copy = count - amount;
 
 		
-		blockno = ospfs_inode_blockno(oi, *f_pos);
+		blockno = ospfs_cursor_blockno(bc, oi, *f_pos);
 
 		if (blockno == 0) {
 			retval = -EIO;
 			goto done;
 		}
 
-		data = ospfs_block(blockno);
-
 		// Figure out how much data is left in this block to write.
 		// Copy data from user space. Return -EFAULT if unable to read
 		// read user space.
 		// Keep track of the number of bytes moved in 'n'.
 		/* EXERCISE(x): Your code here */
 
-		data_offset = *f_pos % OSPFS_BLKSIZE;
+		data_offset = *f_pos & (OSPFS_BLKSIZE - 1);
 		
 		n = OSPFS_BLKSIZE - data_offset;
 
@@ -1346,13 +3996,13 @@ ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *
 		if(n > bytes_left_to_copy)
 			n = bytes_left_to_copy;
 
-		data += *f_pos % OSPFS_BLKSIZE;
+		data = (char *) ospfs_data_get(blockno, &bh) + data_offset;
 		
 		if(copy_from_user(data, buffer, n) > 0)
-		{
-			return -EFAULT;
+			retval = -EFAULT;
+		ospfs_data_put(blockno, bh, 1);
+		if (retval < 0)
 			goto done;
-		}
 		//added = (*f_pos + n) - oi->oi_size;
 
 		//if(added < 0)
@@ -1365,43 +4015,516 @@ ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *
 	}
 
     done:
+	cursor_put(filp, bc);
+	up_read(ospfs_inode_sem(inode));
+    out:
+	mutex_unlock(&inode->i_mutex);
 	return (retval >= 0 ? amount : retval);
 }
 
 
-// find_direntry(dir_oi, name, namelen)
+/*****************************************************************************
+ * ADDRESS SPACE OPERATIONS
+ *
+ *   With the 'pagecache' module parameter set, regular files are read and
+ *   written through the Linux page cache, using the generic file operations
+ *   (do_sync_read, generic_file_aio_write, generic_file_mmap, splice).
+ *   Those call the functions below to move one page between the page cache
+ *   and the file's OSPFS blocks.  A page holds PAGE_CACHE_SIZE bytes, which
+ *   is several OSPFS blocks.
+ *
+ *   write_end copies each write through to the disk array right away and
+ *   leaves the page clean, so the disk is always up to date with write().
+ *   Only pages dirtied through mmap are copied back later, by writepage.
+ */
+
+// ospfs_page_io(bc, oi, page, from, to, write)
+//	Copies bytes 'from' through 'to' - 1 of 'page' from the file's blocks
+//	into the page (write == 0), or from the page into the blocks
+//	(write != 0).  When reading, bytes past the end of the file are
+//	zeroed; when writing, they are ignored.
+//
+//	Writing holds the file's 'ii_sem' for reading, so the block map can't
+//	change under the copy.  Reading takes no lock: it stops at i_size, and
+//	if 'ii_seq' shows that blocks left the file during the copy, the copy
+//	is redone (see LOCKING).  No one sees a page being read until the
+//	caller marks it uptodate and unlocks it, after the check, so a stale
+//	copy never escapes.
+//
+//   Inputs:  bc    -- block-map cursor used to look up the blocks
+//	      oi    -- pointer to the file's OSPFS inode
+//	      page  -- a locked page of that file
+//	      from  -- first byte of the page to copy
+//	      to    -- one past the last byte to copy
+
+static void
+ospfs_page_io(ospfs_blockmap_cursor_t *bc, ospfs_inode_t *oi, struct page *page,
+	      unsigned from, unsigned to, int write)
+{
+	ospfs_inode_info_t *ii = ospfs_inode_info(page->mapping->host);
+	loff_t pos = page_offset(page);
+	char *kaddr = kmap(page);
+	unsigned start = from, seq = 0;
+
+	if (write)
+		down_read(&ii->ii_sem);
+    retry:
+	if (!write)
+		seq = read_seqcount_begin(&ii->ii_seq);
+	for (from = start; from < to; ) {
+		uint64_t size = (write ? ospfs_size(oi) : i_size_read(page->mapping->host));
+		uint32_t blockno;
+		unsigned n = OSPFS_BLKSIZE - ((pos + from) & (OSPFS_BLKSIZE - 1));
+		char *data;
+		struct buffer_head *bh;
+
+		smp_rmb();
+
+		if (pos + from >= size) {
+			if (!write)
+				memset(kaddr + from, 0, to - from);
+			break;
+		}
+		if (n > to - from)
+			n = to - from;
+		if (n > size - (pos + from))
+			n = size - (pos + from);
+
+		blockno = ospfs_cursor_blockno(bc, oi, pos + from);
+		if (blockno == 0) {
+			if (!write)
+				memset(kaddr + from, 0, n);
+			from += n;
+			continue;
+		}
+		data = (char *) ospfs_data_get(blockno, &bh)
+			+ ((pos + from) & (OSPFS_BLKSIZE - 1));
+		if (write)
+			memcpy(data, kaddr + from, n);
+		else
+			memcpy(kaddr + from, data, n);
+		ospfs_data_put(blockno, bh, write);
+		from += n;
+	}
+	if (write)
+		up_read(&ii->ii_sem);
+	else if (read_seqcount_retry(&ii->ii_seq, seq)) {
+		bc->bc_oi = NULL;
+		goto retry;
+	}
+
+	if (!write)
+		flush_dcache_page(page);
+	kunmap(page);
+}
+
+
+// ospfs_data_readahead(bc, oi, pos, end)
+//	Starts reading the data blocks of 'oi' that hold bytes 'pos' through
+//	'end' - 1 and aren't in memory, in file order, so that the block layer
+//	merges each run of contiguous blocks into one request.  ospfs_page_io
+//	then finds the blocks read or in flight, instead of reading them one
+//	synchronous block at a time.  Only a hint: a block map that changes
+//	meanwhile just reads the wrong blocks.  Never waits for the reads.
+
+static void
+ospfs_data_readahead(ospfs_blockmap_cursor_t *bc, ospfs_inode_t *oi,
+		     uint64_t pos, uint64_t end)
+{
+	struct buffer_head *batch[DISK_FLUSH_BATCH];
+	int i, n = 0;
+
+	if (!disk_sb)
+		return;
+	for (pos &= ~(uint64_t) (OSPFS_BLKSIZE - 1); pos < end; pos += OSPFS_BLKSIZE) {
+		uint32_t blockno = ospfs_cursor_blockno(bc, oi, pos);
+		struct buffer_head *bh;
+
+		if (blockno < disk_nmeta || blockno >= ospfs_super->os_nblocks
+		    || !(bh = sb_getblk(disk_sb, blockno)))
+			continue;
+		if (buffer_uptodate(bh)) {
+			brelse(bh);
+			continue;
+		}
+		batch[n++] = bh;
+		if (n == DISK_FLUSH_BATCH) {
+			ll_rw_block(READ, n, batch);
+			for (i = 0; i < n; i++)
+				brelse(batch[i]);
+			n = 0;
+		}
+	}
+	if (n) {
+		ll_rw_block(READ, n, batch);
+		for (i = 0; i < n; i++)
+			brelse(batch[i]);
+	}
+}
+
+
+// ospfs_readpage(filp, page)
+//	Linux calls this function to fill a locked page of a regular file.
+//	It is the address_space_operations.readpage callback.
+
+static int
+ospfs_readpage(struct file *filp, struct page *page)
+{
+	ospfs_inode_t *oi = ospfs_inode(page->mapping->host->i_ino);
+	ospfs_blockmap_cursor_t bc;
+
+	memset(&bc, 0, sizeof(bc));
+	ospfs_data_readahead(&bc, oi, page_offset(page),
+			     min_t(uint64_t, page_offset(page) + PAGE_CACHE_SIZE,
+				   i_size_read(page->mapping->host)));
+	ospfs_page_io(&bc, oi, page, 0, PAGE_CACHE_SIZE, 0);
+	SetPageUptodate(page);
+	unlock_page(page);
+	return 0;
+}
+
+
+// ospfs_readpages(filp, mapping, pages, nr_pages)
+//	Linux calls this function to fill a batch of pages during readahead.
+//	It is the address_space_operations.readpages callback.
+//	All the pages share one block-map cursor, so a readahead window visits
+//	each indirect block once.  The whole window's blocks are requested
+//	first (ospfs_data_readahead), a contiguous run per request, and the
+//	pages are then filled as the reads complete.
+
+static int
+ospfs_readpages_filler(void *data, struct page *page)
+{
+	ospfs_blockmap_cursor_t *bc = data;
+	ospfs_page_io(bc, ospfs_inode(page->mapping->host->i_ino), page,
+		      0, PAGE_CACHE_SIZE, 0);
+	SetPageUptodate(page);
+	unlock_page(page);
+	return 0;
+}
+
+static int
+ospfs_readpages(struct file *filp, struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages)
+{
+	ospfs_inode_t *oi = ospfs_inode(mapping->host->i_ino);
+	ospfs_blockmap_cursor_t bc;
+	pgoff_t first = ~(pgoff_t) 0, last = 0;
+	struct page *page;
+
+	list_for_each_entry(page, pages, lru) {
+		first = min(first, page->index);
+		last = max(last, page->index);
+	}
+	memset(&bc, 0, sizeof(bc));
+	if (nr_pages)
+		ospfs_data_readahead(&bc, oi, (uint64_t) first << PAGE_CACHE_SHIFT,
+				     min_t(uint64_t, (uint64_t) (last + 1) << PAGE_CACHE_SHIFT,
+					   i_size_read(mapping->host)));
+	return read_cache_pages(mapping, pages, ospfs_readpages_filler, &bc);
+}
+
+
+// ospfs_writepage(page, wbc)
+//	Linux calls this function to write back a page dirtied through mmap.
+//	It is the address_space_operations.writepage callback.
+//	mmap can't extend a file, so the page's blocks already exist.
+
+static int
+ospfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	loff_t size = i_size_read(inode);
+	ospfs_blockmap_cursor_t bc;
+
+	// Pages wholly past the end of the file were truncated away
+	if (page_offset(page) < size) {
+		unsigned to = PAGE_CACHE_SIZE;
+		if (size - page_offset(page) < to)
+			to = size - page_offset(page);
+		memset(&bc, 0, sizeof(bc));
+		ospfs_page_io(&bc, ospfs_inode(inode->i_ino), page, 0, to, 1);
+	}
+
+	set_page_writeback(page);
+	unlock_page(page);
+	end_page_writeback(page);
+	return 0;
+}
+
+
+// ospfs_write_begin(filp, mapping, pos, len, flags, pagep, fsdata)
+//	Linux calls this function before copying 'len' bytes of a write() at
+//	file offset 'pos' into a page.  It is the
+//	address_space_operations.write_begin callback.
+//
+//   Returns: 0 on success, with '*pagep' set to the locked page.
+//	      -ENOSPC if the blocks for the write can't be allocated.
+//
+//	The file is grown with change_size here, and any shared blocks the
+//	write covers are copied (see Shared blocks), before any data is
+//	copied, so a full disk is reported without touching the page.
+//	The VFS holds the file's i_mutex, so the block map can be checked
+//	without 'ii_sem'.
+
+static int
+ospfs_write_begin(struct file *filp, struct address_space *mapping,
+		  loff_t pos, unsigned len, unsigned flags,
+		  struct page **pagep, void **fsdata)
+{
+	ospfs_inode_t *oi = ospfs_inode(mapping->host->i_ino);
+	struct page *page;
+	int r = 0;
+
+	if ((r = unshare_file_range(mapping->host, pos, len)) < 0)
+		return r;
+
+	if (pos + len > ospfs_size(oi)
+	    && (r = resize_file(mapping->host, oi, pos + len)) < 0)
+		return r;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+	page = grab_cache_page_write_begin(mapping, pos >> PAGE_CACHE_SHIFT, flags);
+#else
+	page = __grab_cache_page(mapping, pos >> PAGE_CACHE_SHIFT);
+#endif
+	if (!page) {
+		resize_file(mapping->host, oi, i_size_read(mapping->host));
+		return -ENOMEM;
+	}
+
+	// The rest of the page must hold the file's current data
+	if (!PageUptodate(page)) {
+		ospfs_blockmap_cursor_t bc;
+		memset(&bc, 0, sizeof(bc));
+		ospfs_page_io(&bc, oi, page, 0, PAGE_CACHE_SIZE, 0);
+		SetPageUptodate(page);
+	}
+
+	*pagep = page;
+	return 0;
+}
+
+
+// ospfs_write_end(filp, mapping, pos, len, copied, page, fsdata)
+//	Linux calls this function after copying 'copied' bytes of a write()
+//	into 'page'.  It is the address_space_operations.write_end callback.
+//	Copies those bytes through to the file's blocks, updates the file
+//	size, and gives back any blocks that a short copy didn't use.
+//
+//   Returns: the number of bytes written.
+
+static int
+ospfs_write_end(struct file *filp, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned copied,
+		struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	unsigned from = pos & (PAGE_CACHE_SIZE - 1);
+	ospfs_blockmap_cursor_t bc;
+
+	memset(&bc, 0, sizeof(bc));
+	ospfs_page_io(&bc, oi, page, from, from + copied, 1);
+
+	if (pos + copied > inode->i_size)
+		resize_publish(inode, pos + copied);
+	unlock_page(page);
+	page_cache_release(page);
+
+	if (ospfs_size(oi) > inode->i_size)
+		resize_file(inode, oi, inode->i_size);
+	return copied;
+}
+
+
+// ospfs_file_mmap(filp, vma)
+//	Linux calls this function to map a regular file into memory.  It is
+//	the file_operations.mmap callback.
+//
+//	writepage runs under the page lock, so it can't start a transaction
+//	to copy a shared block.  Instead, a shared writable mapping gives the
+//	file its own copy of all its shared blocks up front (see Shared
+//	blocks).  Blocks the file gains later are its own.  The file is
+//	marked so that it is never cloned, which would share its blocks
+//	again under the mapping (see ospfs_ioctl).
+
+static int
+ospfs_file_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	int r = 0;
+
+	if (ospfs_refcounts() && (vma->vm_flags & VM_SHARED)
+	    && (vma->vm_flags & VM_MAYWRITE)) {
+		resize_lock(inode);
+		ospfs_inode_info(inode)->ii_wmapped = 1;
+		resize_unlock(inode);
+		r = unshare_file_range(inode, 0, ospfs_size(oi));
+	}
+	return (r < 0 ? r : generic_file_mmap(filp, vma));
+}
+
+
+// ospfs_ioctl(filp, cmd, arg)
+//	Linux calls this function for ioctl()s on a regular file.  It is the
+//	file_operations.unlocked_ioctl callback.  The only request is
+//	OSPFS_IOC_CLONE, which makes 'filp' a clone of the file open on
+//	descriptor 'arg' (see SHARED BLOCKS in ospfs.h and clone_blockmap).
+//
+//   Returns: 0 on success, or < 0 on error.  In particular:
+//		-ENOTTY:     for any other request
+//		-EOPNOTSUPP: if the file system has no reference count table
+//		-EBADF:      unless 'filp' is open for writing and 'arg' is a
+//			     descriptor open for reading
+//		-EXDEV:      if 'arg' is on another file system
+//		-EINVAL:     if 'arg' isn't a regular file, is 'filp' itself,
+//			     or 'filp' isn't empty
+//		-EBUSY:      if either file has been mapped shared and
+//			     writable: writepage couldn't copy a block the
+//			     mapping changes
+//		-EFBIG:      if the clone would change more blocks than
+//			     the journal holds (see clone_credits)
+//		-ENOSPC:     if the disk fills up
+//
+//   Both files' i_mutex keep out writers, which check for shared blocks
+//   under i_mutex (ospfs_write and ospfs_write_begin), and keep the source's
+//   block map as clone_credits saw it.  The i_mutexes are taken in address
+//   order.
+
+static long
+ospfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct inode *inode = filp->f_dentry->d_inode, *src_inode;
+	struct file *src_filp;
+	uint64_t credits;
+	long r;
+
+	if (cmd != OSPFS_IOC_CLONE)
+		return -ENOTTY;
+	if (!ospfs_refcounts())
+		return -EOPNOTSUPP;
+	if (!(filp->f_mode & FMODE_WRITE) || !(src_filp = fget(arg)))
+		return -EBADF;
+	src_inode = src_filp->f_dentry->d_inode;
+	if (!(src_filp->f_mode & FMODE_READ)) {
+		r = -EBADF;
+		goto out_fput;
+	} else if (src_inode->i_sb != inode->i_sb) {
+		r = -EXDEV;
+		goto out_fput;
+	} else if (!S_ISREG(src_inode->i_mode) || src_inode == inode) {
+		r = -EINVAL;
+		goto out_fput;
+	}
+
+	if (src_inode < inode) {
+		mutex_lock(&src_inode->i_mutex);
+		mutex_lock_nested(&inode->i_mutex, I_MUTEX_CHILD);
+	} else {
+		mutex_lock(&inode->i_mutex);
+		mutex_lock_nested(&src_inode->i_mutex, I_MUTEX_CHILD);
+	}
+	// A clone is one operation, so it must fit in one transaction
+	down_read(ospfs_inode_sem(src_inode));
+	credits = clone_credits(ospfs_inode(src_inode->i_ino));
+	up_read(ospfs_inode_sem(src_inode));
+	if (journal_cap && credits > journal_cap) {
+		r = -EFBIG;
+		goto out_unlock;
+	}
+
+	journal_start(credits);
+	down_read(ospfs_inode_sem(src_inode));
+	resize_lock(inode);
+
+	if (ospfs_inode_info(inode)->ii_wmapped
+	    || ospfs_inode_info(src_inode)->ii_wmapped)
+		r = -EBUSY;
+	else if (ospfs_size(ospfs_inode(inode->i_ino)) != 0)
+		r = -EINVAL;
+	else if ((r = clone_blockmap(ospfs_inode(inode->i_ino),
+				     ospfs_inode(src_inode->i_ino))) == 0)
+		resize_publish(inode, ospfs_size(ospfs_inode(inode->i_ino)));
+
+	resize_unlock(inode);
+	up_read(ospfs_inode_sem(src_inode));
+	journal_stop(credits, 1);
+    out_unlock:
+	mutex_unlock(&src_inode->i_mutex);
+	mutex_unlock(&inode->i_mutex);
+    out_fput:
+	fput(src_filp);
+	return r;
+}
+
+
+// find_direntry(dir, name, namelen, entry_off)
 //	Looks through the directory to find an entry with name 'name' (length
 //	in characters 'namelen').  Returns a pointer to the directory entry,
 //	if one exists, or NULL if one does not.
 //
-//   Inputs:  dir_oi  -- the OSP inode for the directory
-//	      name    -- name to search for
-//	      namelen -- length of 'name'.  (If -1, then use strlen(name).)
+//   Inputs:  dir       -- the Linux inode for the directory, whose
+//			   i_mutex the caller holds
+//	      name      -- name to search for
+//	      namelen   -- length of 'name'.  (If -1, then use strlen(name).)
+//	      entry_off -- if not NULL, set to the offset of the entry found
 //
-//	We have written this function for you.
+//	The directory's hash index is used if possible (see DIRECTORY INDEX
+//	above); otherwise the directory is searched entry by entry.
 
 static ospfs_direntry_t *
-find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen)
+find_direntry(struct inode *dir, const char *name, int namelen, uint32_t *entry_off)
 {
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
+	ospfs_dirindex_t *di = dirindex_get(dir);
 	int off;
 	if (namelen < 0)
 		namelen = strlen(name);
+
+	if (di) {
+		uint32_t hash = full_name_hash((const unsigned char *) name, namelen);
+		ospfs_dirindex_entry_t *de;
+		for (de = di->di_buckets[hash & (di->di_nbuckets - 1)]; de;
+		     de = de->de_next) {
+			ospfs_direntry_t *od;
+			if (de->de_hash != hash)
+				continue;
+			od = ospfs_inode_data(dir_oi, de->de_off);
+			if (od->od_ino
+			    && memcmp(od->od_name, name, namelen) == 0
+			    && od->od_name[namelen] == '\0') {
+				if (entry_off)
+					*entry_off = de->de_off;
+				return od;
+			}
+		}
+		return 0;
+	}
+
 	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
 		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
 		if (od->od_ino
-		    && strlen(od->od_name) == namelen
-		    && memcmp(od->od_name, name, namelen) == 0)
+		    && memcmp(od->od_name, name, namelen) == 0
+		    && od->od_name[namelen] == '\0') {
+			if (entry_off)
+				*entry_off = off;
 			return od;
+		}
 	}
 	return 0;
 }
 
 
-// create_blank_direntry(dir_oi)
-//	'dir_oi' is an OSP inode for a directory.
-//	Return a blank directory entry in that directory.  This might require
-//	adding a new block to the directory.  Returns an error pointer (see
-//	below) on failure.
+// create_blank_direntry(dir, entry_off)
+//	'dir' is the Linux inode for a directory, whose i_mutex the caller
+//	holds.
+//	Return a blank directory entry in that directory, and set '*entry_off'
+//	to its offset.  This might require adding a new block to the
+//	directory.  Returns an error pointer (see below) on failure.
+//	If the directory has a hash index, the search starts at the index's
+//	free-entry hint instead of at the beginning of the directory.
 //
 // ERROR POINTERS: The Linux kernel uses a special convention for returning
 // error values in the form of pointers.  Here's how it works.
@@ -1426,7 +4549,7 @@ find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen)
 // COMPLETED EXERCISE: Write this function.
 
 static ospfs_direntry_t *
-create_blank_direntry(ospfs_inode_t *dir_oi)
+create_blank_direntry(struct inode *dir, uint32_t *entry_off)
 {
 	// Outline:
 	// 1. Check the existing directory data for an empty entry.  Return one
@@ -1435,22 +4558,31 @@ create_blank_direntry(ospfs_inode_t *dir_oi)
 	//    Use ERR_PTR if this fails; otherwise, clear out all the directory
 	//    entries and return one of them.
 	
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
 	uint32_t new_size;
 	ospfs_direntry_t *od;
+	ospfs_dirindex_t *di;
 	int retval = 0, offset;
 	
 	if (dir_oi->oi_ftype != OSPFS_FTYPE_DIR) {
 		return ERR_PTR(-EIO);
 	}
 	
-	for (offset = 0; offset < dir_oi->oi_size; offset += OSPFS_DIRENTRY_SIZE) {
+	di = dirindex_find(dir);
+	for (offset = (di ? di->di_freehint : 0); offset < dir_oi->oi_size;
+	     offset += OSPFS_DIRENTRY_SIZE) {
 		od = ospfs_inode_data(dir_oi, offset);
 		//See the header ospfs_direntry. It says that:
 		//If the inode number is 0, then the directory entry is EMPTY
 		if (od->od_ino == 0) {
+			if (di)
+				di->di_freehint = offset;
+			*entry_off = offset;
 			return od;
 		}
 	}
+	if (di)
+		di->di_freehint = offset;
 	
 	// If no free entries were found, add a block
 	// ospfs_size2nblocks(size) returns the number of blocks required to hold 'size' bytes of data.
@@ -1465,6 +4597,7 @@ create_blank_direntry(ospfs_inode_t *dir_oi)
 	
 	//Note that in the above loop, offset stops when it is greater than or equal to dir_oi->oi_size.
 	//Now, we change the size, we don't need to add anything to offset.
+	*entry_off = offset;
 	return ospfs_inode_data(dir_oi, offset);
 }
 
@@ -1504,6 +4637,7 @@ ospfs_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dent
 	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
 	ospfs_inode_t *src_oi = ospfs_inode(src_dentry->d_inode->i_ino);
 	ospfs_direntry_t *new_entry;
+	uint32_t entry_off;
 	
 	// Some error handling code. See the function header requirement above.
 	
@@ -1515,14 +4649,14 @@ ospfs_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dent
 		return -ENAMETOOLONG;
 	}
 	
-	if (find_direntry(dir_oi, dst_dentry->d_name.name, dst_dentry->d_name.len) != NULL) {
+	if (find_direntry(dir, dst_dentry->d_name.name, dst_dentry->d_name.len, NULL) != NULL) {
 		return -EEXIST;
 	}
 	
 	// Since this is hard link. inode structure are the same for both original file and the hard link
 	// We only need to allocate a new directory entry for the hard link.
 	
-	new_entry = create_blank_direntry(dir_oi);
+	new_entry = create_blank_direntry(dir, &entry_off);
 	
 	if (IS_ERR(new_entry)) {
 		return PTR_ERR(new_entry);
@@ -1536,10 +4670,16 @@ ospfs_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dent
 	new_entry->od_ino = src_dentry->d_inode->i_ino;
 	memcpy(new_entry->od_name, dst_dentry->d_name.name, dst_dentry->d_name.len);
 	new_entry->od_name[dst_dentry->d_name.len] = '\0';
+	ospfs_block_dirty(ospfs_inode_blockno(dir_oi, entry_off));
+	dirindex_add(dir, entry_off, dst_dentry->d_name.name, dst_dentry->d_name.len);
 	
 	// Increase the link count on the source file.
 	// Note that we can only have hard link on regular file.
 	src_oi->oi_nlink++;
+	ospfs_inode_dirty(src_oi);
+	inc_nlink(src_dentry->d_inode);
+	atomic_inc(&src_dentry->d_inode->i_count);
+	d_instantiate(dst_dentry, src_dentry->d_inode);
 	
 	return 0;
 }
@@ -1578,6 +4718,7 @@ ospfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidat
 {
 	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino); // load ospfs_inode structure from disk
 	uint32_t entry_ino = 0;
+	uint32_t entry_off;
 	
 	ospfs_inode_t *file_oi = NULL;
 	ospfs_direntry_t *new_entry = NULL;
@@ -1592,16 +4733,17 @@ ospfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidat
 		return -ENAMETOOLONG;
 	}
 	
-	if (find_direntry(dir_oi, dentry->d_name.name, dentry->d_name.len) != NULL) { //check if file name already exists
+	if (find_direntry(dir, dentry->d_name.name, dentry->d_name.len, NULL) != NULL) { //check if file name already exists
 		return -EEXIST;
 	}
 	
 	// Step 1: Create a new inode for new file
 	
 	// Get an inode 
-	entry_ino = find_free_inode(); // Tuan: I have this function impelemented above.
+	entry_ino = allocate_inode();
 	// return inode number if it finds a free inode. return 0 otherwise.	
-	// How do we know if an inode is free? when its link count equals 0.	
+	// How do we know if an inode is free? the free-inode index tracks
+	// inodes whose link count equals 0.
 	
 	if(entry_ino == 0) {
 		return -ENOSPC;
@@ -1610,22 +4752,29 @@ ospfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidat
 	file_oi = ospfs_inode(entry_ino); // load ospfs_inode structure from disk
 	
 	if (file_oi == NULL) {
+		free_inode(entry_ino);
 		return -EIO;
 	}
 	
 	// Initialize the new inode structure with correct values
+	// (clearing any block pointers or extents left from its last use)
+	memset(file_oi, 0, sizeof(*file_oi));
 	file_oi->oi_size = 0; //File size
-	file_oi->oi_ftype = OSPFS_FTYPE_REG;
+	file_oi->oi_ftype = (use_extents ? OSPFS_FTYPE_XREG : OSPFS_FTYPE_REG);
 	file_oi->oi_nlink = 1; //Number of hard links
 	file_oi->oi_mode = mode; //File permission mode
+	ospfs_inode_dirty(file_oi);
 	
 	// Step 2: Create a new directory entry for new file
 	
 	// As part of this lab, we need to implement create_blank_direntry
-	new_entry = create_blank_direntry(dir_oi); //create a blank directory entry in that directory
+	new_entry = create_blank_direntry(dir, &entry_off); //create a blank directory entry in that directory
 	//This function returns a pointer to a directory entry which we can modify.
 	
 	if(IS_ERR(new_entry)) {
+		file_oi->oi_nlink = 0;
+		ospfs_inode_dirty(file_oi);
+		free_inode(entry_ino);
 		return PTR_ERR(new_entry);
 	}
 	
@@ -1633,6 +4782,8 @@ ospfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidat
 	new_entry->od_ino = entry_ino;
 	memcpy(new_entry->od_name, dentry->d_name.name, dentry->d_name.len);
 	new_entry->od_name[dentry->d_name.len] = '\0';
+	ospfs_block_dirty(ospfs_inode_blockno(dir_oi, entry_off));
+	dirindex_add(dir, entry_off, dentry->d_name.name, dentry->d_name.len);
 	
 	/* Execute this code after your function has successfully created the
 	  file.  Set entry_ino to the created file's inode number before
@@ -1675,6 +4826,7 @@ ospfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 
 	ospfs_symlink_inode_t *symlink_ino = NULL; 
 	ospfs_direntry_t *od;
+	uint32_t entry_off;
 
 	char *qmark;
 	char *colon;
@@ -1692,25 +4844,29 @@ ospfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 		return -ENAMETOOLONG;
 
 	// Name in use?
-	else if (find_direntry(dir_oi, dentry->d_name.name, dentry->d_name.len) != NULL)
+	else if (find_direntry(dir, dentry->d_name.name, dentry->d_name.len, NULL) != NULL)
 		return -EEXIST;
 
 	// Determine what inode we can use... helps us detect out of space errors
 	// Start at 2 since the first two inodes are special
-	entry_ino = find_free_inode();
+	entry_ino = allocate_inode();
 	symlink_ino = (ospfs_symlink_inode_t *) ospfs_inode(entry_ino);
 
 	//no free inode found
 	if(entry_ino == 0)
 		return -ENOSPC;
 	//fail getting data
-	if(symlink_ino == NULL)
+	if(symlink_ino == NULL) {
+		free_inode(entry_ino);
 		return -EIO;
+	}
 
 	// Get our new entry
-	od = create_blank_direntry(dir_oi);
-	if (IS_ERR(od))
+	od = create_blank_direntry(dir, &entry_off);
+	if (IS_ERR(od)) {
+		free_inode(entry_ino);
 		return PTR_ERR(od);
+	}
 
 	//strpbrk returns the first instance of appeard character
 	qmark = strpbrk(symname, "?");
@@ -1721,8 +4877,10 @@ ospfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 		size_t root_path_len = colon - qmark + 1;//4
 		size_t other_path_len = strlen(colon);	//7
 
-		if(root_path_len + other_path_len > OSPFS_MAXNAMELEN)
+		if(root_path_len + other_path_len > OSPFS_MAXNAMELEN) {
+			free_inode(entry_ino);
 			return -ENAMETOOLONG;
+		}
 
 		symlink_ino->oi_size = strlen(qmark) + 1;
 		
@@ -1737,8 +4895,10 @@ ospfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 	else // regular symlink
 	{
 		size_t name_len = strlen(symname);
-		if (name_len > OSPFS_MAXSYMLINKLEN)
+		if (name_len > OSPFS_MAXSYMLINKLEN) {
+			free_inode(entry_ino);
 			return -ENAMETOOLONG;
+		}
 
 		symlink_ino->oi_size = name_len;
 		strncpy(symlink_ino->oi_symlink, symname, symlink_ino->oi_size);
@@ -1752,8 +4912,12 @@ ospfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 	strncpy(od->od_name, dentry->d_name.name, dentry->d_name.len);
 	od->od_name[dentry->d_name.len] = 0;
 	od->od_ino = entry_ino;
+	ospfs_block_dirty(ospfs_inode_blockno(dir_oi, entry_off));
+	dirindex_add(dir, entry_off, dentry->d_name.name, dentry->d_name.len);
+	ospfs_inode_dirty((ospfs_inode_t *) symlink_ino);
 
 	dir_oi->oi_nlink++;
+	ospfs_inode_dirty(dir_oi);
 
 	// Instructor-provided code
 	{
@@ -1819,13 +4983,59 @@ ospfs_follow_link(struct dentry *dentry, struct nameidata *nd)
 }
 
 
+// ospfs_journal_link, ospfs_journal_unlink, ospfs_journal_create,
+// ospfs_journal_symlink
+//	The directory inode operations, each run as one journal operation
+//	(see journal_start).
+
+static int
+ospfs_journal_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dentry)
+{
+	int r;
+	journal_start(JOURNAL_OP_CREDITS);
+	r = ospfs_link(src_dentry, dir, dst_dentry);
+	journal_stop(JOURNAL_OP_CREDITS, 1);
+	return r;
+}
+
+static int
+ospfs_journal_unlink(struct inode *dirino, struct dentry *dentry)
+{
+	int r;
+	journal_start(JOURNAL_OP_CREDITS);
+	r = ospfs_unlink(dirino, dentry);
+	journal_stop(JOURNAL_OP_CREDITS, 1);
+	return r;
+}
+
+static int
+ospfs_journal_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidata *nd)
+{
+	int r;
+	journal_start(JOURNAL_OP_CREDITS);
+	r = ospfs_create(dir, dentry, mode, nd);
+	journal_stop(JOURNAL_OP_CREDITS, 1);
+	return r;
+}
+
+static int
+ospfs_journal_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
+{
+	int r;
+	journal_start(JOURNAL_OP_CREDITS);
+	r = ospfs_symlink(dir, dentry, symname);
+	journal_stop(JOURNAL_OP_CREDITS, 1);
+	return r;
+}
+
+
 // Define the file system operations structures mentioned above.
 
 static struct file_system_type ospfs_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "ospfs",
 	.get_sb		= ospfs_get_sb,
-	.kill_sb	= kill_anon_super
+	.kill_sb	= ospfs_kill_sb
 };
 
 static struct inode_operations ospfs_reg_inode_ops = {
@@ -1834,21 +5044,48 @@ static struct inode_operations ospfs_reg_inode_ops = {
 
 static struct file_operations ospfs_reg_file_ops = {
 	.llseek		= generic_file_llseek,
+	.read		= do_sync_read,
+	.aio_read	= generic_file_aio_read,
+	.write		= do_sync_write,
+	.aio_write	= generic_file_aio_write,
+	.mmap		= ospfs_file_mmap,
+	.fsync		= ospfs_fsync,
+	.unlocked_ioctl	= ospfs_ioctl,
+	.splice_read	= generic_file_splice_read,
+	.splice_write	= generic_file_splice_write
+};
+
+static struct file_operations ospfs_reg_direct_file_ops = {
+	.llseek		= generic_file_llseek,
+	.open		= ospfs_open,
+	.release	= ospfs_release,
 	.read		= ospfs_read,
-	.write		= ospfs_write
+	.write		= ospfs_write,
+	.fsync		= ospfs_fsync,
+	.unlocked_ioctl	= ospfs_ioctl
+};
+
+static struct address_space_operations ospfs_aops = {
+	.readpage	= ospfs_readpage,
+	.readpages	= ospfs_readpages,
+	.writepage	= ospfs_writepage,
+	.write_begin	= ospfs_write_begin,
+	.write_end	= ospfs_write_end,
+	.set_page_dirty	= __set_page_dirty_nobuffers
 };
 
 static struct inode_operations ospfs_dir_inode_ops = {
 	.lookup		= ospfs_dir_lookup,
-	.link		= ospfs_link,
-	.unlink		= ospfs_unlink,
-	.create		= ospfs_create,
-	.symlink	= ospfs_symlink
+	.link		= ospfs_journal_link,
+	.unlink		= ospfs_journal_unlink,
+	.create		= ospfs_journal_create,
+	.symlink	= ospfs_journal_symlink
 };
 
 static struct file_operations ospfs_dir_file_ops = {
 	.read		= generic_read_dir,
-	.readdir	= ospfs_dir_readdir
+	.readdir	= ospfs_dir_readdir,
+	.fsync		= ospfs_fsync
 };
 
 static struct inode_operations ospfs_symlink_inode_ops = {
@@ -1861,6 +5098,11 @@ static struct dentry_operations ospfs_dentry_ops = {
 };
 
 static struct super_operations ospfs_superblock_ops = {
+	.alloc_inode	= ospfs_alloc_inode,
+	.destroy_inode	= ospfs_destroy_inode,
+	.delete_inode	= ospfs_delete_inode,
+	.put_super	= ospfs_put_super,
+	.sync_fs	= ospfs_sync_fs
 };
 
 
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/****************************************************************************
+ * readbench
+ *
+ *   Measures how read throughput on one file scales with the number of
+ *   reading threads.  Run it on a file in a mounted OSPFS: ospfs_read and
+ *   readpage take no lock (see LOCKING in ospfsmod.c), so the total should
+ *   grow with the thread count until the CPUs or memory bandwidth run out.
+ *
+ *   For 1, 2, 4, ... threads up to the maximum, every thread reads the
+ *   file sequentially with pread on one shared descriptor, each starting
+ *   at a different offset and wrapping at the end, for a fixed time.
+ *
+ ****************************************************************************/
+
+int fd;
+off_t filesize;
+size_t bufsize = 65536;
+volatile int stop;
+
+struct reader {
+	pthread_t thread;
+	off_t pos;
+	uint64_t nbytes;
+};
+
+void *
+reader(void *arg)
+{
+	struct reader *r = arg;
+	char *buf = malloc(bufsize);
+	ssize_t n;
+
+	if (!buf) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	while (!stop) {
+		if ((n = pread(fd, buf, bufsize, r->pos)) < 0) {
+			perror("pread");
+			exit(1);
+		}
+		r->nbytes += n;
+		r->pos += n;
+		if (n == 0 || r->pos >= filesize)
+			r->pos = 0;
+	}
+	free(buf);
+	return NULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// measure(readers, nthreads, seconds)
+//	Runs 'nthreads' readers for 'seconds' seconds and prints their total
+//	throughput.
+void
+measure(struct reader *readers, long nthreads, long seconds)
+{
+	uint64_t total = 0;
+	double start, elapsed;
+	long i;
+
+	stop = 0;
+	start = now();
+	for (i = 0; i < nthreads; i++) {
+		readers[i].pos = (filesize / nthreads * i) & ~((off_t) 4095);
+		readers[i].nbytes = 0;
+		if ((errno = pthread_create(&readers[i].thread, NULL, reader, &readers[i]))) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(readers[i].thread, NULL);
+		total += readers[i].nbytes;
+	}
+	elapsed = now() - start;
+
+	printf("%8ld %12.1f %12.1f\n", nthreads, total / elapsed / 1e6,
+	       total / elapsed / 1e6 / nthreads);
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "Usage: readbench [-t MAXTHREADS] [-s SECONDS] [-b BUFSIZE] FILE\n\
+  \"-t MAXTHREADS\" means try up to MAXTHREADS threads (default: one per CPU).\n\
+  \"-s SECONDS\" means read for SECONDS seconds at each thread count (default 2).\n\
+  \"-b BUFSIZE\" means read BUFSIZE bytes per call (default 65536).\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	long maxthreads = sysconf(_SC_NPROCESSORS_ONLN), seconds = 2;
+	long size = bufsize, *opt;
+	struct reader *readers;
+	struct stat st;
+	long nthreads;
+	char *s;
+
+	while (argc > 2 && argv[1][0] == '-' && strlen(argv[1]) == 2) {
+		if (argv[1][1] == 't')
+			opt = &maxthreads;
+		else if (argv[1][1] == 's')
+			opt = &seconds;
+		else if (argv[1][1] == 'b')
+			opt = &size;
+		else
+			usage();
+		*opt = strtol(argv[2], &s, 0);
+		if (*s || s == argv[2] || *opt < 1)
+			usage();
+		argc -= 2, argv += 2;
+	}
+	if (argc != 2)
+		usage();
+	if (maxthreads < 1)
+		maxthreads = 1;
+	bufsize = size;
+
+	if ((fd = open(argv[1], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(argv[1]);
+		exit(2);
+	}
+	if ((filesize = st.st_size) == 0) {
+		fprintf(stderr, "%s: empty file\n", argv[1]);
+		exit(2);
+	}
+	if (!(readers = calloc(maxthreads, sizeof(*readers)))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	printf("%s: %jd bytes, %zu-byte reads, %ld s per thread count\n",
+	       argv[1], (intmax_t) filesize, bufsize, seconds);
+	printf("%8s %12s %12s\n", "threads", "total MB/s", "MB/s/thread");
+	for (nthreads = 1; nthreads < maxthreads; nthreads *= 2)
+		measure(readers, nthreads, seconds);
+	measure(readers, maxthreads, seconds);
+	return 0;
+}